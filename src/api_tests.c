@@ -0,0 +1,750 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "drachen.h"
+
+/* Tests of parts of the library which drachencode does not reach. Run by
+ * run_tests from the top of the source tree; each test writes its archive
+ * to test.api.
+ */
+
+#define ARCHIVE "test.api"
+
+static int failures;
+
+#define CHECK(cond) do {                                                \
+    if (!(cond)) {                                                      \
+      fprintf(stderr, "%s:%d: check failed: %s\n",                      \
+              __FILE__, __LINE__, #cond);                               \
+      ++failures;                                                       \
+    }                                                                   \
+  } while (0)
+
+/* Fills frame with content which changes a little from frame k to the
+ * next.
+ */
+static void make_frame(unsigned char* frame, uint32_t size, unsigned k) {
+  uint32_t i;
+
+  for (i = 0; i < size; ++i)
+    frame[i] = (unsigned char)(i/7 + (i % 13 == k % 13? k*3 : 0));
+}
+
+/* Writes the num_frames frames of the given size which follow each other in
+ * frames to ARCHIVE, named f0, f1, and so on, with the given transform (or
+ * NULL for the identity). Returns 0 or an error code.
+ */
+static int write_frames(const unsigned char* frames, uint32_t size,
+                        unsigned num_frames, const uint32_t* xform,
+                        const drachen_stream_params* params,
+                        const drachen_block_spec* blocks,
+                        int optimal_segments) {
+  drachen_encoder* enc;
+  FILE* out = fopen(ARCHIVE, "wb");
+  char name[16];
+  unsigned k;
+  int status;
+
+  if (!out) return errno;
+  enc = drachen_create_encoder_ex(out, size, xform, params);
+  if (!enc) return ENOMEM;
+  if (blocks) drachen_set_block_size(enc, blocks);
+  drachen_set_optimal_segments(enc, optimal_segments);
+
+  status = drachen_error(enc);
+  for (k = 0; k < num_frames && !status; ++k) {
+    sprintf(name, "f%u", k);
+    status = drachen_encode(enc, frames + (size_t)k*size, name);
+  }
+
+  if (drachen_free(enc) && !status)
+    status = errno;
+  return status;
+}
+
+/* Writes num_frames frames of the given size, as made by make_frame(), to
+ * ARCHIVE. Returns 0 or an error code.
+ */
+static int write_archive(uint32_t size, unsigned num_frames,
+                         const drachen_stream_params* params,
+                         const drachen_block_spec* blocks,
+                         int optimal_segments) {
+  unsigned char* frames = malloc((size_t)size * num_frames);
+  unsigned k;
+  int status;
+
+  if (!frames) return ENOMEM;
+  for (k = 0; k < num_frames; ++k)
+    make_frame(frames + (size_t)k*size, size, k);
+
+  status = write_frames(frames, size, num_frames, NULL, params, blocks,
+                        optimal_segments);
+  free(frames);
+  return status;
+}
+
+/* Returns a decoder for ARCHIVE restricted to its first 16 bytes */
+static drachen_encoder* open_roi_decoder(void) {
+  static const drachen_range range = { 0, 16 };
+  drachen_encoder* dec = drachen_create_decoder(fopen(ARCHIVE, "rb"), 0);
+
+  if (!dec) return NULL;
+  CHECK(!drachen_error(dec));
+  CHECK(!drachen_set_roi(dec, &range, 1));
+  return dec;
+}
+
+/* Decoders with a region of interest only hold that much of each frame, so
+ * everything which needs whole frames must refuse to run.
+ */
+static void test_roi_misuse(void) {
+  const uint32_t size = 4096;
+  unsigned char* frame = malloc(size * 2);
+  drachen_encoder* dec;
+  drachen_range changes[4];
+  uint32_t n;
+  char name[16];
+
+  CHECK(frame && !write_archive(size, 3, NULL, NULL, 0));
+
+  CHECK((dec = open_roi_decoder()));
+  CHECK(drachen_decode(frame, name, sizeof(name), dec) == EINVAL);
+  drachen_free(dec);
+
+  CHECK((dec = open_roi_decoder()));
+  CHECK(drachen_decode_batch(frame, 2, &n, NULL, 0, NULL, dec) == EINVAL);
+  CHECK(n == 0);
+  drachen_free(dec);
+
+  CHECK((dec = open_roi_decoder()));
+  CHECK(drachen_verify(name, sizeof(name), dec) == EINVAL);
+  drachen_free(dec);
+
+  CHECK((dec = open_roi_decoder()));
+  CHECK(drachen_decode_changes(frame, name, sizeof(name), changes, 4, &n,
+                               dec) == EINVAL);
+  drachen_free(dec);
+
+  CHECK((dec = open_roi_decoder()));
+  CHECK(drachen_encode(dec, frame, "x") == EINVAL);
+  drachen_free(dec);
+
+  /* Which leaves the region itself intact */
+  CHECK((dec = open_roi_decoder()));
+  CHECK(!drachen_decode_roi(frame, name, sizeof(name), dec));
+  CHECK(!strcmp(name, "f0"));
+  make_frame(frame + size, size, 0);
+  CHECK(!memcmp(frame, frame + size, 16));
+  drachen_free(dec);
+
+  free(frame);
+}
+
+/* Decodes every frame of ARCHIVE, checking it against make_frame() */
+static void check_archive(uint32_t size, unsigned num_frames) {
+  unsigned char* frame = malloc(size * 2);
+  drachen_encoder* dec = drachen_create_decoder(fopen(ARCHIVE, "rb"), size);
+  char name[16];
+  unsigned k;
+
+  CHECK(frame && dec && !drachen_error(dec));
+  for (k = 0; k < num_frames; ++k) {
+    CHECK(!drachen_decode(frame, name, sizeof(name), dec));
+    make_frame(frame + size, size, k);
+    CHECK(!memcmp(frame, frame + size, size));
+  }
+  CHECK(drachen_decode(frame, name, sizeof(name), dec) ==
+        DRACHEN_END_OF_STREAM);
+
+  drachen_free(dec);
+  free(frame);
+}
+
+/* Segments of every length around the limits of the length forms must
+ * survive, whether they come from blocks of that size or from optimal
+ * segmentation.
+ */
+static void test_segment_lengths(void) {
+  static const uint32_t sizes[] = { 257, 258, 259, 65794, 65795 };
+  drachen_block_spec blocks[1];
+  unsigned i;
+
+  blocks[0].segment_end = 0xFFFFFFFFu;
+  for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); ++i) {
+    blocks[0].block_size = sizes[i];
+    CHECK(!write_archive(sizes[i], 4, NULL, blocks, 0));
+    check_archive(sizes[i], 4);
+  }
+
+  blocks[0].block_size = 30;
+  CHECK(!write_archive(288, 12, NULL, blocks, 1));
+  check_archive(288, 12);
+  CHECK(!write_archive(272, 12, NULL, blocks, 1));
+  check_archive(272, 12);
+}
+
+/* Stores into expected the ranges drachen_decode_changes() should report
+ * for the bytes which differ between prev and curr, given room for
+ * max_changes, and returns how many there are.
+ */
+static uint32_t expected_changes(drachen_range* expected, uint32_t max_changes,
+                                 const unsigned char* prev,
+                                 const unsigned char* curr, uint32_t size) {
+  uint32_t n = 0, i;
+
+  for (i = 0; i < size; ++i) {
+    if (prev[i] == curr[i]) continue;
+    if (n && (expected[n-1].end == i || n == max_changes)) {
+      expected[n-1].end = i+1;
+    } else {
+      expected[n].begin = i;
+      expected[n].end = i+1;
+      ++n;
+    }
+  }
+
+  return n;
+}
+
+/* With one-byte blocks, only the bytes which were edited are encoded as
+ * anything other than a copy of the previous frame (as long as none are zero,
+ * which may be stored as zero rather than copied), so the changes reported
+ * (mapped back through the inverse of a transform which reorders every byte)
+ * must be exactly those bytes, merged and cut off as documented.
+ */
+static void test_decode_changes(void) {
+  enum { COLS = 20, ROWS = 10, SIZE = COLS*ROWS*3, NUM_FRAMES = 5 };
+  static const uint32_t max_changes[NUM_FRAMES] = { 64, 64, 64, 3, 1 };
+  unsigned char* frames = malloc(SIZE * NUM_FRAMES);
+  unsigned char buffer[SIZE], zero[SIZE];
+  uint32_t xform[SIZE], n, expected_n, i;
+  drachen_range changes[64], expected[64];
+  drachen_block_spec blocks[1];
+  drachen_encoder* dec;
+  unsigned k;
+  char name[16];
+
+  CHECK(frames != NULL);
+  if (!frames) return;
+  drachen_make_image_xform_matrix(xform, 0, COLS, ROWS, 3, 4, 4);
+
+  /* f1 edits a few bytes, two of them adjacent; f2 is unchanged; f3 and f4
+   * edit more places than there is room to report.
+   */
+  for (i = 0; i < SIZE; ++i)
+    frames[i] = (unsigned char)(i/3 + 1);
+  for (k = 1; k < NUM_FRAMES; ++k) {
+    memcpy(frames + k*SIZE, frames + (k-1)*SIZE, SIZE);
+    if (k == 1) {
+      frames[SIZE + 5] += 1;
+      frames[SIZE + 6] += 1;
+      frames[SIZE + 100] += 7;
+      frames[SIZE + 301] ^= 0x40;
+      frames[SIZE + SIZE-1] += 1;
+    } else if (k >= 3) {
+      for (i = k; i < SIZE; i += 47)
+        frames[k*SIZE + i] += k;
+    }
+  }
+
+  blocks[0].segment_end = 0xFFFFFFFFu;
+  blocks[0].block_size = 1;
+  CHECK(!write_frames(frames, SIZE, NUM_FRAMES, xform, NULL, blocks, 0));
+
+  dec = drachen_create_decoder(fopen(ARCHIVE, "rb"), SIZE);
+  CHECK(dec && !drachen_error(dec));
+  if (!dec) {
+    free(frames);
+    return;
+  }
+
+  memset(zero, 0, SIZE);
+  memset(buffer, 0, SIZE);
+  for (k = 0; k < NUM_FRAMES; ++k) {
+    CHECK(!drachen_decode_changes(buffer, name, sizeof(name), changes,
+                                  max_changes[k], &n, dec));
+    CHECK(!memcmp(buffer, frames + k*SIZE, SIZE));
+    expected_n = expected_changes(expected, max_changes[k],
+                                  k? frames + (k-1)*SIZE : zero,
+                                  frames + k*SIZE, SIZE);
+    CHECK(n == expected_n);
+    CHECK(!memcmp(changes, expected, sizeof(drachen_range) *
+                  (n < expected_n? n : expected_n)));
+  }
+  CHECK(drachen_decode_changes(buffer, name, sizeof(name), changes, 64, &n,
+                               dec) == DRACHEN_END_OF_STREAM);
+  CHECK(n == 0);
+
+  drachen_free(dec);
+  free(frames);
+}
+
+/* Decodes ARCHIVE, which holds the num_frames frames in expected, in
+ * batches of up to batch frames, which need not divide num_frames.
+ */
+static void check_batches(const unsigned char* expected, uint32_t size,
+                          unsigned num_frames, unsigned batch) {
+  unsigned char* frames = malloc((size_t)size * batch);
+  drachen_encoder* dec = drachen_create_decoder(fopen(ARCHIVE, "rb"), size);
+  char names[64], name[16];
+  uint32_t offsets[8], n, j, pos;
+  unsigned k = 0;
+
+  CHECK(frames && dec && !drachen_error(dec) && batch <= 8);
+  if (!frames || !dec) {
+    free(frames);
+    if (dec) drachen_free(dec);
+    return;
+  }
+
+  while (k < num_frames) {
+    CHECK(!drachen_decode_batch(frames, batch, &n, names, sizeof(names),
+                                offsets, dec));
+    CHECK(n == (num_frames - k < batch? num_frames - k : batch));
+    if (!n) break;
+
+    for (j = pos = 0; j < n; ++j, ++k) {
+      CHECK(!memcmp(frames + (size_t)j*size, expected + (size_t)k*size,
+                    size));
+      sprintf(name, "f%u", k);
+      CHECK(offsets[j] == pos && !strcmp(names + pos, name));
+      pos += strlen(name) + 1;
+    }
+  }
+
+  CHECK(drachen_decode_batch(frames, batch, &n, names, sizeof(names),
+                             offsets, dec) == DRACHEN_END_OF_STREAM);
+  CHECK(n == 0);
+
+  drachen_free(dec);
+  free(frames);
+}
+
+/* Frames decoded in batches must come out as they were encoded, through
+ * the identity transform (which decodes straight into the caller's buffer,
+ * predicting from the frames before within it, or two frames back with
+ * DRACHEN_FEATURE_LINEAR) and through any other. Names are packed into the
+ * shared buffer until it runs out.
+ */
+static void test_decode_batch(void) {
+  enum { COLS = 10, ROWS = 10, SIZE = COLS*ROWS*3, NUM_FRAMES = 11 };
+  unsigned char* frames = malloc((size_t)SIZE * NUM_FRAMES);
+  uint32_t xform[SIZE], offsets[4], n;
+  drachen_stream_params params;
+  drachen_encoder* dec;
+  char names[8];
+  unsigned k, i;
+
+  /* Half of each frame ramps, so that LINEAR is used for it */
+  CHECK(frames != NULL);
+  if (!frames) return;
+  for (k = 0; k < NUM_FRAMES; ++k) {
+    make_frame(frames + (size_t)k*SIZE, SIZE, k);
+    for (i = 0; i < SIZE/2; ++i)
+      frames[(size_t)k*SIZE + i] = (unsigned char)(i/7 + k*(i%5));
+  }
+
+  CHECK(!write_frames(frames, SIZE, NUM_FRAMES, NULL, NULL, NULL, 0));
+  check_batches(frames, SIZE, NUM_FRAMES, 4);
+  check_batches(frames, SIZE, NUM_FRAMES, 1);
+
+  drachen_default_stream_params(&params);
+  params.features = DRACHEN_FEATURE_LINEAR;
+  CHECK(!write_frames(frames, SIZE, NUM_FRAMES, NULL, &params, NULL, 0));
+  check_batches(frames, SIZE, NUM_FRAMES, 4);
+  check_batches(frames, SIZE, NUM_FRAMES, 3);
+
+  drachen_make_image_xform_matrix(xform, 0, COLS, ROWS, 3, 4, 4);
+  CHECK(!write_frames(frames, SIZE, NUM_FRAMES, xform, &params, NULL, 0));
+  check_batches(frames, SIZE, NUM_FRAMES, 4);
+
+  /* f0 and f1 fit, f2 is cut short, and f3 gets the empty name at the end */
+  dec = drachen_create_decoder(fopen(ARCHIVE, "rb"), SIZE);
+  CHECK(dec && !drachen_error(dec));
+  if (dec) {
+    CHECK(!drachen_decode_batch(frames, 4, &n, names, sizeof(names), offsets,
+                                dec));
+    CHECK(n == 4);
+    CHECK(offsets[0] == 0 && !strcmp(names + offsets[0], "f0"));
+    CHECK(offsets[1] == 3 && !strcmp(names + offsets[1], "f1"));
+    CHECK(offsets[2] == 6 && !strcmp(names + offsets[2], "f"));
+    CHECK(offsets[3] == 7 && !strcmp(names + offsets[3], ""));
+    drachen_free(dec);
+  }
+
+  free(frames);
+}
+
+/* Writes the num_frames frames in frames to ARCHIVE with two reference
+ * slots and checksums, pinning frame 0 to slot 0 if pin is set, and stores
+ * the number of bytes each frame took into lens.
+ */
+static int write_pinned(const unsigned char* frames, uint32_t size,
+                        unsigned num_frames, int pin, long* lens) {
+  drachen_stream_params params;
+  drachen_encoder* enc;
+  FILE* out = fopen(ARCHIVE, "wb");
+  char name[16];
+  long pos;
+  unsigned k;
+  int status;
+
+  if (!out) return errno;
+  drachen_default_stream_params(&params);
+  params.features = DRACHEN_FEATURE_REFERENCES | DRACHEN_FEATURE_CRC32C;
+  params.num_references = 2;
+  enc = drachen_create_encoder_ex(out, size, NULL, &params);
+  if (!enc) return ENOMEM;
+
+  status = drachen_error(enc);
+  if (!status && pin)
+    status = drachen_pin_frame(enc, 0);
+  pos = ftell(out);
+  for (k = 0; k < num_frames && !status; ++k) {
+    sprintf(name, "f%u", k);
+    status = drachen_encode(enc, frames + (size_t)k*size, name);
+    lens[k] = ftell(out) - pos;
+    pos += lens[k];
+  }
+
+  if (drachen_free(enc) && !status)
+    status = errno;
+  return status;
+}
+
+/* A pinned frame stays in its slot however many other frames pass through
+ * the others, so that when it recurs it is written as a duplicate: just its
+ * name, the control byte and the checksum. So is a repeat of the previous
+ * frame.
+ */
+static void test_pin_frame(void) {
+  enum { SIZE = 256, NUM_FRAMES = 11 };
+  unsigned char* frames = malloc((size_t)SIZE * NUM_FRAMES);
+  long lens[NUM_FRAMES];
+  drachen_stream_params params;
+  drachen_encoder* enc;
+  unsigned k;
+
+  CHECK(frames != NULL);
+  if (!frames) return;
+
+  /* f0 is the pinned frame, f1 to f8 are all different, f9 repeats f0 and
+   * f10 repeats f9.
+   */
+  memset(frames, 0xA5, SIZE);
+  for (k = 1; k < 9; ++k)
+    make_frame(frames + (size_t)k*SIZE, SIZE, k);
+  memcpy(frames + (size_t)9*SIZE, frames, SIZE);
+  memcpy(frames + (size_t)10*SIZE, frames, SIZE);
+
+  CHECK(!write_pinned(frames, SIZE, NUM_FRAMES, 1, lens));
+  CHECK(lens[9] == (long)sizeof("f9") + 1 + 4);
+  CHECK(lens[10] == (long)sizeof("f10") + 1 + 4);
+  check_batches(frames, SIZE, NUM_FRAMES, 1);
+
+  /* Unpinned, f0 is long gone from the references by f9 */
+  CHECK(!write_pinned(frames, SIZE, NUM_FRAMES, 0, lens));
+  CHECK(lens[9] > (long)sizeof("f9") + 1 + 4);
+  CHECK(lens[10] == (long)sizeof("f10") + 1 + 4);
+  check_batches(frames, SIZE, NUM_FRAMES, 1);
+
+  /* There is no slot 2, nor any slot without references */
+  drachen_default_stream_params(&params);
+  params.features = DRACHEN_FEATURE_REFERENCES;
+  params.num_references = 2;
+  enc = drachen_create_encoder_ex(fopen(ARCHIVE, "wb"), SIZE, NULL, &params);
+  CHECK(enc && !drachen_error(enc));
+  if (enc) {
+    CHECK(drachen_pin_frame(enc, 2) == EINVAL);
+    drachen_free(enc);
+  }
+
+  enc = drachen_create_encoder(fopen(ARCHIVE, "wb"), SIZE, NULL);
+  CHECK(enc && !drachen_error(enc));
+  if (enc) {
+    CHECK(drachen_pin_frame(enc, 0) == EINVAL);
+    drachen_free(enc);
+  }
+
+  free(frames);
+}
+
+/* A decoder in follow mode, reading an archive which grows a byte at a time,
+ * must report DRACHEN_END_OF_STREAM whenever it reaches a partial frame, and
+ * read that frame again whole once the rest of it has arrived, with every
+ * feature which keeps state between frames.
+ */
+static void test_follow(void) {
+  enum { SIZE = 512, NUM_FRAMES = 6 };
+  unsigned char* frames = malloc((size_t)SIZE * (NUM_FRAMES + 1));
+  unsigned char* archive = NULL;
+  drachen_stream_params params;
+  drachen_encoder* enc, * dec = NULL;
+  long ends[NUM_FRAMES], header_len = 0, len = 0, pos;
+  FILE* out = fopen(ARCHIVE, "wb"), * in;
+  char name[16], expected[16];
+  unsigned k, i, j;
+
+  CHECK(frames && out);
+  if (!frames || !out) goto finish;
+
+  /* Frames which ramp, then return to f1 from a reference and stay there */
+  for (k = 0; k < NUM_FRAMES; ++k) {
+    j = k >= 4? 1 : k;
+    make_frame(frames + (size_t)k*SIZE, SIZE, j);
+    for (i = 0; i < SIZE/4; ++i)
+      frames[(size_t)k*SIZE + i] = (unsigned char)(j*(i%3));
+  }
+
+  drachen_default_stream_params(&params);
+  params.features = DRACHEN_FEATURE_CRC32C | DRACHEN_FEATURE_NAME_DELTA |
+    DRACHEN_FEATURE_ENTROPY | DRACHEN_FEATURE_COMPACT_SEGMENTS |
+    DRACHEN_FEATURE_REFERENCES | DRACHEN_FEATURE_LINEAR |
+    DRACHEN_FEATURE_BACKGROUND;
+  params.num_references = 3;
+  params.background_shift = 2;
+  enc = drachen_create_encoder_ex(out, SIZE, NULL, &params);
+  CHECK(enc && !drachen_error(enc));
+  if (!enc) goto finish;
+
+  header_len = ftell(out);
+  for (k = 0; k < NUM_FRAMES; ++k) {
+    sprintf(name, "f%u", k);
+    CHECK(!drachen_encode(enc, frames + (size_t)k*SIZE, name));
+    ends[k] = ftell(out);
+  }
+  CHECK(!drachen_free(enc));
+
+  /* Start again with only the header, and feed the rest in byte by byte */
+  in = fopen(ARCHIVE, "rb");
+  len = ends[NUM_FRAMES-1];
+  archive = malloc(len);
+  CHECK(in && archive && fread(archive, len, 1, in));
+  if (in) fclose(in);
+  out = fopen(ARCHIVE, "wb");
+  CHECK(out && fwrite(archive, header_len, 1, out) && !fflush(out));
+  if (!out) goto finish;
+
+  dec = drachen_create_decoder(fopen(ARCHIVE, "rb"), SIZE);
+  CHECK(dec && !drachen_error(dec));
+  if (!dec) goto finish;
+  drachen_set_follow(dec, 1);
+
+  CHECK(drachen_decode(frames + (size_t)NUM_FRAMES*SIZE, name, sizeof(name),
+                       dec) == DRACHEN_END_OF_STREAM);
+  CHECK(!drachen_wait_for_data(dec, 0));
+  CHECK(!drachen_wait_for_data(dec, 0));
+
+  for (pos = header_len, k = 0; pos < len; ++pos) {
+    CHECK(EOF != fputc(archive[pos], out) && !fflush(out));
+    if (pos+1 < ends[k]) {
+      CHECK(drachen_decode(frames + (size_t)NUM_FRAMES*SIZE, name,
+                           sizeof(name), dec) == DRACHEN_END_OF_STREAM);
+    } else {
+      CHECK(!drachen_decode(frames + (size_t)NUM_FRAMES*SIZE, name,
+                            sizeof(name), dec));
+      CHECK(!memcmp(frames + (size_t)NUM_FRAMES*SIZE, frames + (size_t)k*SIZE,
+                    SIZE));
+      sprintf(expected, "f%u", k);
+      CHECK(!strcmp(name, expected));
+      ++k;
+    }
+  }
+
+  CHECK(k == NUM_FRAMES);
+  CHECK(drachen_decode(frames + (size_t)NUM_FRAMES*SIZE, name, sizeof(name),
+                       dec) == DRACHEN_END_OF_STREAM);
+  CHECK(!drachen_error(dec));
+
+  finish:
+  if (dec) drachen_free(dec);
+  if (out) fclose(out);
+  free(archive);
+  free(frames);
+}
+
+/* The record transform must be a permutation which puts each field (and
+ * with split_bytes, each byte of each field) of every record in a run of its
+ * own, leaving bytes before the offset and after the last whole record
+ * alone, and must be the same whether made directly or from its spec.
+ */
+static void test_record_xform(void) {
+  enum { OFFSET = 3, RECORD = 7, NUM_RECORDS = 5,
+         SIZE = OFFSET + RECORD*NUM_RECORDS + 3 };
+  static const unsigned fields[] = { 2, 1 };
+  /* Where each byte of a record starts, and how far apart its records are,
+   * with the remainder of the record as a field of 4 bytes.
+   */
+  static const uint32_t whole_start[RECORD] = { 0, 1, 10, 15, 16, 17, 18 };
+  static const uint32_t whole_step[RECORD] = { 2, 2, 1, 4, 4, 4, 4 };
+  static const uint32_t split_start[RECORD] = { 0, 5, 10, 15, 20, 25, 30 };
+  uint32_t direct[SIZE], from_spec[SIZE], r, b, i;
+  unsigned char seen[SIZE];
+  drachen_xform_spec spec;
+  int split;
+
+  for (split = 0; split < 2; ++split) {
+    for (i = 0; i < SIZE; ++i)
+      direct[i] = i;
+    drachen_make_record_xform_matrix(direct, OFFSET, RECORD, NUM_RECORDS,
+                                     fields, 2, split);
+
+    memset(&spec, 0, sizeof(spec));
+    spec.kind = DRACHEN_XFORM_RECORD;
+    spec.offset = OFFSET;
+    spec.record_size = RECORD;
+    spec.num_records = NUM_RECORDS;
+    spec.field_sizes = fields;
+    spec.num_fields = 2;
+    spec.split_bytes = split;
+    drachen_make_xform_matrix(from_spec, SIZE, &spec);
+    CHECK(!memcmp(direct, from_spec, sizeof(direct)));
+
+    memset(seen, 0, SIZE);
+    for (i = 0; i < SIZE; ++i) {
+      CHECK(from_spec[i] < SIZE && !seen[from_spec[i]]);
+      if (from_spec[i] < SIZE)
+        seen[from_spec[i]] = 1;
+    }
+
+    for (i = 0; i < OFFSET; ++i)
+      CHECK(from_spec[i] == i);
+    for (i = OFFSET + RECORD*NUM_RECORDS; i < SIZE; ++i)
+      CHECK(from_spec[i] == i);
+    for (r = 0; r < NUM_RECORDS; ++r)
+      for (b = 0; b < RECORD; ++b)
+        CHECK(from_spec[OFFSET + r*RECORD + b] == OFFSET +
+              (split? split_start[b] + r : whole_start[b] + r*whole_step[b]));
+  }
+}
+
+/* Returns the next of a fixed sequence of pseudo-random numbers, starting
+ * again from seed if it is non-zero.
+ */
+static unsigned next_random(unsigned seed) {
+  static unsigned state;
+
+  if (seed) state = seed;
+  state = state*1103515245u + 12345u;
+  return state >> 16;
+}
+
+/* Checks that the transform and block sizes suggested for the frames
+ * round-trip through drachen_create_encoder_spec(), and returns the spec.
+ */
+static drachen_xform_spec check_suggestion(unsigned char*const* frames,
+                                           unsigned num_frames,
+                                           uint32_t size) {
+  drachen_xform_spec spec;
+  drachen_block_spec blocks[2];
+  drachen_encoder* enc;
+  unsigned char* frame = malloc(size);
+  unsigned k;
+
+  memset(&spec, 0, sizeof(spec));
+  CHECK(!drachen_suggest_xform(&spec, blocks,
+                               (const unsigned char*const*)frames,
+                               num_frames, size));
+
+  enc = drachen_create_encoder_spec(fopen(ARCHIVE, "wb"), size, &spec, NULL);
+  CHECK(frame && enc && !drachen_error(enc));
+  if (!frame || !enc) {
+    if (enc) drachen_free(enc);
+    goto finish;
+  }
+  drachen_set_block_size(enc, blocks);
+  for (k = 0; k < num_frames; ++k)
+    CHECK(!drachen_encode(enc, frames[k], "f"));
+  CHECK(!drachen_free(enc));
+
+  enc = drachen_create_decoder(fopen(ARCHIVE, "rb"), size);
+  CHECK(enc && !drachen_error(enc));
+  if (!enc) goto finish;
+  for (k = 0; k < num_frames; ++k) {
+    CHECK(!drachen_decode(frame, NULL, 0, enc));
+    CHECK(!memcmp(frame, frames[k], size));
+  }
+  drachen_free(enc);
+
+  finish:
+  free(frame);
+  return spec;
+}
+
+/* The suggested transform must find the layout of samples for which it is
+ * plain: an RGB image whose columns vary smoothly across it, and records
+ * of random identifiers with a slowly moving value.
+ */
+static void test_suggest_xform(void) {
+  enum { COLS = 120, ROWS = 80, SIZE = COLS*ROWS*3, RECORD = 12,
+         NUM_FRAMES = 4 };
+  unsigned char* frames[NUM_FRAMES], * p;
+  drachen_xform_spec spec;
+  unsigned k, x, y, c, r, tex, id, v;
+
+  for (k = 0; k < NUM_FRAMES; ++k)
+    CHECK((frames[k] = malloc(SIZE)) != NULL);
+  for (k = 0; k < NUM_FRAMES; ++k)
+    if (!frames[k]) goto finish;
+
+  for (k = 0; k < NUM_FRAMES; ++k) {
+    next_random(99);
+    for (x = tex = 0; x < COLS; ++x) {
+      tex += next_random(0) % 7 - 3;
+      for (y = 0; y < ROWS; ++y)
+        for (c = 0; c < 3; ++c)
+          frames[k][(y*COLS + x)*3 + c] =
+            (unsigned char)(c*70 + tex*(c+1) + y/4 + k*(c+1));
+    }
+  }
+
+  spec = check_suggestion(frames, NUM_FRAMES, SIZE);
+  CHECK(spec.kind == DRACHEN_XFORM_IMAGE);
+  CHECK(spec.num_components == 3);
+  CHECK(spec.offset == 0 && spec.cols == COLS && spec.rows == ROWS);
+
+  for (k = 0; k < NUM_FRAMES; ++k) {
+    next_random(12345);
+    for (r = 0; r < SIZE/RECORD; ++r) {
+      p = frames[k] + r*RECORD;
+      id = next_random(0) << 16 | next_random(0);
+      v = (id >> 7) % 60000 + k*5;
+      memcpy(p, &id, 4);
+      p[4] = (unsigned char)v;
+      p[5] = (unsigned char)(v >> 8);
+      p[6] = 0x40;
+      p[7] = (id >> 3) & 1;
+      memset(p + 8, 0, 4);
+    }
+  }
+
+  spec = check_suggestion(frames, NUM_FRAMES, SIZE);
+  CHECK(spec.kind == DRACHEN_XFORM_RECORD);
+  CHECK(spec.offset == 0 && spec.record_size == RECORD &&
+        spec.num_records == SIZE/RECORD);
+
+  finish:
+  for (k = 0; k < NUM_FRAMES; ++k)
+    free(frames[k]);
+}
+
+int main(void) {
+  test_roi_misuse();
+  test_segment_lengths();
+  test_decode_changes();
+  test_decode_batch();
+  test_pin_frame();
+  test_follow();
+  test_record_xform();
+  test_suggest_xform();
+
+  remove(ARCHIVE);
+  return failures? 1 : 0;
+}
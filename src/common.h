@@ -2,18 +2,96 @@
 #define COMMON_H_
 
 #include <stdio.h>
+#include <string.h>
 #include <inttypes.h>
+#include <sys/types.h>
 
 /* This is an internal header for libdrachen.
  * Don't install it.
  */
 
+/* With DRACHEN_FEATURE_COMPACT_SEGMENTS, everything about how a segment is
+ * coded but its length and incr value (see CH_MODE).
+ */
+struct segment_mode {
+  unsigned char cmptyp, rlesex, inincr, predictor, ref;
+  int32_t disp;
+};
+/* The number of modes in the dictionary (all codes but CH_NEWMODE) */
+#define COMPACT_MODES 7
+
 struct drachen_encoder {
   uint32_t frame_size;
+  drachen_stream_params params;
   const drachen_block_spec* block_size;
   unsigned char* prev_frame, * curr_frame;
+  /* With DRACHEN_FEATURE_LINEAR, the frame before prev_frame; otherwise
+   * NULL
+   */
+  unsigned char* prev2_frame;
+  /* With DRACHEN_FEATURE_REFERENCES, the params.num_references reference
+   * frames (each holding roi_size bytes with a region of interest); otherwise
+   * NULL
+   */
+  unsigned char** refs;
+  /* For encoding with references, the CRC-32C of each reference and of
+   * prev_frame, and bit masks of the slots which hold a frame and of those
+   * which are pinned. next_ref is the slot to consider next for storing a
+   * frame, and pin_ref the slot the next frame is pinned to, or -1.
+   */
+  uint32_t* ref_crc;
+  uint32_t prev_crc;
+  int prev_crc_valid;
+  unsigned ref_valid, ref_pinned, next_ref;
+  int pin_ref;
+  /* For decoding, the slot the frame being decoded is to be stored in, or
+   * -1
+   */
+  int store_ref;
+  /* For decoding with DRACHEN_FEATURE_BASE_FRAME, whether the base frame has
+   * yet to be given (see drachen_set_base_frame())
+   */
+  int base_pending;
+  /* Set while a packed transform table is coded (see
+   * drachen_write_packed_xform()), before the rest of the header is known,
+   * when only predictors which depend on nothing but the features may be
+   * used
+   */
+  int coding_xform;
+  /* With DRACHEN_FEATURE_BACKGROUND, the background model, holding each byte
+   * scaled by 256, and the whole part of each, which is what segments
+   * predict from (each holding roi_size bytes with a region of interest);
+   * otherwise NULL. background_started is set once the model has been
+   * started from a frame.
+   */
+  uint16_t* background;
+  unsigned char* background_frame;
+  int background_started;
+  /* For encoding with DRACHEN_FEATURE_DISPLACED, the displacement chosen by
+   * the search for the previous block
+   */
+  int32_t last_disp;
   FILE* file;
+  /* The transform, either as a table of indices (as described for
+   * drachen_create_encoder(), but inverted when encoding), or, if xform is
+   * NULL, as described by xform_spec. xform is also NULL if the transform
+   * maps every byte onto itself, in which case xform_is_identity is set.
+   */
   uint32_t* xform;
+  drachen_xform_spec xform_spec;
+  int xform_is_identity;
+  /* For large tables, the order in which to move bytes (see
+   * drachen_plan_xform()), or NULL.
+   */
+  struct xform_plan* plan;
+  /* The field sizes of a DRACHEN_XFORM_RECORD xform_spec, owned by the
+   * encoder
+   */
+  unsigned* record_fields;
+  /* With DRACHEN_FEATURE_BITPLANES, a frame-sized buffer for splitting and
+   * joining the bit planes
+   */
+  unsigned char* bitplane_frame;
 
   /* For reading, the input machine byte order.
    * Each item is a left bitshift count divided by eight.
@@ -22,8 +100,116 @@ struct drachen_encoder {
 
   int error;
 
+  /* Running CRC-32C of the name of the frame being decoded */
+  uint32_t name_crc;
+  /* With DRACHEN_FEATURE_NAME_DELTA, the name of the last frame encoded or
+   * completely decoded, and, for decoding, the name of the frame being
+   * decoded, which replaces it once the frame is complete. Each is
+   * NUL-terminated, *_len bytes long without the NUL, and held in a buffer of
+   * *_cap bytes.
+   */
+  char* last_name, * next_name;
+  uint32_t last_name_len, next_name_len, last_name_cap, next_name_cap;
+
+  /* For following a growing stream (see drachen_set_follow()), whether to
+   * do so, and the file offset of the frame being decoded. notify_fd is the
+   * inotify descriptor used by drachen_wait_for_data(), -1 if not yet
+   * created, or -2 if it could not be.
+   */
+  int follow;
+  off_t frame_start;
+  int notify_fd;
+
   unsigned char* tmp_data;
   uint32_t tmp_data_len;
+
+  /* For encoding, whether to choose segments by their total cost (see
+   * drachen_set_optimal_segments()), and, for doing so, the method, offset
+   * and end of each block, with room for blocks_cap blocks
+   */
+  int optimal_segments;
+  struct encoding_method* block_meths;
+  uint32_t* block_offset, * block_end;
+  uint32_t blocks_cap;
+
+  /* For encoding, the most each byte may be altered by, and the size the
+   * segments of each frame should fit in, or 0 (see drachen_set_max_error()),
+   * and a frame-sized buffer for trying alterations
+   */
+  unsigned max_error;
+  uint32_t target_size;
+  unsigned char* lossy_frame;
+
+  /* With DRACHEN_FEATURE_ENTROPY, for encoding, the memory stream (or
+   * temporary file) frame bodies are first written to, and the buffer of the
+   * memory stream. For decoding, the real file while a decoded body is being
+   * read from memory, or NULL. body and coded hold the plain and coded
+   * bodies, and rans_table the decoding table.
+   */
+  FILE* body_file;
+  char* body_mem;
+  size_t body_mem_size;
+  FILE* stream_file;
+  unsigned char* body, * coded;
+  uint32_t body_size, coded_size;
+  uint32_t* rans_table;
+
+  /* With DRACHEN_FEATURE_COMPACT_SEGMENTS, the dictionary of the modes of the
+   * segments of the current frame, most recently used first.
+   */
+  struct segment_mode modes[COMPACT_MODES];
+
+  /* For partial decoding, the region of interest (see drachen_set_roi()).
+   * roi is a sorted list of num_roi disjoint intervals in transformed
+   * space; prev_frame and curr_frame then only hold roi_size bytes, each
+   * interval being stored at its base. roi_ranges are the caller's
+   * untransformed ranges, and roi_map holds the index into the compacted
+   * frame of each byte within them, in order.
+   */
+  struct roi_interval* roi;
+  uint32_t num_roi, roi_size;
+  drachen_range* roi_ranges;
+  unsigned num_roi_ranges;
+  uint32_t* roi_map;
+
+  /* For change-set decoding (see drachen_decode_changes()).
+   * inverse_xform and change_mask (one bit per byte) are only allocated
+   * for non-identity transforms. changed lists the intervals of the
+   * transformed frame which were touched by the current frame.
+   */
+  uint32_t* inverse_xform;
+  unsigned char* change_mask;
+  drachen_range* changed;
+  uint32_t num_changed, changed_cap;
+
+  /* For partial decoding of streams with bit planes, the index within the
+   * compacted frame of the start of the bit-plane region, if it is within
+   * the region of interest, or 0xFFFFFFFF. The joined region is then kept
+   * after the compacted frame.
+   */
+  uint32_t roi_bitplane;
+};
+
+struct roi_interval {
+  uint32_t begin, end, base;
+};
+
+/* A precomputed way of applying a transform table to large frames.
+ *
+ * Runs of consecutive indices are moved with memcpy(). The remaining bytes
+ * are listed as (dst,src) pairs, grouped by tiles of the destination small
+ * enough to stay in cache, and sorted by source within each tile, so that
+ * the source is read in ascending order once per tile rather than at random.
+ */
+struct xform_run {
+  uint32_t dst, src, len;
+};
+
+struct xform_plan {
+  struct xform_run* runs;
+  uint32_t num_runs;
+  uint32_t* dst, * src;
+  uint32_t num_pairs;
 };
 
 static inline uint32_t swab32a(uint32_t value, const unsigned char* shifts) {
@@ -48,6 +234,237 @@ static inline uint16_t swab16(uint32_t value, const drachen_encoder* enc) {
   return swab16a(value, enc->endian16);
 }
 
+/* Functions for parametric transforms, in xform.c */
+/* Returns the index within the transformed frame of byte i of the
+ * untransformed frame.
+ */
+uint32_t drachen_xform_spec_index(const drachen_xform_spec*, uint32_t i);
+/* Validates the given spec against the frame size, returning 0 or EINVAL, and
+ * reduces image block sizes as drachen_make_image_xform_matrix() does.
+ */
+int drachen_normalise_xform_spec(drachen_xform_spec*, uint32_t frame_size);
+/* Builds the plan for the table of the given encoder, if it is large enough
+ * to benefit. Failure to do so is not an error.
+ */
+void drachen_plan_xform(drachen_encoder*);
+void drachen_free_xform_plan(struct xform_plan*);
+/* Transforms the untransformed frame in into out, for encoding */
+void drachen_transform_frame(unsigned char* out, const unsigned char* in,
+                             const drachen_encoder*);
+/* Reverses the transform of the transformed frame in into out, for decoding */
+void drachen_untransform_frame(unsigned char* out, const unsigned char* in,
+                               const drachen_encoder*);
+
+/* Prediction, in predict.c. Each adds or subtracts the prediction of the
+ * given predictor (a PRED_* constant other than PRED_NONE) from prev and
+ * prev2 (the frame before prev) to or from the len bytes at dst (for
+ * PRED_REF or PRED_BACKGROUND, prev is the reference frame or
+ * background_frame instead). offset is the index of the
+ * first byte within the transformed frame, to which words are aligned; a word
+ * cut by either end of the range only includes the bytes within it.
+ */
+void drachen_add_prediction(unsigned char* dst, int predictor,
+                            const unsigned char* prev,
+                            const unsigned char* prev2,
+                            uint32_t offset, uint32_t len);
+void drachen_sub_prediction(unsigned char* dst, int predictor,
+                            const unsigned char* prev,
+                            const unsigned char* prev2,
+                            uint32_t offset, uint32_t len);
+
+/* Adds or subtracts the bytes of frame, which is size bytes long, disp bytes
+ * after the given offset, to or from the len bytes at dst (see
+ * PRED_DISPLACED). Bytes beyond either end of frame are taken as zero.
+ */
+void drachen_add_displaced(unsigned char* dst, const unsigned char* frame,
+                           uint32_t size, uint32_t offset, uint32_t len,
+                           int32_t disp);
+void drachen_sub_displaced(unsigned char* dst, const unsigned char* frame,
+                           uint32_t size, uint32_t offset, uint32_t len,
+                           int32_t disp);
+/* Adds to the len bytes of frame at the given offset the bytes dist before
+ * them within frame, in order, so that each byte is predicted from its
+ * already decoded neighbour (see PRED_LEFT and PRED_UP). Bytes before the
+ * start of the frame are taken as zero.
+ */
+void drachen_add_spatial(unsigned char* frame, uint32_t offset, uint32_t len,
+                         uint32_t dist);
+/* The reverse of drachen_add_spatial(): subtracts from the len bytes at dst
+ * the bytes dist before the given offset within frame, which is not
+ * modified.
+ */
+void drachen_sub_spatial(unsigned char* dst, const unsigned char* frame,
+                         uint32_t offset, uint32_t len, uint32_t dist);
+/* Returns the sum of absolute differences between the len bytes at a and
+ * those at b.
+ */
+uint32_t drachen_sad(const unsigned char* a, const unsigned char* b,
+                     uint32_t len);
+/* Moves the len entries of the background model at model (see
+ * DRACHEN_FEATURE_BACKGROUND) 1/2^shift of the way towards the bytes at
+ * frame, storing the whole part of each at whole. A shift of 0 starts the
+ * model afresh from frame.
+ */
+void drachen_update_background(uint16_t* model, unsigned char* whole,
+                               const unsigned char* frame, uint32_t len,
+                               unsigned shift);
+
+/* Static-table rANS coding, in entropy.c (see DRACHEN_FEATURE_ENTROPY).
+ * Frequencies are scaled to sum to RANS_SCALE.
+ */
+#define RANS_SCALE_BITS 12
+#define RANS_SCALE (1u << RANS_SCALE_BITS)
+/* Codes the len bytes at in, with their table, into at most limit bytes at
+ * out. Returns the length of the result, or 0 if it would not fit.
+ */
+uint32_t drachen_rans_encode(unsigned char* out, uint32_t limit,
+                             const unsigned char* in, uint32_t len);
+/* Decodes the in_len bytes at in into len bytes at out, building the
+ * decoding table (of RANS_SCALE entries) at table. Returns 0, or
+ * DRACHEN_OVERRUN if the input does not decode to exactly len bytes.
+ */
+int drachen_rans_decode(unsigned char* out, uint32_t len,
+                        const unsigned char* in, uint32_t in_len,
+                        uint32_t* table);
+/* Ensures that the buffer *buf, of *size bytes, is at least len bytes long.
+ * Returns 0 or ENOMEM.
+ */
+int drachen_reserve(unsigned char** buf, uint32_t* size, uint32_t len);
+
+/* Ensures that the name buffer *buf, of *cap bytes, is at least len bytes
+ * long, keeping its contents. Returns 0 or ENOMEM.
+ */
+int drachen_reserve_name(char** buf, uint32_t* cap, uint32_t len);
+/* Stores at dst the name of len bytes at src with its last decimal number
+ * incremented, keeping its width unless every digit was 9 (see
+ * DRACHEN_FEATURE_NAME_DELTA). dst needs room for len + 1 bytes; no NUL is
+ * stored. Returns the length of the new name, or 0 if src has no digits.
+ */
+uint32_t drachen_increment_name(char* dst, const char* src, uint32_t len);
+
+/* Bit-plane functions, in xform.c (see DRACHEN_FEATURE_BITPLANES).
+ * len is the length of the region, which must be a multiple of 8; each plane
+ * is len/8 bytes long.
+ */
+/* Splits len bytes at src into planes at dst */
+void drachen_split_bitplanes(unsigned char* dst, const unsigned char* src,
+                             uint32_t len);
+/* Joins the planes at src back into len bytes at dst */
+void drachen_join_bitplanes(unsigned char* dst, const unsigned char* src,
+                            uint32_t len);
+/* Joins only the given group of eight bytes, at dst */
+void drachen_join_bitplane_group(unsigned char* dst, const unsigned char* src,
+                                 uint32_t len, uint32_t group);
+
+static inline int has_bitplanes(const drachen_encoder* enc) {
+  return enc->params.bitplane_end > enc->params.bitplane_begin;
+}
+
+/* Returns whether segment headers may be extended (see EE_EXTEND) */
+static inline int has_extended_segments(const drachen_encoder* enc) {
+  return !!(enc->params.features & (DRACHEN_FEATURE_WORD_DELTA |
+                                    DRACHEN_FEATURE_LINEAR |
+                                    DRACHEN_FEATURE_REFERENCES |
+                                    DRACHEN_FEATURE_DISPLACED |
+                                    DRACHEN_FEATURE_SPATIAL |
+                                    DRACHEN_FEATURE_PACKED |
+                                    DRACHEN_FEATURE_BACKGROUND));
+}
+
+/* Makes curr_frame the previous frame, after it has been encoded or
+ * decoded.
+ */
+static inline void push_frame(drachen_encoder* enc) {
+  unsigned char* swap = enc->curr_frame;
+
+  if (enc->prev2_frame) {
+    enc->curr_frame = enc->prev2_frame;
+    enc->prev2_frame = enc->prev_frame;
+  } else {
+    enc->curr_frame = enc->prev_frame;
+  }
+
+  enc->prev_frame = swap;
+}
+
+/* Folds the given frame, once it has been encoded or decoded, into the
+ * background model, if there is one.
+ */
+static inline void update_background(drachen_encoder* enc,
+                                     const unsigned char* frame) {
+  if (!enc->background)
+    return;
+
+  drachen_update_background(enc->background, enc->background_frame, frame,
+                            enc->roi? enc->roi_size : enc->frame_size,
+                            enc->background_started?
+                            enc->params.background_shift : 0);
+  enc->background_started = 1;
+}
+
+/* Writes or reads the given transform table (in the form written to the
+ * header) as a stride followed by four byte planes of the differences
+ * between each index and the one stride elements before, each plane encoded
+ * like a frame. These must only be called before the first
+ * frame. Both set and return the error field.
+ */
+int drachen_write_packed_xform(drachen_encoder*, const uint32_t*);
+int drachen_read_packed_xform(drachen_encoder*);
+
+/* For decoders, returns the index within the transformed frame of byte i of
+ * the untransformed frame.
+ */
+static inline uint32_t xform_index(const drachen_encoder* enc, uint32_t i) {
+  if (enc->xform)
+    return enc->xform[i];
+  else if (enc->xform_is_identity)
+    return i;
+  else
+    return drachen_xform_spec_index(&enc->xform_spec, i);
+}
+
+#ifndef HAVE_FSEEKO
+#define fseeko fseek
+#define ftello ftell
+#endif
+
+/* The format version written for streams which use any features */
+#define DRACHEN_VERSION_FEATURES 2
+/* Features understood by this version of the library */
+#define DRACHEN_KNOWN_FEATURES (DRACHEN_FEATURE_CRC32C |          \
+                                DRACHEN_FEATURE_XFORM_DESC |      \
+                                DRACHEN_FEATURE_BITPLANES |       \
+                                DRACHEN_FEATURE_WORD_DELTA |      \
+                                DRACHEN_FEATURE_LINEAR |          \
+                                DRACHEN_FEATURE_REFERENCES |      \
+                                DRACHEN_FEATURE_DISPLACED |       \
+                                DRACHEN_FEATURE_SPATIAL |         \
+                                DRACHEN_FEATURE_PACKED |          \
+                                DRACHEN_FEATURE_ENTROPY |         \
+                                DRACHEN_FEATURE_COMPACT_SEGMENTS |\
+                                DRACHEN_FEATURE_NAME_DELTA |      \
+                                DRACHEN_FEATURE_BASE_FRAME |      \
+                                DRACHEN_FEATURE_BACKGROUND)
+/* Kind of transform descriptor (see DRACHEN_FEATURE_XFORM_DESC) for an
+ * explicit table. Other kinds are the DRACHEN_XFORM_* constants.
+ */
+#define XFORM_DESC_TABLE 0xFFFFFFFFu
+
+/* CRC-32C of len bytes at data, continuing from crc (which is 0 initially).
+ * drachen_crc32c_init() must have been called first.
+ */
+void drachen_crc32c_init(void);
+uint32_t drachen_crc32c(uint32_t crc, const void* data, size_t len);
+
+/* With DRACHEN_FEATURE_ENTROPY, the byte which begins the body of a frame
+ * which is not a duplicate: either the segments follow as they are, or they
+ * are rANS-coded, after their length and the coded length.
+ */
+#define BODY_PLAIN 0
+#define BODY_RANS 1
+/* No segment takes more than this many bytes per byte of the frame */
+#define MAX_BODY_PER_BYTE 12
+
 /* Constants for the encoding element header */
 #define EE_LENENC 0x03
 #define EE_LENONE 0x00
@@ -67,5 +484,189 @@ static inline uint16_t swab16(uint32_t value, const drachen_encoder* enc) {
 #define EE_RLESEX 0x20
 #define EE_ININCR 0x40
 #define EE_PRVADD 0x80
+/* In streams with extended segments (see has_extended_segments()), a zero
+ * segment with sign extension, which is otherwise never written, is instead
+ * followed (after the length) by a mode byte, whose low bits give the
+ * compression and whose high bits give the predictor. EE_PRVADD is then
+ * unused, and EE_EXTSEX takes the place of EE_RLESEX.
+ */
+#define EE_EXTEND (EE_CMPZER | EE_RLESEX)
+#define EE_EXTSEX 0x80
+#define EX_CMPTYP 0x0F
+#define EX_PREDICTOR 0xF0
+#define EX_PRED_SHIFT 4
+/* With DRACHEN_FEATURE_PACKED, the compressions of the mode byte from
+ * EX_CMPPACK to EX_CMPPACK_MAX pack each byte into 1 to 7 bits.
+ */
+#define EX_CMPPACK 8
+#define EX_CMPPACK_MAX 14
+/* Returns the number of bits per byte of the given packed compression */
+static inline unsigned packed_width(unsigned cmptyp) {
+  return cmptyp - EX_CMPPACK + 1;
+}
+/* Predictors */
+/* None; the segment is added to zero */
+#define PRED_NONE 0
+/* Each byte of the previous frame (EE_PRVADD) */
+#define PRED_PREV 1
+/* Each 16-bit or 32-bit little-endian word of the previous frame */
+#define PRED_PREV16 2
+#define PRED_PREV32 3
+/* 2*prev - prev2, by bytes, 16-bit words or 32-bit words */
+#define PRED_LINEAR 4
+#define PRED_LINEAR16 5
+#define PRED_LINEAR32 6
+/* Each byte of a reference frame, whose slot is given by a byte after the
+ * mode byte
+ */
+#define PRED_REF 7
+/* Each byte of the previous frame, displaced by the signed int which follows
+ * the mode byte; bytes beyond either end of the frame are zero
+ */
+#define PRED_DISPLACED 8
+/* The byte before, or the byte params.row_stride bytes before, in the same
+ * frame; bytes before the start of the frame are zero
+ */
+#define PRED_LEFT 9
+#define PRED_UP 10
+/* Each byte of the background model (see DRACHEN_FEATURE_BACKGROUND) */
+#define PRED_BACKGROUND 11
+
+/* In streams with references, the name of each frame is followed by a
+ * control byte. The low bits give the slot the frame is stored in, plus one,
+ * or zero if it is not stored. The high bits give the slot of the reference
+ * the frame duplicates, plus one, or FC_DUP_PREV if it duplicates the
+ * previous frame, or zero if it is encoded as usual.
+ */
+#define FC_STORE 0x0F
+#define FC_DUP 0xF0
+#define FC_DUP_SHIFT 4
+#define FC_DUP_PREV 0x0F
+
+/* With DRACHEN_FEATURE_COMPACT_SEGMENTS, segments begin with a single byte
+ * instead of the usual descriptor. Its low bits select a mode from the
+ * dictionary, or are CH_NEWMODE for a new mode described by the bytes which
+ * follow. Its high bits give the length: the code plus one up to CH_LENMAX,
+ * or CH_LENVAR for a varint plus CH_LENMAX + 2, or CH_LENREST for the
+ * remainder of the frame. The incr value comes last, if the mode has one.
+ */
+#define CH_MODE 0x07
+#define CH_NEWMODE 0x07
+#define CH_LEN_SHIFT 3
+#define CH_LENMAX 29
+#define CH_LENVAR 30
+#define CH_LENREST 31
+/* The flags byte which follows the mode byte of a new mode */
+#define CM_SEX 0x01
+#define CM_INCR 0x02
+
+/* Returns whether the stream allows the given predictor */
+static inline int has_predictor(const drachen_encoder* enc, int predictor) {
+  switch (predictor) {
+  case PRED_NONE:
+  case PRED_PREV:
+    return 1;
+
+  case PRED_PREV16:
+  case PRED_PREV32:
+    return !!(enc->params.features & DRACHEN_FEATURE_WORD_DELTA);
+
+  case PRED_LINEAR:
+    return !!enc->prev2_frame;
+
+  case PRED_LINEAR16:
+  case PRED_LINEAR32:
+    return enc->prev2_frame &&
+      (enc->params.features & DRACHEN_FEATURE_WORD_DELTA);
+
+  case PRED_REF:
+    return enc->refs && !enc->coding_xform;
+
+  case PRED_DISPLACED:
+    return (enc->params.features & DRACHEN_FEATURE_DISPLACED) &&
+      !enc->coding_xform;
+
+  case PRED_LEFT:
+    return !!(enc->params.features & DRACHEN_FEATURE_SPATIAL);
+
+  case PRED_UP:
+    return (enc->params.features & DRACHEN_FEATURE_SPATIAL) &&
+      enc->params.row_stride && !enc->coding_xform;
+
+  case PRED_BACKGROUND:
+    return enc->background && !enc->coding_xform;
+
+  default:
+    return 0;
+  }
+}
+
+/* Returns how far back within the frame PRED_LEFT or PRED_UP predicts
+ * from
+ */
+static inline uint32_t spatial_dist(const drachen_encoder* enc,
+                                    int predictor) {
+  return predictor == PRED_UP? enc->params.row_stride : 1;
+}
+
+/* Returns the width of the words a predictor works on */
+static inline unsigned predictor_width(int predictor) {
+  switch (predictor) {
+  case PRED_PREV16:
+  case PRED_LINEAR16:
+    return 2;
+
+  case PRED_PREV32:
+  case PRED_LINEAR32:
+    return 4;
+
+  default:
+    return 1;
+  }
+}
+
+/* Starts the dictionary of modes afresh for a new frame, holding the modes
+ * most segments use: copying the previous frame, bytes as they are, the
+ * previous frame plus the incr value, the previous frame plus small
+ * differences, runs of bytes, and a constant.
+ */
+static inline void reset_modes(drachen_encoder* enc) {
+  static const unsigned char initial[COMPACT_MODES][3] = {
+    /* Compression, predictor, incr value */
+    { EE_CMPZER >> EE_CMP_SHIFT, PRED_PREV, 0 },
+    { EE_CMPNON >> EE_CMP_SHIFT, PRED_NONE, 0 },
+    { EE_CMPZER >> EE_CMP_SHIFT, PRED_PREV, 1 },
+    { EE_CMPHLF >> EE_CMP_SHIFT, PRED_PREV, 0 },
+    { EE_CMPR44 >> EE_CMP_SHIFT, PRED_PREV, 0 },
+    { EE_CMPR48 >> EE_CMP_SHIFT, PRED_NONE, 0 },
+    { EE_CMPZER >> EE_CMP_SHIFT, PRED_NONE, 1 },
+  };
+  unsigned k;
+
+  memset(enc->modes, 0, sizeof(enc->modes));
+  for (k = 0; k < COMPACT_MODES; ++k) {
+    enc->modes[k].cmptyp = initial[k][0];
+    enc->modes[k].predictor = initial[k][1];
+    enc->modes[k].inincr = initial[k][2];
+  }
+}
+
+/* Moves mode k of the dictionary to the front */
+static inline void use_mode(drachen_encoder* enc, unsigned k) {
+  struct segment_mode mode = enc->modes[k];
+
+  memmove(enc->modes + 1, enc->modes, k*sizeof(mode));
+  enc->modes[0] = mode;
+}
+
+/* Adds a new mode to the front of the dictionary, dropping the least
+ * recently used.
+ */
+static inline void add_mode(drachen_encoder* enc,
+                            const struct segment_mode* mode) {
+  memmove(enc->modes + 1, enc->modes,
+          (COMPACT_MODES - 1)*sizeof(*mode));
+  enc->modes[0] = *mode;
+}
 
 #endif /* COMMON_H_ */
@@ -0,0 +1,136 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#ifdef HAVE_SSE42_CRC32C
+#include <nmmintrin.h>
+#endif
+
+#include "drachen.h"
+#include "common.h"
+
+/* CRC-32C (Castagnoli), reflected polynomial. */
+#define CRC32C_POLY 0x82F63B78u
+
+/* Tables for the portable slicing-by-8 implementation.
+ * crc_table[k][b] is the CRC of byte b followed by k zero bytes.
+ */
+static uint32_t crc_table[8][256];
+static int crc_table_ready;
+
+#ifdef HAVE_SSE42_CRC32C
+static int has_sse42;
+#endif
+
+void drachen_crc32c_init(void) {
+  uint32_t b, k, crc;
+
+  if (crc_table_ready) return;
+
+  for (b = 0; b < 256; ++b) {
+    crc = b;
+    for (k = 0; k < 8; ++k)
+      crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+    crc_table[0][b] = crc;
+  }
+
+  for (b = 0; b < 256; ++b)
+    for (k = 1; k < 8; ++k)
+      crc_table[k][b] = (crc_table[k-1][b] >> 8) ^
+                        crc_table[0][crc_table[k-1][b] & 0xFF];
+
+#ifdef HAVE_SSE42_CRC32C
+  __builtin_cpu_init();
+  has_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+
+  crc_table_ready = 1;
+}
+
+static uint32_t crc32c_soft(uint32_t crc, const unsigned char* data,
+                            size_t len) {
+  uint32_t lo, hi;
+
+  /* Align to a word boundary so the main loop can read whole words */
+  while (len && ((uintptr_t)data & 3)) {
+    crc = (crc >> 8) ^ crc_table[0][(crc ^ *data++) & 0xFF];
+    --len;
+  }
+
+  while (len >= 8) {
+    lo = crc ^ (data[0] | (data[1] << 8) | (data[2] << 16) |
+                ((uint32_t)data[3] << 24));
+    hi = data[4] | (data[5] << 8) | (data[6] << 16) |
+         ((uint32_t)data[7] << 24);
+    crc =
+      crc_table[7][(lo      ) & 0xFF] ^
+      crc_table[6][(lo >>  8) & 0xFF] ^
+      crc_table[5][(lo >> 16) & 0xFF] ^
+      crc_table[4][(lo >> 24)       ] ^
+      crc_table[3][(hi      ) & 0xFF] ^
+      crc_table[2][(hi >>  8) & 0xFF] ^
+      crc_table[1][(hi >> 16) & 0xFF] ^
+      crc_table[0][(hi >> 24)       ];
+    data += 8;
+    len -= 8;
+  }
+
+  while (len--)
+    crc = (crc >> 8) ^ crc_table[0][(crc ^ *data++) & 0xFF];
+
+  return crc;
+}
+
+#ifdef HAVE_SSE42_CRC32C
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char* data,
+                             size_t len) {
+#if defined(__x86_64__)
+  uint64_t crc64, word;
+#endif
+  uint32_t word32;
+
+  while (len && ((uintptr_t)data & 7)) {
+    crc = _mm_crc32_u8(crc, *data++);
+    --len;
+  }
+
+#if defined(__x86_64__)
+  crc64 = crc;
+  while (len >= 8) {
+    __builtin_memcpy(&word, data, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+    data += 8;
+    len -= 8;
+  }
+  crc = (uint32_t)crc64;
+#endif
+
+  while (len >= 4) {
+    __builtin_memcpy(&word32, data, 4);
+    crc = _mm_crc32_u32(crc, word32);
+    data += 4;
+    len -= 4;
+  }
+
+  while (len--)
+    crc = _mm_crc32_u8(crc, *data++);
+
+  return crc;
+}
+#endif /* HAVE_SSE42_CRC32C */
+
+uint32_t drachen_crc32c(uint32_t crc, const void* data, size_t len) {
+  crc = ~crc;
+#ifdef HAVE_SSE42_CRC32C
+  if (has_sse42)
+    crc = crc32c_sse42(crc, data, len);
+  else
+#endif
+    crc = crc32c_soft(crc, data, len);
+  return ~crc;
+}
@@ -9,13 +9,28 @@
 #include <string.h>
 #include <inttypes.h>
 
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
 #include "drachen.h"
 #include "common.h"
 
+#include "unlockio.h"
+
+/* The status to return after fread() could not read everything. */
+#define READ_FAILURE(in) (ferror(in)? errno : DRACHEN_PREMATURE_EOF)
+
 static int decompress_noop(unsigned char* dst, unsigned char* end,
                            FILE* in, int sex) {
   size_t size = end-dst;
-  return !fread(dst, size, 1, in);
+  return fread(dst, size, 1, in)? 0 : READ_FAILURE(in);
 }
 
 static int decompress_zero(unsigned char* dst, unsigned char* end,
@@ -180,6 +195,61 @@ static int decompress_half(unsigned char* dst, unsigned char* end,
   return 0;
 }
 
+/* Values unpacked by decompress_packed() per read */
+#define PACK_CHUNK 512
+
+/* Unpacks n bytes of bits bits each from in to dst, eight at a time: each
+ * group of eight is loaded as one 64-bit word, from which the values are
+ * shifted out. in must be readable up to a whole group.
+ */
+static inline void unpack_bits(unsigned char* dst, const unsigned char* in,
+                               unsigned n, unsigned bits, int sex) {
+  const unsigned mask = (1u << bits) - 1, sign = 1u << (bits - 1);
+  unsigned char group[8];
+  uint64_t v;
+  unsigned i, j;
+
+  for (i = 0; i < n; i += 8, in += bits) {
+    v = 0;
+    for (j = 0; j < bits; ++j)
+      v |= (uint64_t)in[j] << 8*j;
+    for (j = 0; j < 8; ++j)
+      group[j] = sex? (((v >> j*bits) & mask) ^ sign) - sign :
+                      (v >> j*bits) & mask;
+    memcpy(dst + i, group, n - i < 8? n - i : 8);
+  }
+}
+
+static int decompress_packed(unsigned char* dst, unsigned char* end,
+                             FILE* in, int sex, unsigned bits) {
+  unsigned char buf[PACK_CHUNK*7/8];
+  size_t n, size;
+
+  while (dst != end) {
+    n = (size_t)(end - dst) < PACK_CHUNK? (size_t)(end - dst) : PACK_CHUNK;
+    size = (n*bits + 7)/8;
+    if (!fread(buf, size, 1, in))
+      return READ_FAILURE(in);
+    /* Pad the last group */
+    memset(buf + size, 0, (n + 7)/8*bits - size);
+
+    /* With constant widths, the loops of unpack_bits() unroll completely */
+    switch (bits) {
+    case 1: unpack_bits(dst, buf, n, 1, sex); break;
+    case 2: unpack_bits(dst, buf, n, 2, sex); break;
+    case 3: unpack_bits(dst, buf, n, 3, sex); break;
+    case 4: unpack_bits(dst, buf, n, 4, sex); break;
+    case 5: unpack_bits(dst, buf, n, 5, sex); break;
+    case 6: unpack_bits(dst, buf, n, 6, sex); break;
+    case 7: unpack_bits(dst, buf, n, 7, sex); break;
+    }
+
+    dst += n;
+  }
+
+  return 0;
+}
+
 static int (* const decompressors[8])(unsigned char*, unsigned char*,
                                       FILE*, int) = {
   decompress_noop,
@@ -192,20 +262,326 @@ static int (* const decompressors[8])(unsigned char*, unsigned char*,
   decompress_zero,
 };
 
-static int decode_one_element(uint32_t* offset, drachen_encoder* enc) {
-  int head = fgetc(enc->file), lenenc, cmptyp, rlesex, inincr, prvadd, ch;
+/* Skippers parse the payload of a segment of the given length without
+ * expanding it, leaving the input positioned after the segment. They return
+ * the same values as the decompressors.
+ */
+static int skip_bytes(FILE* in, uint32_t size) {
+  unsigned char discard[256];
+  uint32_t n;
+  while (size) {
+    n = size < sizeof(discard)? size : sizeof(discard);
+    if (!fread(discard, n, 1, in))
+      return READ_FAILURE(in);
+    size -= n;
+  }
+  return 0;
+}
+
+#define SKIPRUN(runlength) \
+  if (((unsigned)runlength) > len) return DRACHEN_OVERRUN; \
+  len -= runlength
+
+#define SKIPDATUM() \
+  if (EOF == fgetc(in)) return DRACHEN_PREMATURE_EOF
+
+static int skip_noop(uint32_t len, FILE* in) {
+  return skip_bytes(in, len);
+}
+
+static int skip_zero(uint32_t len, FILE* in) {
+  /* ZERO segments have no payload */
+  (void)len;
+  (void)in;
+  return 0;
+}
+
+static int skip_rle88(uint32_t len, FILE* in) {
+  int runlength;
+  while (len) {
+    runlength = fgetc(in);
+    if (runlength == EOF)
+      return DRACHEN_PREMATURE_EOF;
+    SKIPDATUM();
+    if (!runlength) runlength = 256;
+
+    SKIPRUN(runlength);
+  }
+  return 0;
+}
+
+static int skip_rle48(uint32_t len, FILE* in) {
+  int runlength;
+  unsigned rl0, rl1;
+  while (len) {
+    runlength = fgetc(in);
+    if (runlength == EOF)
+      return DRACHEN_PREMATURE_EOF;
+
+    rl0 = runlength & 0xF;
+    rl1 = (runlength >> 4) & 0xF;
+    if (rl0 == 0) rl0 = 16;
+    if (rl1 == 0) rl1 = 16;
+
+    SKIPDATUM();
+    SKIPRUN(rl0);
+    if (!len) break;
+    SKIPDATUM();
+    SKIPRUN(rl1);
+  }
+  return 0;
+}
+
+static int skip_rle28(uint32_t len, FILE* in) {
+  int runlength;
+  unsigned i, rl;
+  while (len) {
+    runlength = fgetc(in);
+    if (runlength == EOF)
+      return DRACHEN_PREMATURE_EOF;
+
+    for (i = 0; i < 4 && len; ++i) {
+      rl = (runlength >> (2*i)) & 0x3;
+      if (rl == 0) rl = 4;
+      SKIPDATUM();
+      SKIPRUN(rl);
+    }
+  }
+  return 0;
+}
+
+static int skip_rle44(uint32_t len, FILE* in) {
+  int value;
+  unsigned rl;
+  while (len) {
+    value = fgetc(in);
+    if (value == EOF)
+      return DRACHEN_PREMATURE_EOF;
+
+    rl = value & 0xF;
+    if (rl == 0) rl = 16;
+    SKIPRUN(rl);
+  }
+  return 0;
+}
+
+static int skip_rle26(uint32_t len, FILE* in) {
+  int value;
+  unsigned rl;
+  while (len) {
+    value = fgetc(in);
+    if (value == EOF)
+      return DRACHEN_PREMATURE_EOF;
+
+    rl = value & 0x3;
+    if (rl == 0) rl = 4;
+    SKIPRUN(rl);
+  }
+  return 0;
+}
+
+static int skip_half(uint32_t len, FILE* in) {
+  return skip_bytes(in, len/2 + (len&1));
+}
+
+static int (* const skippers[8])(uint32_t, FILE*) = {
+  skip_noop,
+  skip_rle88,
+  skip_rle48,
+  skip_rle28,
+  skip_rle44,
+  skip_rle26,
+  skip_half,
+  skip_zero,
+};
+
+/* The decoded form of an encoding segment header. */
+typedef struct element_header {
+  uint32_t len;
+  int cmptyp, rlesex, inincr;
+  /* One of the PRED_* constants, and for PRED_REF, the slot of the
+   * reference, or for PRED_DISPLACED, the displacement
+   */
+  int predictor;
+  unsigned ref;
+  int32_t disp;
   unsigned char incrval;
-  unsigned i;
+} element_header;
+
+/* Decompresses the payload of the segment with the given header to dst */
+static inline int decompress_segment(unsigned char* dst,
+                                     const element_header* eh, FILE* in) {
+  if (eh->cmptyp >= EX_CMPPACK)
+    return decompress_packed(dst, dst + eh->len, in, eh->rlesex,
+                             packed_width(eh->cmptyp));
+  else
+    return (*decompressors[eh->cmptyp])(dst, dst + eh->len, in, eh->rlesex);
+}
+
+/* Skips the payload of the segment with the given header */
+static inline int skip_segment(const element_header* eh, FILE* in) {
+  if (eh->cmptyp >= EX_CMPPACK)
+    return skip_bytes(in,
+                      ((uint64_t)eh->len*packed_width(eh->cmptyp) + 7)/8);
+  else
+    return (*skippers[eh->cmptyp])(eh->len, in);
+}
+
+/* Sets the compression and predictor of eh from the mode byte of an
+ * extended or compact header, reading the reference slot or displacement
+ * which follows it, if any.
+ */
+static int read_mode(element_header* eh, int mode, drachen_encoder* enc) {
+  uint32_t disp32;
+  int ch;
+
+  eh->cmptyp = mode & EX_CMPTYP;
+  eh->predictor = (mode & EX_PREDICTOR) >> EX_PRED_SHIFT;
+  eh->ref = 0;
+  eh->disp = 0;
+  if ((eh->cmptyp > (EE_CMPZER >> EE_CMP_SHIFT) &&
+       !((enc->params.features & DRACHEN_FEATURE_PACKED) &&
+         eh->cmptyp <= EX_CMPPACK_MAX)) ||
+      !has_predictor(enc, eh->predictor))
+    return DRACHEN_UNSUPPORTED;
+
+  if (eh->predictor == PRED_REF) {
+    ch = fgetc(enc->file);
+    if (ch == EOF)
+      return DRACHEN_PREMATURE_EOF;
+    if ((unsigned)ch >= enc->params.num_references)
+      return DRACHEN_UNSUPPORTED;
+    eh->ref = ch;
+  }
+
+  if (eh->predictor == PRED_DISPLACED) {
+    if (!fread(&disp32, 4, 1, enc->file))
+      return READ_FAILURE(enc->file);
+    eh->disp = (int32_t)swab32(disp32, enc);
+  }
+
+  return 0;
+}
+
+/* Reads a varint (see DRACHEN_FEATURE_COMPACT_SEGMENTS) */
+static int read_varint(uint32_t* value, drachen_encoder* enc) {
+  uint64_t v = 0;
+  unsigned shift;
+  int ch;
+
+  for (shift = 0; ; shift += 7) {
+    if (shift > 28)
+      return DRACHEN_OVERRUN;
+    ch = fgetc(enc->file);
+    if (ch == EOF)
+      return DRACHEN_PREMATURE_EOF;
+    v |= (uint64_t)(ch & 0x7F) << shift;
+    if (!(ch & 0x80))
+      break;
+  }
+
+  if (v > 0xFFFFFFFFu)
+    return DRACHEN_OVERRUN;
+  *value = v;
+  return 0;
+}
+
+/* Reads the compact header (see CH_MODE) of the segment starting at the
+ * given offset, keeping the dictionary of modes up to date.
+ */
+static int read_compact_header(element_header* eh, uint32_t offset,
+                               drachen_encoder* enc) {
+  struct segment_mode mode;
+  unsigned k, code;
+  uint32_t len32;
+  int head = fgetc(enc->file), ch, flags, status;
+  if (head == EOF)
+    return DRACHEN_PREMATURE_EOF;
+
+  /* The dictionary starts afresh with each frame */
+  if (!offset)
+    reset_modes(enc);
+
+  /* Determine length */
+  code = head >> CH_LEN_SHIFT;
+  if (code == CH_LENREST) {
+    len32 = enc->frame_size - offset;
+  } else if (code == CH_LENVAR) {
+    status = read_varint(&len32, enc);
+    if (status)
+      return status;
+    if (len32 > 0xFFFFFFFFu - (CH_LENMAX + 2))
+      return DRACHEN_OVERRUN;
+    len32 += CH_LENMAX + 2;
+  } else {
+    len32 = code + 1;
+  }
+
+  if (len32 > enc->frame_size - offset)
+    return DRACHEN_OVERRUN;
+  eh->len = len32;
+
+  k = head & CH_MODE;
+  if (k != CH_NEWMODE) {
+    use_mode(enc, k);
+    mode = enc->modes[0];
+    eh->cmptyp = mode.cmptyp;
+    eh->rlesex = mode.rlesex;
+    eh->inincr = mode.inincr;
+    eh->predictor = mode.predictor;
+    eh->ref = mode.ref;
+    eh->disp = mode.disp;
+  } else {
+    /* A new mode: the mode byte of extended headers, then the flags, then
+     * anything the predictor needs
+     */
+    ch = fgetc(enc->file);
+    flags = fgetc(enc->file);
+    if (ch == EOF || flags == EOF)
+      return DRACHEN_PREMATURE_EOF;
+    if (flags & ~(CM_SEX | CM_INCR))
+      return DRACHEN_UNSUPPORTED;
+
+    status = read_mode(eh, ch, enc);
+    if (status)
+      return status;
+    eh->rlesex = !!(flags & CM_SEX);
+    eh->inincr = !!(flags & CM_INCR);
+
+    mode.cmptyp = eh->cmptyp;
+    mode.rlesex = eh->rlesex;
+    mode.inincr = eh->inincr;
+    mode.predictor = eh->predictor;
+    mode.ref = eh->ref;
+    mode.disp = eh->disp;
+    add_mode(enc, &mode);
+  }
+
+  if (eh->inincr && !fread(&eh->incrval, 1, 1, enc->file))
+    return READ_FAILURE(enc->file);
+
+  return 0;
+}
+
+/* Reads the header of the segment starting at the given offset. */
+static int read_element_header(element_header* eh, uint32_t offset,
+                               drachen_encoder* enc) {
+  int head, lenenc, ch, status;
   uint16_t len16;
   uint32_t len32;
+
+  if (enc->params.features & DRACHEN_FEATURE_COMPACT_SEGMENTS)
+    return read_compact_header(eh, offset, enc);
+
+  head = fgetc(enc->file);
   if (head == EOF)
     return DRACHEN_PREMATURE_EOF;
 
   lenenc = head & EE_LENENC;
-  cmptyp = (head & EE_CMPTYP) >> EE_CMP_SHIFT;
-  rlesex = !!(head & EE_RLESEX);
-  inincr = !!(head & EE_ININCR);
-  prvadd = !!(head & EE_PRVADD);
+  eh->cmptyp = (head & EE_CMPTYP) >> EE_CMP_SHIFT;
+  eh->rlesex = !!(head & EE_RLESEX);
+  eh->inincr = !!(head & EE_ININCR);
+  eh->predictor = head & EE_PRVADD? PRED_PREV : PRED_NONE;
 
   /* Determine length */
   switch (lenenc) {
@@ -223,14 +599,14 @@ static int decode_one_element(uint32_t* offset, drachen_encoder* enc) {
 
   case EE_LENSRT:
     if (!fread(&len16, 2, 1, enc->file))
-      return errno;
+      return READ_FAILURE(enc->file);
 
     len32 = swab16(len16, enc) + 259;
     break;
 
   case EE_LENINT:
     if (!fread(&len32, 4, 1, enc->file))
-      return errno;
+      return READ_FAILURE(enc->file);
 
     len32 = swab32(len32, enc);
     break;
@@ -241,47 +617,461 @@ static int decode_one_element(uint32_t* offset, drachen_encoder* enc) {
 #endif
   }
 
+  /* Read the mode byte of extended headers */
+  if ((head & (EE_CMPTYP | EE_RLESEX)) == EE_EXTEND &&
+      has_extended_segments(enc)) {
+    ch = fgetc(enc->file);
+    if (ch == EOF)
+      return DRACHEN_PREMATURE_EOF;
+
+    eh->rlesex = !!(head & EE_EXTSEX);
+    status = read_mode(eh, ch, enc);
+    if (status)
+      return status;
+  }
+
   /* Read the incr value if present */
-  if (inincr) {
-    if (!fread(&incrval, 1, 1, enc->file))
-      return errno;
+  if (eh->inincr) {
+    if (!fread(&eh->incrval, 1, 1, enc->file))
+      return READ_FAILURE(enc->file);
   }
 
   /* Ensure that the length is sane */
-  if (len32 > enc->frame_size - *offset)
+  if (len32 > enc->frame_size - offset)
     return DRACHEN_OVERRUN;
 
+  eh->len = len32;
+  return 0;
+}
+
+/* Returns whether the given segment merely copies the previous frame. */
+static inline int copies_prev(const element_header* eh) {
+  return eh->cmptyp == (EE_CMPZER >> EE_CMP_SHIFT) &&
+    (eh->predictor == PRED_PREV || eh->predictor == PRED_PREV16 ||
+     eh->predictor == PRED_PREV32) &&
+    (!eh->inincr || !eh->incrval);
+}
+
+/* Applies the additive parts of a segment (the incr value and the
+ * prediction) to len bytes of decompressed data at dst, which are at the
+ * given offset within the transformed frame. prev and prev2 point to the
+ * same bytes of the previous two frames, and at is the index of those bytes
+ * within the buffers of the decoder, for finding them in references and, for
+ * displacements and spatial prediction, finding the start of the frames
+ * (which are then always held whole).
+ */
+static void apply_element_adds(unsigned char* dst,
+                               const unsigned char* prev,
+                               const unsigned char* prev2,
+                               uint32_t offset,
+                               uint32_t len,
+                               uint32_t at,
+                               const element_header* eh,
+                               const drachen_encoder* enc) {
+  uint32_t i;
+
+  /* Add inincr if set */
+  if (eh->inincr)
+    for (i = 0; i < len; ++i)
+      dst[i] += eh->incrval;
+
+  /* Add the prediction if any */
+  if (eh->predictor == PRED_REF)
+    drachen_add_prediction(dst, PRED_REF, enc->refs[eh->ref] + at, NULL,
+                           offset, len);
+  else if (eh->predictor == PRED_BACKGROUND)
+    drachen_add_prediction(dst, PRED_BACKGROUND, enc->background_frame + at,
+                           NULL, offset, len);
+  else if (eh->predictor == PRED_DISPLACED)
+    drachen_add_displaced(dst, prev - at, enc->frame_size, offset, len,
+                          eh->disp);
+  else if (eh->predictor == PRED_LEFT || eh->predictor == PRED_UP)
+    drachen_add_spatial(dst - at, at, len, spatial_dist(enc, eh->predictor));
+  else if (eh->predictor != PRED_NONE)
+    drachen_add_prediction(dst, eh->predictor, prev, prev2, offset, len);
+}
+
+/* Returns p advanced by offset, or NULL if p is NULL. */
+static inline const unsigned char* at_offset(const unsigned char* p,
+                                             uint32_t offset) {
+  return p? p + offset : NULL;
+}
+
+/* Decodes one segment into curr, predicting from prev and prev2 (which is
+ * NULL without DRACHEN_FEATURE_LINEAR).
+ */
+static int decode_one_element(uint32_t* offset,
+                              unsigned char* curr,
+                              const unsigned char* prev,
+                              const unsigned char* prev2,
+                              drachen_encoder* enc) {
+  element_header eh;
+  int status;
+
+  status = read_element_header(&eh, *offset, enc);
+  if (status)
+    return status;
+
+  /* Segments which merely copy the previous frame are by far the most
+   * common; don't bother zeroing them first.
+   */
+  if (copies_prev(&eh)) {
+    memcpy(curr+*offset, prev+*offset, eh.len);
+    *offset += eh.len;
+    return 0;
+  }
+
   /* Decompress */
-  enc->error = (*decompressors[cmptyp])(enc->curr_frame+*offset,
-                                        enc->curr_frame+*offset+len32,
-                                        enc->file, rlesex);
+  status = decompress_segment(curr+*offset, &eh, enc->file);
+  if (status)
+    return status;
+
+  apply_element_adds(curr+*offset, prev+*offset, at_offset(prev2, *offset),
+                     *offset, eh.len, *offset, &eh, enc);
+
+  *offset += eh.len;
+
+  return 0;
+}
+
+/* Decodes the segments of an entire frame into curr, predicting from prev
+ * and prev2.
+ * Sets and returns the error field.
+ */
+static int decode_frame_body(unsigned char* curr,
+                             const unsigned char* prev,
+                             const unsigned char* prev2,
+                             drachen_encoder* enc) {
+  uint32_t offset;
+
+  /* Read until failure or end of frame */
+  for (offset = 0; offset < enc->frame_size && !enc->error; )
+    enc->error = decode_one_element(&offset, curr, prev, prev2, enc);
+
+  return enc->error;
+}
+
+/* For streams with references, reads the control byte which follows the name
+ * of a frame, setting store_ref, and *dup to the frame which the current one
+ * duplicates (prev, or a reference), or NULL if it is encoded as usual.
+ * Sets and returns the error field.
+ */
+static int read_frame_control(const unsigned char** dup,
+                              const unsigned char* prev,
+                              drachen_encoder* enc) {
+  const unsigned n = enc->params.num_references;
+  unsigned store, from;
+  int ch;
+
+  *dup = NULL;
+  enc->store_ref = -1;
+  if (!enc->refs) return 0;
+
+  ch = fgetc(enc->file);
+  if (ch == EOF)
+    return enc->error = DRACHEN_PREMATURE_EOF;
+
+  store = ch & FC_STORE;
+  from = (ch & FC_DUP) >> FC_DUP_SHIFT;
+  if (store > n || (from > n && from != FC_DUP_PREV))
+    return enc->error = DRACHEN_UNSUPPORTED;
+
+  enc->store_ref = (int)store - 1;
+  if (from == FC_DUP_PREV)
+    *dup = prev;
+  else if (from)
+    *dup = enc->refs[from - 1];
+
+  return 0;
+}
+
+/* For streams with DRACHEN_FEATURE_ENTROPY, reads the BODY_* byte which
+ * begins the body of a frame which is not a duplicate, and if the segments
+ * are coded, decodes them and makes the file a stream reading them from
+ * memory, until close_frame_body().
+ * Sets and returns the error field.
+ */
+static int open_frame_body(drachen_encoder* enc) {
+  uint32_t len, coded_len;
+  FILE* body;
+  int ch;
+
+  if (!(enc->params.features & DRACHEN_FEATURE_ENTROPY))
+    return 0;
+
+  ch = fgetc(enc->file);
+  if (ch == EOF)
+    return enc->error = DRACHEN_PREMATURE_EOF;
+  if (ch == BODY_PLAIN)
+    return 0;
+  if (ch != BODY_RANS)
+    return enc->error = DRACHEN_UNSUPPORTED;
+
+  if (!fread(&len, 4, 1, enc->file) || !fread(&coded_len, 4, 1, enc->file))
+    return enc->error = READ_FAILURE(enc->file);
+  len = swab32(len, enc);
+  coded_len = swab32(coded_len, enc);
+  if (!len || coded_len >= len ||
+      len > (uint64_t)enc->frame_size * MAX_BODY_PER_BYTE)
+    return enc->error = DRACHEN_OVERRUN;
+
+  if ((enc->error = drachen_reserve(&enc->coded, &enc->coded_size,
+                                    coded_len)) ||
+      (enc->error = drachen_reserve(&enc->body, &enc->body_size, len)))
+    return enc->error;
+  if (!enc->rans_table &&
+      !(enc->rans_table = malloc(sizeof(uint32_t) * RANS_SCALE)))
+    return enc->error = ENOMEM;
+
+  if (coded_len && !fread(enc->coded, coded_len, 1, enc->file))
+    return enc->error = READ_FAILURE(enc->file);
+  if ((enc->error = drachen_rans_decode(enc->body, len, enc->coded,
+                                        coded_len, enc->rans_table)))
+    return enc->error;
+
+#ifdef HAVE_FMEMOPEN
+  body = fmemopen(enc->body, len, "rb");
+#else
+  body = tmpfile();
+  if (body && (!fwrite(enc->body, len, 1, body) ||
+               fseeko(body, 0, SEEK_SET))) {
+    fclose(body);
+    body = NULL;
+  }
+#endif
+  if (!body)
+    return enc->error = errno? errno : ENOMEM;
+
+  enc->stream_file = enc->file;
+  enc->file = body;
+  return 0;
+}
+
+/* Undoes open_frame_body() once the segments have been read, if it read
+ * them from memory, which they must have been exactly; running out of them
+ * there is not a premature end of the file.
+ * Sets and returns the error field.
+ */
+static int close_frame_body(drachen_encoder* enc) {
+  if (!enc->stream_file)
+    return enc->error;
+
+  if (enc->error == DRACHEN_PREMATURE_EOF ||
+      (!enc->error && EOF != fgetc(enc->file)))
+    enc->error = DRACHEN_OVERRUN;
+
+  fclose(enc->file);
+  enc->file = enc->stream_file;
+  enc->stream_file = NULL;
+  return enc->error;
+}
+
+/* Stores the given decoded frame into the reference slot named by its
+ * control byte, if any. This must only be done once the frame is known to be
+ * complete, since its segments may predict from the same slot.
+ */
+static void store_reference(const unsigned char* frame, drachen_encoder* enc) {
+  if (enc->store_ref >= 0)
+    memcpy(enc->refs[enc->store_ref], frame,
+           enc->roi? enc->roi_size : enc->frame_size);
+}
+
+/* Like decode_frame_body(), but for a frame rather than a group of segments,
+ * which may be a duplicate.
+ */
+static int decode_frame_contents(unsigned char* curr,
+                                 const unsigned char* prev,
+                                 const unsigned char* prev2,
+                                 drachen_encoder* enc) {
+  const unsigned char* dup;
+
+  if (read_frame_control(&dup, prev, enc))
+    return enc->error;
+
+  if (dup) {
+    memcpy(curr, dup, enc->frame_size);
+    return 0;
+  }
+
+  if (open_frame_body(enc))
+    return enc->error;
+
+  decode_frame_body(curr, prev, prev2, enc);
+  return close_frame_body(enc);
+}
+
+int drachen_read_packed_xform(drachen_encoder* enc) {
+  uint32_t i, stride;
+  unsigned plane;
+
+  /* See drachen_write_packed_xform(); prev_frame is still all zero. */
+  if (!fread(&stride, 4, 1, enc->file))
+    return enc->error = READ_FAILURE(enc->file);
+  stride = swab32(stride, enc);
+  if (!stride)
+    return enc->error = DRACHEN_BAD_XFORM;
+
+  memset(enc->xform, 0, sizeof(uint32_t) * enc->frame_size);
+  enc->coding_xform = 1;
+  for (plane = 0; plane < 4; ++plane) {
+    if (decode_frame_body(enc->curr_frame, enc->prev_frame,
+                          enc->prev2_frame, enc))
+      break;
+
+    for (i = 0; i < enc->frame_size; ++i)
+      enc->xform[i] |= (uint32_t)enc->curr_frame[i] << plane*8;
+  }
+  enc->coding_xform = 0;
   if (enc->error)
     return enc->error;
 
-  /* Add inincr if set */
-  if (inincr)
-    for (i = 0; i < len32; ++i)
-      enc->curr_frame[*offset+i] += incrval;
+  for (i = 0; i < enc->frame_size; ++i)
+    enc->xform[i] += i >= stride? enc->xform[i-stride] : i - stride;
 
-  /* Add prev_frame values if set */
-  if (prvadd)
-    for (i = 0; i < len32; ++i)
-      enc->curr_frame[*offset+i] += enc->prev_frame[*offset+i];
+  return 0;
+}
 
-  *offset += len32;
+/* Ensures that tmp_data is at least len bytes long. */
+static int ensure_tmp_data(drachen_encoder* enc, uint32_t len) {
+  if (!enc->tmp_data || enc->tmp_data_len < len) {
+    if (enc->tmp_data) free(enc->tmp_data);
+    enc->tmp_data = malloc(len);
+    if (!enc->tmp_data)
+      return ENOMEM;
+
+    enc->tmp_data_len = len;
+  }
 
   return 0;
 }
 
-int drachen_decode(unsigned char* out, char* name, uint32_t namelen,
-                   drachen_encoder* enc) {
+/* Like decode_one_element(), but for a decoder with a region of interest.
+ *
+ * *cursor is the index of the first ROI interval which may intersect the
+ * segment; it only ever moves forward within a frame.
+ */
+static int decode_one_element_roi(uint32_t* offset, uint32_t* cursor,
+                                  drachen_encoder* enc) {
+  element_header eh;
+  const struct roi_interval* roi = enc->roi;
+  uint32_t begin = *offset, end, i, from, to;
+  unsigned char* dst;
+  int status;
+
+  status = read_element_header(&eh, *offset, enc);
+  if (status)
+    return status;
+
+  end = begin + eh.len;
+  for (i = *cursor; i < enc->num_roi && roi[i].end <= begin; ++i);
+  *cursor = i;
+
+  if (i == enc->num_roi || roi[i].begin >= end) {
+    /* Nothing of interest here */
+    status = skip_segment(&eh, enc->file);
+  } else if (roi[i].begin <= begin && roi[i].end >= end) {
+    /* Entirely within one interval, decompress in place */
+    dst = enc->curr_frame + roi[i].base + begin - roi[i].begin;
+    status = decompress_segment(dst, &eh, enc->file);
+    if (!status)
+      apply_element_adds(dst, enc->prev_frame + (dst - enc->curr_frame),
+                         at_offset(enc->prev2_frame, dst - enc->curr_frame),
+                         begin, eh.len, dst - enc->curr_frame, &eh, enc);
+  } else {
+    /* Straddles the edge of the region; expand the segment to the side, and
+     * keep only the parts we care about.
+     */
+    status = ensure_tmp_data(enc, eh.len);
+    if (!status)
+      status = decompress_segment(enc->tmp_data, &eh, enc->file);
+    for (; !status && i < enc->num_roi && roi[i].begin < end; ++i) {
+      from = roi[i].begin > begin? roi[i].begin : begin;
+      to = roi[i].end < end? roi[i].end : end;
+      dst = enc->curr_frame + roi[i].base + from - roi[i].begin;
+      memcpy(dst, enc->tmp_data + from - begin, to - from);
+      apply_element_adds(dst, enc->prev_frame + (dst - enc->curr_frame),
+                         at_offset(enc->prev2_frame, dst - enc->curr_frame),
+                         from, to - from, dst - enc->curr_frame, &eh, enc);
+    }
+  }
+
+  *offset = end;
+  return status;
+}
+
+/* Reads a name coded against the name of the last frame (see
+ * DRACHEN_FEATURE_NAME_DELTA) into next_name, copying as much of it as fits
+ * into name, if non-NULL.
+ */
+static int decode_name_delta(char* name, uint32_t namelen,
+                             drachen_encoder* enc) {
+  uint32_t code, len;
+  int ch;
+
+  ch = fgetc(enc->file);
+  if (ch == EOF)
+    return DRACHEN_END_OF_STREAM;
+  ungetc(ch, enc->file);
+
+  if ((enc->error = read_varint(&code, enc)))
+    return enc->error;
+
+  if (drachen_reserve_name(&enc->next_name, &enc->next_name_cap,
+                           enc->last_name_len + 2))
+    return enc->error = ENOMEM;
+
+  if (!code) {
+    /* The last name, with its number incremented */
+    len = drachen_increment_name(enc->next_name, enc->last_name,
+                                 enc->last_name_len);
+    if (!len)
+      return enc->error = DRACHEN_UNSUPPORTED;
+  } else {
+    /* A prefix of the last name, then the rest as an NTBS */
+    len = code - 1;
+    if (len > enc->last_name_len)
+      return enc->error = DRACHEN_OVERRUN;
+    if (len)
+      memcpy(enc->next_name, enc->last_name, len);
+
+    while ((ch = fgetc(enc->file))) {
+      if (ch == EOF)
+        return enc->error = READ_FAILURE(enc->file);
+      if (drachen_reserve_name(&enc->next_name, &enc->next_name_cap, len + 2))
+        return enc->error = ENOMEM;
+      enc->next_name[len++] = ch;
+    }
+  }
+
+  enc->next_name[len] = 0;
+  enc->next_name_len = len;
+  if (enc->params.features & DRACHEN_FEATURE_CRC32C)
+    enc->name_crc = drachen_crc32c(0, enc->next_name, len + 1);
+
+  if (name && namelen) {
+    if (len > namelen - 1)
+      len = namelen - 1;
+    memcpy(name, enc->next_name, len);
+    name[len] = 0;
+  }
+
+  return 0;
+}
+
+/* Reads the name of the next frame, as described by drachen_decode(). */
+static int decode_name(char* name, uint32_t namelen, drachen_encoder* enc) {
   int ch, is_first = 1;
-  uint32_t offset;
+  unsigned char byte;
+  const int has_crc = !!(enc->params.features & DRACHEN_FEATURE_CRC32C);
 
-  /* Stop now if there is an error */
-  if (enc->error) return enc->error;
+  /* Nothing can be decoded without the frame the stream starts from */
+  if (enc->base_pending)
+    return enc->error = DRACHEN_WRONG_BASE_FRAME;
 
-  /* Read the name */
+  if (enc->params.features & DRACHEN_FEATURE_NAME_DELTA)
+    return decode_name_delta(name, namelen, enc);
+
+  enc->name_crc = 0;
   while (1) {
     ch = fgetc(enc->file);
     if (ch == EOF) {
@@ -291,6 +1081,12 @@ int drachen_decode(unsigned char* out, char* name, uint32_t namelen,
       enc->error = DRACHEN_PREMATURE_EOF;
       return enc->error;
     }
+    is_first = 0;
+
+    if (has_crc) {
+      byte = ch;
+      enc->name_crc = drachen_crc32c(enc->name_crc, &byte, 1);
+    }
 
     if (name && namelen) {
       if (--namelen)
@@ -303,18 +1099,830 @@ int drachen_decode(unsigned char* out, char* name, uint32_t namelen,
     if (!ch) break;
   }
 
-  /* Read until failure or end of frame */
-  for (offset = 0; offset < enc->frame_size && !enc->error; )
-    enc->error = decode_one_element(&offset, enc);
+  return 0;
+}
+
+/* Makes next_name the name of the last frame */
+static void swap_names(drachen_encoder* enc) {
+  char* name = enc->last_name;
+  uint32_t cap = enc->last_name_cap;
+
+  enc->last_name = enc->next_name;
+  enc->last_name_len = enc->next_name_len;
+  enc->last_name_cap = enc->next_name_cap;
+  enc->next_name = name;
+  enc->next_name_cap = cap;
+}
+
+/* Reads whatever follows the segments of a frame. If frame is non-NULL, it is
+ * the complete transformed frame, and is checked against the checksum, if
+ * any. Sets and returns the error field.
+ */
+static int decode_frame_trailer(const unsigned char* frame,
+                                drachen_encoder* enc) {
+  uint32_t crc;
+
+  if (enc->error) return enc->error;
+
+  if (enc->params.features & DRACHEN_FEATURE_CRC32C) {
+    if (!fread(&crc, 4, 1, enc->file))
+      return enc->error = READ_FAILURE(enc->file);
+
+    if (frame &&
+        swab32(crc, enc) != drachen_crc32c(enc->name_crc, frame,
+                                           enc->frame_size))
+      return enc->error = DRACHEN_BAD_CHECKSUM;
+  }
+
+  /* The frame is complete, so the names which follow are coded against its
+   * name
+   */
+  if (enc->params.features & DRACHEN_FEATURE_NAME_DELTA)
+    swap_names(enc);
+
+  return 0;
+}
+
+/* Called before reading a frame. When following a growing stream, remembers
+ * where the frame starts, so that it can be read again if it turns out to be
+ * incomplete.
+ */
+static void begin_frame(drachen_encoder* enc) {
+  if (enc->follow)
+    enc->frame_start = ftello(enc->file);
+}
+
+/* Called with the final status of reading a frame. When following a growing
+ * stream, an incomplete frame is rewound and reported as the end of the
+ * stream, so that it is simply read again on the next call.
+ */
+static int end_frame(int status, drachen_encoder* enc) {
+  if (!enc->follow)
+    return status;
+
+  if (enc->error == DRACHEN_PREMATURE_EOF && enc->frame_start >= 0) {
+    clearerr(enc->file);
+    if (!fseeko(enc->file, enc->frame_start, SEEK_SET)) {
+      enc->error = 0;
+      return DRACHEN_END_OF_STREAM;
+    }
+  }
+
+  /* Make sure the next read actually tries the file again */
+  if (status == DRACHEN_END_OF_STREAM)
+    clearerr(enc->file);
+
+  return status;
+}
+
+static int decode_frame(unsigned char* out, char* name, uint32_t namelen,
+                        drachen_encoder* enc) {
+  int status;
+
+  /* Stop now if there is an error */
+  if (enc->error) return enc->error;
+
+  /* Read the name */
+  status = decode_name(name, namelen, enc);
+  if (status)
+    return status;
 
   /* If no error, reverse the transformation into out, then update the
-   * "previous frame".
+   * "previous frame". Every byte of curr_frame has been rewritten, so the
+   * buffers can simply be rotated.
    */
-  if (!enc->error) {
-    for (offset = 0; offset < enc->frame_size; ++offset)
-      out[offset] = enc->curr_frame[enc->xform[offset]];
-    memcpy(enc->prev_frame, enc->curr_frame, enc->frame_size);
+  if (!decode_frame_contents(enc->curr_frame, enc->prev_frame,
+                             enc->prev2_frame, enc) &&
+      !decode_frame_trailer(enc->curr_frame, enc)) {
+    drachen_untransform_frame(out, enc->curr_frame, enc);
+
+    store_reference(enc->curr_frame, enc);
+    update_background(enc, enc->curr_frame);
+    push_frame(enc);
   }
 
   return enc->error;
 }
+
+int drachen_decode(unsigned char* out, char* name, uint32_t namelen,
+                   drachen_encoder* enc) {
+  if (enc->error) return enc->error;
+  /* The history only holds the region of interest */
+  if (enc->roi) return enc->error = EINVAL;
+
+  begin_frame(enc);
+  return end_frame(decode_frame(out, name, namelen, enc), enc);
+}
+
+int drachen_decode_batch(unsigned char* out, uint32_t max_frames,
+                         uint32_t* num_frames,
+                         char* names, uint32_t names_len,
+                         uint32_t* name_offsets,
+                         drachen_encoder* enc) {
+  const uint32_t frame_size = enc->frame_size;
+  uint32_t n, name_pos = 0;
+  unsigned char* dst;
+  const unsigned char* prev, * prev2;
+  int status = 0;
+
+  *num_frames = 0;
+  if (enc->error) return enc->error;
+  if (enc->roi) return enc->error = EINVAL;
+
+  for (n = 0; n < max_frames; ++n) {
+    begin_frame(enc);
+    if (names) {
+      if (name_pos < names_len) {
+        name_offsets[n] = name_pos;
+        status = decode_name(names + name_pos, names_len - name_pos, enc);
+        if (!status)
+          name_pos += strlen(names + name_pos) + 1;
+      } else {
+        /* Out of space; point at the final NUL */
+        name_offsets[n] = names_len - 1;
+        status = decode_name(NULL, 0, enc);
+      }
+    } else {
+      status = decode_name(NULL, 0, enc);
+    }
+
+    if (status)
+      break;
+
+    dst = out + (size_t)n * frame_size;
+    if (enc->xform_is_identity && !has_bitplanes(enc)) {
+      /* Decode straight into the output, predicting from the frames before
+       * it in the same array.
+       */
+      prev = n? dst - frame_size : enc->prev_frame;
+      prev2 = !enc->prev2_frame? NULL :
+        n > 1? dst - 2*(size_t)frame_size :
+        n? enc->prev_frame : enc->prev2_frame;
+      if (decode_frame_contents(dst, prev, prev2, enc) ||
+          decode_frame_trailer(dst, enc))
+        break;
+
+      store_reference(dst, enc);
+      update_background(enc, dst);
+    } else {
+      if (decode_frame_contents(enc->curr_frame, enc->prev_frame,
+                                enc->prev2_frame, enc) ||
+          decode_frame_trailer(enc->curr_frame, enc))
+        break;
+
+      drachen_untransform_frame(dst, enc->curr_frame, enc);
+      store_reference(enc->curr_frame, enc);
+      update_background(enc, enc->curr_frame);
+      push_frame(enc);
+    }
+  }
+
+  *num_frames = n;
+
+  status = end_frame(enc->error? enc->error : status, enc);
+  if (enc->error)
+    return enc->error;
+
+  /* Identity-transform frames were never copied into the history */
+  if (enc->xform_is_identity && !has_bitplanes(enc) && n) {
+    if (enc->prev2_frame)
+      memcpy(enc->prev2_frame,
+             n > 1? out + (size_t)(n-2) * frame_size : enc->prev_frame,
+             frame_size);
+    memcpy(enc->prev_frame, out + (size_t)(n-1) * frame_size, frame_size);
+  }
+
+  return n || !max_frames? 0 : status;
+}
+
+static int verify_frame(char* name, uint32_t namelen, drachen_encoder* enc) {
+  int status;
+
+  if (enc->error) return enc->error;
+
+  status = decode_name(name, namelen, enc);
+  if (status)
+    return status;
+
+  /* The history must still be kept, but the frame is never reassembled. */
+  if (!decode_frame_contents(enc->curr_frame, enc->prev_frame,
+                             enc->prev2_frame, enc) &&
+      !decode_frame_trailer(enc->curr_frame, enc)) {
+    store_reference(enc->curr_frame, enc);
+    update_background(enc, enc->curr_frame);
+    push_frame(enc);
+  }
+
+  return enc->error;
+}
+
+int drachen_verify(char* name, uint32_t namelen, drachen_encoder* enc) {
+  if (enc->error) return enc->error;
+  if (enc->roi) return enc->error = EINVAL;
+
+  begin_frame(enc);
+  return end_frame(verify_frame(name, namelen, enc), enc);
+}
+
+/* Appends the range [begin,end) to the list of changes, merging it with the
+ * previous range if they are adjacent, or if there is no room for another.
+ */
+static void add_change(drachen_range* changes, uint32_t max_changes,
+                       uint32_t* num_changes, uint32_t begin, uint32_t end) {
+  if (*num_changes &&
+      (changes[*num_changes-1].end == begin || *num_changes == max_changes)) {
+    changes[*num_changes-1].end = end;
+  } else {
+    changes[*num_changes].begin = begin;
+    changes[*num_changes].end = end;
+    ++*num_changes;
+  }
+}
+
+/* Appends len bytes at the given offset to enc->changed. */
+static int record_change(uint32_t offset, uint32_t len, drachen_encoder* enc) {
+  drachen_range* changed;
+
+  if (enc->num_changed &&
+      enc->changed[enc->num_changed-1].end == offset) {
+    enc->changed[enc->num_changed-1].end += len;
+    return 0;
+  }
+
+  if (enc->num_changed == enc->changed_cap) {
+    changed = realloc(enc->changed, sizeof(drachen_range) *
+                      (enc->changed_cap? enc->changed_cap*2 : 16));
+    if (!changed)
+      return ENOMEM;
+
+    enc->changed = changed;
+    enc->changed_cap = enc->changed_cap? enc->changed_cap*2 : 16;
+  }
+
+  enc->changed[enc->num_changed].begin = offset;
+  enc->changed[enc->num_changed].end = offset + len;
+  ++enc->num_changed;
+  return 0;
+}
+
+/* Like decode_one_element(), but segments which are plain copies of the
+ * previous frame are not expanded into curr_frame. Every other segment is
+ * recorded in enc->changed.
+ */
+static int decode_one_element_changes(uint32_t* offset,
+                                      drachen_encoder* enc) {
+  element_header eh;
+  int status;
+
+  status = read_element_header(&eh, *offset, enc);
+  if (status)
+    return status;
+
+  if (copies_prev(&eh)) {
+    /* Spatial prediction may need the bytes of the current frame, which are
+     * otherwise only held by prev_frame until the end of the frame.
+     */
+    if (enc->params.features & DRACHEN_FEATURE_SPATIAL)
+      memcpy(enc->curr_frame+*offset, enc->prev_frame+*offset, eh.len);
+    *offset += eh.len;
+    return 0;
+  }
+
+  status = decompress_segment(enc->curr_frame+*offset, &eh, enc->file);
+  if (status)
+    return status;
+
+  apply_element_adds(enc->curr_frame+*offset, enc->prev_frame+*offset,
+                     at_offset(enc->prev2_frame, *offset), *offset, eh.len,
+                     *offset, &eh, enc);
+
+  status = record_change(*offset, eh.len, enc);
+  *offset += eh.len;
+  return status;
+}
+
+/* For streams with bit planes, rewrites the list of changes (which is in
+ * terms of the split frame) in terms of the joined frame, where every changed
+ * plane byte changes a group of eight bytes. The changed groups are joined
+ * into curr_frame from prev_frame, which must already be up to date.
+ */
+static int join_changed_bitplanes(drachen_encoder* enc) {
+  const uint32_t begin = enc->params.bitplane_begin;
+  const uint32_t end = enc->params.bitplane_end;
+  const uint32_t plane = (end - begin) / 8;
+  drachen_range* joined;
+  unsigned char* groups;
+  uint32_t i, q, from, to, n = 0, runs = 0;
+
+  if (ensure_tmp_data(enc, plane))
+    return ENOMEM;
+
+  groups = enc->tmp_data;
+  memset(groups, 0, plane);
+  for (i = 0; i < enc->num_changed; ++i) {
+    from = enc->changed[i].begin > begin? enc->changed[i].begin : begin;
+    to = enc->changed[i].end < end? enc->changed[i].end : end;
+    if (to >= from + plane)
+      memset(groups, 1, plane);
+    else
+      for (; from < to; ++from)
+        groups[(from - begin) % plane] = 1;
+  }
+
+  for (q = 0; q < plane; ++q)
+    if (groups[q] && (q == 0 || !groups[q-1]))
+      ++runs;
+
+  /* At most one change can straddle each end of the region */
+  joined = malloc(sizeof(drachen_range) * (enc->num_changed + runs + 1));
+  if (!joined)
+    return ENOMEM;
+
+  for (i = 0; i < enc->num_changed && enc->changed[i].begin < begin; ++i) {
+    joined[n] = enc->changed[i];
+    if (joined[n].end > begin)
+      joined[n].end = begin;
+    ++n;
+  }
+
+  for (q = 0; q < plane; ++q) {
+    if (!groups[q]) continue;
+
+    drachen_join_bitplane_group(enc->curr_frame + begin + q*8,
+                                enc->prev_frame + begin, end - begin, q);
+    if (n && joined[n-1].end == begin + q*8) {
+      joined[n-1].end += 8;
+    } else {
+      joined[n].begin = begin + q*8;
+      joined[n].end = joined[n].begin + 8;
+      ++n;
+    }
+  }
+
+  for (i = 0; i < enc->num_changed; ++i) {
+    if (enc->changed[i].end <= end) continue;
+
+    joined[n] = enc->changed[i];
+    if (joined[n].begin < end)
+      joined[n].begin = end;
+    if (n && joined[n-1].end == joined[n].begin)
+      joined[n-1].end = joined[n].end;
+    else
+      ++n;
+  }
+
+  free(enc->changed);
+  enc->changed = joined;
+  enc->changed_cap = enc->num_changed + runs + 1;
+  enc->num_changed = n;
+  return 0;
+}
+
+static int decode_frame_changes(unsigned char* out,
+                                char* name, uint32_t namelen,
+                                drachen_range* changes, uint32_t max_changes,
+                                uint32_t* num_changes,
+                                drachen_encoder* enc) {
+  uint32_t offset, i, t, begin, end;
+  const unsigned char* dup;
+  int status;
+
+  *num_changes = 0;
+  if (enc->error) return enc->error;
+
+  status = decode_name(name, namelen, enc);
+  if (status)
+    return status;
+
+  enc->num_changed = 0;
+  if (read_frame_control(&dup, enc->prev_frame, enc))
+    return enc->error;
+
+  /* A duplicate of the previous frame changes nothing at all */
+  if (dup && dup != enc->prev_frame) {
+    memcpy(enc->curr_frame, dup, enc->frame_size);
+    enc->error = record_change(0, enc->frame_size, enc);
+  }
+
+  if (!dup && open_frame_body(enc))
+    return enc->error;
+
+  for (offset = 0; !dup && offset < enc->frame_size && !enc->error; )
+    enc->error = decode_one_element_changes(&offset, enc);
+
+  if (close_frame_body(enc))
+    return enc->error;
+
+  /* Only the changed parts of the previous frame need to be updated. The
+   * frame before it is simply copied whole, rather than also keeping track
+   * of what changed in the frame before.
+   */
+  if (enc->prev2_frame)
+    memcpy(enc->prev2_frame, enc->prev_frame, enc->frame_size);
+  for (i = 0; i < enc->num_changed; ++i)
+    memcpy(enc->prev_frame + enc->changed[i].begin,
+           enc->curr_frame + enc->changed[i].begin,
+           enc->changed[i].end - enc->changed[i].begin);
+
+  if (decode_frame_trailer(enc->prev_frame, enc))
+    return enc->error;
+
+  store_reference(enc->prev_frame, enc);
+  update_background(enc, enc->prev_frame);
+
+  if (has_bitplanes(enc) && (enc->error = join_changed_bitplanes(enc)))
+    return enc->error;
+
+  if (enc->xform_is_identity) {
+    for (i = 0; i < enc->num_changed; ++i) {
+      begin = enc->changed[i].begin;
+      end = enc->changed[i].end;
+      memcpy(out + begin, enc->curr_frame + begin, end - begin);
+      add_change(changes, max_changes, num_changes, begin, end);
+    }
+
+    return 0;
+  }
+
+  /* For arbitrary transforms, scatter the changed bytes through the inverse
+   * transform, marking which untransformed bytes were touched; then collect
+   * the marked bytes into ranges (clearing the mask for the next frame).
+   */
+  if (!enc->inverse_xform) {
+    enc->inverse_xform = malloc(sizeof(uint32_t) * enc->frame_size);
+    enc->change_mask = calloc(enc->frame_size/8 + 1, 1);
+    if (!enc->inverse_xform || !enc->change_mask)
+      return enc->error = ENOMEM;
+
+    for (i = 0; i < enc->frame_size; ++i)
+      enc->inverse_xform[xform_index(enc, i)] = i;
+  }
+
+  if (!enc->num_changed)
+    return 0;
+
+  for (i = 0; i < enc->num_changed; ++i) {
+    for (t = enc->changed[i].begin; t < enc->changed[i].end; ++t) {
+      offset = enc->inverse_xform[t];
+      out[offset] = enc->curr_frame[t];
+      enc->change_mask[offset >> 3] |= 1 << (offset & 7);
+    }
+  }
+
+  for (i = 0; i <= enc->frame_size/8; ++i) {
+    if (!enc->change_mask[i]) continue;
+
+    for (t = 0; t < 8; ++t)
+      if (enc->change_mask[i] & (1 << t))
+        add_change(changes, max_changes, num_changes, i*8+t, i*8+t+1);
+
+    enc->change_mask[i] = 0;
+  }
+
+  return 0;
+}
+
+int drachen_decode_changes(unsigned char* out, char* name, uint32_t namelen,
+                           drachen_range* changes, uint32_t max_changes,
+                           uint32_t* num_changes,
+                           drachen_encoder* enc) {
+  int status;
+
+  *num_changes = 0;
+  if (enc->error) return enc->error;
+  if (enc->roi) return enc->error = EINVAL;
+
+  begin_frame(enc);
+  status = end_frame(decode_frame_changes(out, name, namelen, changes,
+                                          max_changes, num_changes, enc),
+                     enc);
+  if (status)
+    *num_changes = 0;
+  return status;
+}
+
+/* Finds the ROI interval containing the given transformed index, which must
+ * exist.
+ */
+static const struct roi_interval* find_roi_interval(
+  const drachen_encoder* enc, uint32_t ix
+) {
+  uint32_t lo = 0, hi = enc->num_roi, mid;
+  while (hi - lo > 1) {
+    mid = (lo + hi) / 2;
+    if (enc->roi[mid].begin <= ix)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  return enc->roi + lo;
+}
+
+int drachen_set_roi(drachen_encoder* enc,
+                    const drachen_range* ranges,
+                    unsigned num_ranges) {
+  unsigned char* mask = NULL, * prev = NULL, * curr = NULL, * prev2 = NULL;
+  unsigned char** refs = NULL, * background_frame = NULL;
+  uint16_t* background = NULL;
+  struct roi_interval* roi = NULL;
+  const struct roi_interval* in;
+  drachen_range* ranges_copy = NULL;
+  uint32_t* map = NULL;
+  uint32_t i, ix, num_roi, size, map_len, extra = 0;
+  const uint32_t bp_begin = enc->params.bitplane_begin;
+  const uint32_t bp_end = enc->params.bitplane_end;
+  int in_bitplanes = 0;
+  unsigned r;
+
+  if (enc->error) return enc->error;
+  if (enc->roi) return enc->error = EINVAL;
+
+  map_len = 0;
+  for (r = 0; r < num_ranges; ++r) {
+    if (ranges[r].begin > ranges[r].end ||
+        ranges[r].end > enc->frame_size)
+      return enc->error = EINVAL;
+    map_len += ranges[r].end - ranges[r].begin;
+  }
+
+  /* Mark every transformed byte within the region */
+  mask = calloc(enc->frame_size/8 + 1, 1);
+  if (!mask) goto oom;
+  for (r = 0; r < num_ranges; ++r)
+    for (i = ranges[r].begin; i < ranges[r].end; ++i) {
+      ix = xform_index(enc, i);
+      if (ix >= bp_begin && ix < bp_end)
+        in_bitplanes = 1;
+      else
+        mask[ix >> 3] |= 1 << (ix & 7);
+    }
+
+  /* Any byte within the bit planes needs bits from all over them, so the
+   * whole region is decoded, and joined after the compacted frame.
+   */
+  if (in_bitplanes) {
+    for (ix = bp_begin; ix < bp_end; ++ix)
+      mask[ix >> 3] |= 1 << (ix & 7);
+    extra = bp_end - bp_begin;
+  }
+
+  /* Displaced and spatially predicted segments (see
+   * DRACHEN_FEATURE_DISPLACED and DRACHEN_FEATURE_SPATIAL) may predict any
+   * byte from any other, so the whole frame is kept.
+   */
+  if (enc->params.features & (DRACHEN_FEATURE_DISPLACED |
+                              DRACHEN_FEATURE_SPATIAL))
+    memset(mask, 0xFF, enc->frame_size/8 + 1);
+
+  /* Words (see DRACHEN_FEATURE_WORD_DELTA) can only be decoded whole, so
+   * every aligned group of four bytes which is marked at all is marked
+   * entirely.
+   */
+  if (enc->params.features & DRACHEN_FEATURE_WORD_DELTA)
+    for (i = 0; i <= enc->frame_size/8; ++i)
+      mask[i] = (mask[i] & 0x0F? 0x0F : 0) | (mask[i] & 0xF0? 0xF0 : 0);
+
+#define MARKED(ix) (mask[(ix) >> 3] & (1 << ((ix) & 7)))
+  /* Coalesce the marked bytes into intervals; the first pass only counts
+   * them.
+   */
+  num_roi = 0;
+  for (i = 0; i < enc->frame_size; ++i)
+    if (MARKED(i) && (i == 0 || !MARKED(i-1)))
+      ++num_roi;
+
+  roi = malloc(sizeof(struct roi_interval) * (num_roi? num_roi : 1));
+  if (!roi) goto oom;
+  num_roi = size = 0;
+  for (i = 0; i < enc->frame_size; ++i) {
+    if (!MARKED(i)) continue;
+    if (i == 0 || !MARKED(i-1)) {
+      roi[num_roi].begin = i;
+      roi[num_roi].base = size;
+      ++num_roi;
+    }
+    roi[num_roi-1].end = i+1;
+    ++size;
+  }
+#undef MARKED
+  free(mask);
+  mask = NULL;
+
+  ranges_copy = malloc(sizeof(drachen_range) * (num_ranges? num_ranges : 1));
+  map = malloc(sizeof(uint32_t) * (map_len? map_len : 1));
+  prev = malloc(size + extra? size + extra : 1);
+  curr = malloc(size + extra? size + extra : 1);
+  if (!ranges_copy || !map || !prev || !curr) goto oom;
+  if (enc->prev2_frame) {
+    prev2 = malloc(size + extra? size + extra : 1);
+    if (!prev2) goto oom;
+  }
+  if (enc->refs) {
+    refs = calloc(enc->params.num_references, sizeof(unsigned char*));
+    if (!refs) goto oom;
+    for (r = 0; r < enc->params.num_references; ++r)
+      if (!(refs[r] = malloc(size? size : 1))) goto oom;
+  }
+  if (enc->background) {
+    background = malloc(sizeof(uint16_t) * (size? size : 1));
+    background_frame = malloc(size? size : 1);
+    if (!background || !background_frame) goto oom;
+  }
+
+  memcpy(ranges_copy, ranges, sizeof(drachen_range) * num_ranges);
+  enc->roi = roi;
+  enc->num_roi = num_roi;
+  if (in_bitplanes) {
+    in = find_roi_interval(enc, bp_begin);
+    enc->roi_bitplane = in->base + bp_begin - in->begin;
+  }
+
+  map_len = 0;
+  for (r = 0; r < num_ranges; ++r) {
+    for (i = ranges[r].begin; i < ranges[r].end; ++i) {
+      ix = xform_index(enc, i);
+      if (ix >= bp_begin && ix < bp_end) {
+        map[map_len++] = size + ix - bp_begin;
+      } else {
+        in = find_roi_interval(enc, ix);
+        map[map_len++] = in->base + ix - in->begin;
+      }
+    }
+  }
+
+  /* Carry over whatever history has been decoded so far */
+  for (i = 0; i < num_roi; ++i) {
+    memcpy(prev + roi[i].base, enc->prev_frame + roi[i].begin,
+           roi[i].end - roi[i].begin);
+    if (prev2)
+      memcpy(prev2 + roi[i].base, enc->prev2_frame + roi[i].begin,
+             roi[i].end - roi[i].begin);
+    for (r = 0; refs && r < enc->params.num_references; ++r)
+      memcpy(refs[r] + roi[i].base, enc->refs[r] + roi[i].begin,
+             roi[i].end - roi[i].begin);
+    if (background) {
+      memcpy(background + roi[i].base, enc->background + roi[i].begin,
+             sizeof(uint16_t) * (roi[i].end - roi[i].begin));
+      memcpy(background_frame + roi[i].base,
+             enc->background_frame + roi[i].begin,
+             roi[i].end - roi[i].begin);
+    }
+  }
+
+  free(enc->prev_frame);
+  free(enc->curr_frame);
+  if (prev2) free(enc->prev2_frame);
+  enc->prev_frame = prev;
+  enc->curr_frame = curr;
+  if (prev2) enc->prev2_frame = prev2;
+  if (refs) {
+    for (r = 0; r < enc->params.num_references; ++r)
+      free(enc->refs[r]);
+    free(enc->refs);
+    enc->refs = refs;
+  }
+  if (background) {
+    free(enc->background);
+    free(enc->background_frame);
+    enc->background = background;
+    enc->background_frame = background_frame;
+  }
+  enc->roi_size = size;
+  enc->roi_ranges = ranges_copy;
+  enc->num_roi_ranges = num_ranges;
+  enc->roi_map = map;
+  return 0;
+
+  oom:
+  if (mask) free(mask);
+  if (roi) free(roi);
+  if (ranges_copy) free(ranges_copy);
+  if (map) free(map);
+  if (prev) free(prev);
+  if (curr) free(curr);
+  if (prev2) free(prev2);
+  if (refs) {
+    for (r = 0; r < enc->params.num_references; ++r)
+      if (refs[r]) free(refs[r]);
+    free(refs);
+  }
+  if (background) free(background);
+  if (background_frame) free(background_frame);
+  enc->roi = NULL;
+  enc->num_roi = 0;
+  enc->roi_bitplane = 0xFFFFFFFFu;
+  return enc->error = ENOMEM;
+}
+
+static int decode_frame_roi(unsigned char* out, char* name, uint32_t namelen,
+                            drachen_encoder* enc) {
+  uint32_t offset, cursor, i, k;
+  const unsigned char* dup;
+  unsigned r;
+  int status;
+
+  if (enc->error) return enc->error;
+  if (!enc->roi) return enc->error = EINVAL;
+
+  status = decode_name(name, namelen, enc);
+  if (status)
+    return status;
+
+  if (!read_frame_control(&dup, enc->prev_frame, enc) && dup)
+    memcpy(enc->curr_frame, dup, enc->roi_size);
+
+  if (!enc->error && !dup)
+    open_frame_body(enc);
+
+  cursor = 0;
+  for (offset = 0; !dup && offset < enc->frame_size && !enc->error; )
+    enc->error = decode_one_element_roi(&offset, &cursor, enc);
+  close_frame_body(enc);
+
+  /* Without the whole frame, there is nothing to check the checksum
+   * against.
+   */
+  if (!decode_frame_trailer(NULL, enc)) {
+    if (enc->roi_bitplane != 0xFFFFFFFFu)
+      drachen_join_bitplanes(enc->curr_frame + enc->roi_size,
+                             enc->curr_frame + enc->roi_bitplane,
+                             enc->params.bitplane_end -
+                             enc->params.bitplane_begin);
+
+    k = 0;
+    for (r = 0; r < enc->num_roi_ranges; ++r)
+      for (i = enc->roi_ranges[r].begin; i < enc->roi_ranges[r].end; ++i)
+        out[i] = enc->curr_frame[enc->roi_map[k++]];
+
+    /* Every byte in the region was rewritten, so the frame joins the history
+     * as it is.
+     */
+    store_reference(enc->curr_frame, enc);
+    update_background(enc, enc->curr_frame);
+    push_frame(enc);
+  }
+
+  return enc->error;
+}
+
+int drachen_decode_roi(unsigned char* out, char* name, uint32_t namelen,
+                       drachen_encoder* enc) {
+  if (enc->error) return enc->error;
+  if (!enc->roi) return enc->error = EINVAL;
+
+  begin_frame(enc);
+  return end_frame(decode_frame_roi(out, name, namelen, enc), enc);
+}
+
+void drachen_set_follow(drachen_encoder* enc, int follow) {
+  enc->follow = follow;
+}
+
+int drachen_wait_for_data(drachen_encoder* enc, unsigned timeout_ms) {
+#ifdef HAVE_SYS_INOTIFY_H
+  char path[64];
+  char events[4096];
+  struct pollfd pfd;
+
+  if (enc->notify_fd < 0) {
+    /* Set up the watch on first use. Data may have arrived between the
+     * caller's last read and now, so return immediately rather than
+     * risking sleeping through it.
+     */
+    enc->notify_fd = inotify_init();
+    if (enc->notify_fd >= 0) {
+      snprintf(path, sizeof(path), "/proc/self/fd/%d", fileno(enc->file));
+      if (inotify_add_watch(enc->notify_fd, path, IN_MODIFY) >= 0)
+        return 0;
+
+      close(enc->notify_fd);
+    }
+
+    /* Can't watch this file; just poll it */
+    enc->notify_fd = -2;
+  }
+
+  if (enc->notify_fd >= 0) {
+    pfd.fd = enc->notify_fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, timeout_ms) < 0)
+      return errno;
+
+    /* Discard the events, we only care that there were any */
+    if (pfd.revents & POLLIN)
+      if (read(enc->notify_fd, events, sizeof(events)) < 0)
+        return errno;
+
+    return 0;
+  }
+#endif /* HAVE_SYS_INOTIFY_H */
+
+#ifdef HAVE_POLL_H
+  if (poll(NULL, 0, timeout_ms) < 0)
+    return errno;
+#else
+  sleep((timeout_ms + 999) / 1000);
+#endif
+  return 0;
+}
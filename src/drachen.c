@@ -7,6 +7,9 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #include "drachen.h"
 #include "common.h"
@@ -18,7 +21,7 @@ static drachen_block_spec default_block_spec[1] = {
 /**
  * Creates a drachen_encoder with the given fields.
  *
- * xform is left uninitialised (but is allocated).
+ * The transform is initially the identity.
  *
  * Returns the new encoder if successful, or NULL if memory allocation failed.
  */
@@ -43,65 +46,605 @@ drachen_encoder* drachen_alloc_encoder(FILE* file,
     return NULL;
   }
 
+  encoder->prev2_frame = NULL;
+  encoder->refs = NULL;
+  encoder->ref_crc = NULL;
+  encoder->prev_crc_valid = 0;
+  encoder->ref_valid = encoder->ref_pinned = encoder->next_ref = 0;
+  encoder->pin_ref = encoder->store_ref = -1;
+  encoder->base_pending = 0;
+  encoder->coding_xform = 0;
+  encoder->background = NULL;
+  encoder->background_frame = NULL;
+  encoder->background_started = 0;
+  encoder->last_disp = 0;
   encoder->file = file;
-  encoder->xform = malloc(sizeof(uint32_t)*frame_size);
-  if (!encoder->xform) {
-    free(encoder->prev_frame);
-    free(encoder->curr_frame);
-    free(encoder);
-    return NULL;
-  }
+  encoder->xform = NULL;
+  encoder->plan = NULL;
+  encoder->record_fields = NULL;
+  encoder->bitplane_frame = NULL;
+  memset(&encoder->xform_spec, 0, sizeof(drachen_xform_spec));
+  encoder->xform_spec.kind = DRACHEN_XFORM_IDENTITY;
+  encoder->xform_is_identity = 1;
 
+  drachen_default_stream_params(&encoder->params);
   encoder->error = 0;
+  encoder->follow = 0;
+  encoder->frame_start = -1;
+  encoder->notify_fd = -1;
   encoder->tmp_data = NULL;
+  encoder->last_name = encoder->next_name = NULL;
+  encoder->last_name_len = encoder->next_name_len = 0;
+  encoder->last_name_cap = encoder->next_name_cap = 0;
+  encoder->optimal_segments = 0;
+  encoder->block_meths = NULL;
+  encoder->block_offset = encoder->block_end = NULL;
+  encoder->blocks_cap = 0;
+  encoder->max_error = 0;
+  encoder->target_size = 0;
+  encoder->lossy_frame = NULL;
+  encoder->body_file = encoder->stream_file = NULL;
+  encoder->body_mem = NULL;
+  encoder->body_mem_size = 0;
+  encoder->body = encoder->coded = NULL;
+  encoder->body_size = encoder->coded_size = 0;
+  encoder->rans_table = NULL;
+  encoder->roi = NULL;
+  encoder->roi_bitplane = 0xFFFFFFFFu;
+  encoder->num_roi = encoder->roi_size = 0;
+  encoder->roi_ranges = NULL;
+  encoder->num_roi_ranges = 0;
+  encoder->roi_map = NULL;
+  encoder->inverse_xform = NULL;
+  encoder->change_mask = NULL;
+  encoder->changed = NULL;
+  encoder->num_changed = encoder->changed_cap = 0;
 
   return encoder;
 }
 
+void drachen_default_stream_params(drachen_stream_params* params) {
+  memset(params, 0, sizeof(drachen_stream_params));
+}
+
 drachen_encoder* drachen_create_encoder(FILE* out,
                                         uint32_t frame_size,
                                         const uint32_t* xform) {
+  return drachen_create_encoder_ex(out, frame_size, xform, NULL);
+}
+
+/* Writes the reverse transformation matrix of the given encoder, which must
+ * have no table, to its file.
+ */
+static int write_spec_xform(drachen_encoder* enc) {
+  uint32_t chunk[1024], i, n;
+
+  for (i = 0; i < enc->frame_size; i += n) {
+    for (n = 0; n < 1024 && i + n < enc->frame_size; ++n)
+      chunk[n] = xform_index(enc, i + n);
+    if (!fwrite(chunk, n*sizeof(uint32_t), 1, enc->file))
+      return 0;
+  }
+
+  return 1;
+}
+
+/* Writes the transform descriptor of the given encoder, whose original
+ * table (if it has one) is xform, to its file. Sets and returns the error
+ * field.
+ */
+static int write_xform_desc(drachen_encoder* enc, const uint32_t* xform) {
+  uint32_t desc[7];
+  unsigned n = 1, f;
+
+  if (enc->xform) {
+    desc[0] = XFORM_DESC_TABLE;
+  } else if (enc->xform_is_identity) {
+    desc[0] = DRACHEN_XFORM_IDENTITY;
+  } else if (enc->xform_spec.kind == DRACHEN_XFORM_IMAGE) {
+    desc[0] = DRACHEN_XFORM_IMAGE;
+    desc[1] = enc->xform_spec.offset;
+    desc[2] = enc->xform_spec.cols;
+    desc[3] = enc->xform_spec.rows;
+    desc[4] = enc->xform_spec.num_components;
+    desc[5] = enc->xform_spec.block_width;
+    desc[6] = enc->xform_spec.block_height;
+    n = 7;
+  } else {
+    desc[0] = DRACHEN_XFORM_RECORD;
+    desc[1] = enc->xform_spec.offset;
+    desc[2] = enc->xform_spec.record_size;
+    desc[3] = enc->xform_spec.num_records;
+    desc[4] = enc->xform_spec.split_bytes;
+    desc[5] = enc->xform_spec.num_fields;
+    n = 6;
+  }
+
+  if (!fwrite(desc, n*sizeof(uint32_t), 1, enc->file))
+    return enc->error = errno;
+
+  /* Record layouts are followed by the size of each field */
+  if (desc[0] == DRACHEN_XFORM_RECORD)
+    for (f = 0; f < enc->xform_spec.num_fields; ++f)
+      if (!fwrite(&enc->record_fields[f], 4, 1, enc->file))
+        return enc->error = errno;
+
+  if (enc->xform)
+    return drachen_write_packed_xform(enc, xform);
+
+  return 0;
+}
+
+/* Allocates the bit-plane buffer of the given encoder, returning 0 or an
+ * error code.
+ */
+static int alloc_bitplane_frame(drachen_encoder* enc) {
+  enc->bitplane_frame = malloc(enc->frame_size);
+  return enc->bitplane_frame? 0 : ENOMEM;
+}
+
+/* Allocates prev2_frame for DRACHEN_FEATURE_LINEAR, initially zero like
+ * prev_frame.
+ */
+static int alloc_prev2_frame(drachen_encoder* enc) {
+  enc->prev2_frame = calloc(enc->frame_size? enc->frame_size : 1, 1);
+  return enc->prev2_frame? 0 : ENOMEM;
+}
+
+/* Allocates the reference frames for DRACHEN_FEATURE_REFERENCES, initially
+ * zero, and their checksums.
+ */
+static int alloc_refs(drachen_encoder* enc) {
+  uint32_t i, n = enc->params.num_references;
+
+  enc->refs = calloc(n, sizeof(unsigned char*));
+  enc->ref_crc = calloc(n, sizeof(uint32_t));
+  if (!enc->refs || !enc->ref_crc)
+    return ENOMEM;
+
+  for (i = 0; i < n; ++i)
+    if (!(enc->refs[i] = calloc(enc->frame_size? enc->frame_size : 1, 1)))
+      return ENOMEM;
+
+  return 0;
+}
+
+/* Allocates the background model for DRACHEN_FEATURE_BACKGROUND, initially
+ * zero.
+ */
+static int alloc_background(drachen_encoder* enc) {
+  enc->background = calloc(enc->frame_size? enc->frame_size : 1,
+                           sizeof(uint16_t));
+  enc->background_frame = calloc(enc->frame_size? enc->frame_size : 1, 1);
+  return enc->background && enc->background_frame? 0 : ENOMEM;
+}
+
+/* Makes the untransformed frame base the previous frame (and the one before
+ * it, and the start of any background model) of the given encoder, or of the
+ * given decoder if decoding is set, as if it had been encoded or decoded.
+ */
+static void seed_prev_frame(drachen_encoder* enc, const unsigned char* base,
+                            int decoding) {
+  uint32_t i;
+
+  if (!decoding) {
+    drachen_transform_frame(enc->prev_frame, base, enc);
+  } else {
+    for (i = 0; i < enc->frame_size; ++i)
+      enc->prev_frame[xform_index(enc, i)] = base[i];
+
+    if (has_bitplanes(enc)) {
+      i = enc->params.bitplane_end - enc->params.bitplane_begin;
+      memcpy(enc->bitplane_frame, enc->prev_frame + enc->params.bitplane_begin,
+             i);
+      drachen_split_bitplanes(enc->prev_frame + enc->params.bitplane_begin,
+                              enc->bitplane_frame, i);
+    }
+  }
+
+  if (enc->prev2_frame)
+    memcpy(enc->prev2_frame, enc->prev_frame, enc->frame_size);
+  update_background(enc, enc->prev_frame);
+
+  /* A first frame identical to the base is a duplicate of the previous */
+  if (enc->refs) {
+    enc->prev_crc = drachen_crc32c(0, enc->prev_frame, enc->frame_size);
+    enc->prev_crc_valid = 1;
+  }
+}
+
+/* Common part of drachen_create_encoder_ex() and
+ * drachen_create_encoder_spec(); exactly one of xform and spec is non-NULL.
+ */
+static drachen_encoder* create_encoder(FILE* out,
+                                       uint32_t frame_size,
+                                       const uint32_t* xform,
+                                       const drachen_xform_spec* spec,
+                                       const drachen_stream_params* p) {
   drachen_encoder* enc = drachen_alloc_encoder(out, frame_size);
   uint32_t i, endian32 = 0x03020100;
   uint16_t endian16 = 0x0100;
+  char magic[8] = "Drachen";
   if (!enc) return NULL;
-  if (!xform) {
-    /* Initialise default null transform */
-    for (i = 0; i < frame_size; ++i)
-      enc->xform[i] = i;
+  if (p)
+    enc->params = *p;
+
+  if (enc->params.features & ~DRACHEN_KNOWN_FEATURES) {
+    enc->error = DRACHEN_UNSUPPORTED;
+    return enc;
+  }
+
+  if (enc->params.features & DRACHEN_FEATURE_CRC32C)
+    drachen_crc32c_init();
+
+  if (enc->params.features & DRACHEN_FEATURE_BITPLANES) {
+    if (enc->params.bitplane_begin > enc->params.bitplane_end ||
+        enc->params.bitplane_end > frame_size) {
+      enc->error = EINVAL;
+      return enc;
+    }
+
+    enc->params.bitplane_end -=
+      (enc->params.bitplane_end - enc->params.bitplane_begin) % 8;
+    if ((enc->error = alloc_bitplane_frame(enc)))
+      return enc;
   } else {
-    /* Invert xform into the one we'll be using. */
-    for (i = 0; i < frame_size; ++i)
-      enc->xform[xform[i]] = i;
+    enc->params.bitplane_begin = enc->params.bitplane_end = 0;
   }
 
+  if ((enc->params.features & DRACHEN_FEATURE_LINEAR) &&
+      (enc->error = alloc_prev2_frame(enc)))
+    return enc;
+
+  if (enc->params.features & DRACHEN_FEATURE_REFERENCES) {
+    if (!enc->params.num_references ||
+        enc->params.num_references > DRACHEN_MAX_REFERENCES) {
+      enc->error = EINVAL;
+      return enc;
+    }
+
+    /* Duplicate frames are found by their checksums */
+    drachen_crc32c_init();
+    if ((enc->error = alloc_refs(enc)))
+      return enc;
+  } else {
+    enc->params.num_references = 0;
+  }
+
+  if (!(enc->params.features & (DRACHEN_FEATURE_DISPLACED |
+                                DRACHEN_FEATURE_SPATIAL)))
+    enc->params.row_stride = 0;
+
+  if (enc->params.features & DRACHEN_FEATURE_BACKGROUND) {
+    if (!enc->params.background_shift ||
+        enc->params.background_shift > DRACHEN_MAX_BACKGROUND_SHIFT) {
+      enc->error = EINVAL;
+      return enc;
+    }
+
+    if ((enc->error = alloc_background(enc)))
+      return enc;
+  } else {
+    enc->params.background_shift = 0;
+  }
+
+  if (enc->params.features & DRACHEN_FEATURE_BASE_FRAME) {
+    if (!enc->params.base_frame) {
+      enc->error = EINVAL;
+      return enc;
+    }
+
+    drachen_crc32c_init();
+    enc->params.base_crc = drachen_crc32c(0, enc->params.base_frame,
+                                          frame_size);
+  } else {
+    enc->params.base_frame = NULL;
+    enc->params.base_crc = 0;
+  }
+
+  if (spec) {
+    enc->xform_spec = *spec;
+    if ((enc->error = drachen_normalise_xform_spec(&enc->xform_spec,
+                                                   frame_size)))
+      return enc;
+
+    if (spec->kind == DRACHEN_XFORM_RECORD && spec->num_fields) {
+      enc->record_fields = malloc(sizeof(unsigned) * spec->num_fields);
+      if (!enc->record_fields) {
+        enc->error = ENOMEM;
+        return enc;
+      }
+
+      memcpy(enc->record_fields, spec->field_sizes,
+             sizeof(unsigned) * spec->num_fields);
+      enc->xform_spec.field_sizes = enc->record_fields;
+    }
+    enc->xform_is_identity = (enc->xform_spec.kind == DRACHEN_XFORM_IDENTITY);
+  } else {
+    for (i = 0; i < frame_size && xform[i] == i; ++i);
+    if (i < frame_size) {
+      /* Invert xform into the one we'll be using. */
+      enc->xform = malloc(sizeof(uint32_t)*frame_size);
+      if (!enc->xform) {
+        enc->error = ENOMEM;
+        return enc;
+      }
+
+      for (i = 0; i < frame_size; ++i)
+        enc->xform[xform[i]] = i;
+      enc->xform_is_identity = 0;
+      drachen_plan_xform(enc);
+    }
+  }
+
+  /* Streams without features are written in the original format, so that
+   * older decoders can still read them.
+   */
+  if (enc->params.features)
+    magic[7] = DRACHEN_VERSION_FEATURES;
+
   /* Write header */
-  if (!fwrite("Drachen", 8, 1, enc->file) ||
+  if (!fwrite(magic, 8, 1, enc->file) ||
       !fwrite(&endian32, 4, 1, enc->file) ||
       !fwrite(&endian16, 2, 1, enc->file) ||
       !fwrite(&frame_size, 4, 1, enc->file) ||
-      /* Write the original xform, since it is correct for decoding.
-       * If there is no original, the inverse and forward are identical, so
-       * fall back on the one we generated above.
-       */
-      !fwrite(xform? xform : enc->xform,
-              frame_size*sizeof(uint32_t), 1, enc->file)) {
+      (enc->params.features &&
+       !fwrite(&enc->params.features, 4, 1, enc->file))) {
     enc->error = errno;
     return enc;
   }
 
+  if (enc->params.features & DRACHEN_FEATURE_XFORM_DESC)
+    write_xform_desc(enc, xform);
+  /* Otherwise, write the original xform, since it is correct for decoding.
+   * Parametric transforms are expanded as they are written.
+   */
+  else if (!(xform?
+             !!fwrite(xform, frame_size*sizeof(uint32_t), 1, enc->file) :
+             write_spec_xform(enc)))
+    enc->error = errno;
+
+  if (!enc->error && (enc->params.features & DRACHEN_FEATURE_BITPLANES) &&
+      (!fwrite(&enc->params.bitplane_begin, 4, 1, enc->file) ||
+       !fwrite(&enc->params.bitplane_end, 4, 1, enc->file)))
+    enc->error = errno;
+
+  if (!enc->error && (enc->params.features & DRACHEN_FEATURE_REFERENCES) &&
+      !fwrite(&enc->params.num_references, 4, 1, enc->file))
+    enc->error = errno;
+
+  if (!enc->error && (enc->params.features & (DRACHEN_FEATURE_DISPLACED |
+                                               DRACHEN_FEATURE_SPATIAL)) &&
+      !fwrite(&enc->params.row_stride, 4, 1, enc->file))
+    enc->error = errno;
+
+  if (!enc->error && (enc->params.features & DRACHEN_FEATURE_BASE_FRAME) &&
+      !fwrite(&enc->params.base_crc, 4, 1, enc->file))
+    enc->error = errno;
+
+  if (!enc->error && (enc->params.features & DRACHEN_FEATURE_BACKGROUND) &&
+      !fwrite(&enc->params.background_shift, 4, 1, enc->file))
+    enc->error = errno;
+
+  /* The base is only loaded now, since a packed transform table is coded
+   * against zeroes.
+   */
+  if (!enc->error && enc->params.base_frame)
+    seed_prev_frame(enc, enc->params.base_frame, 0);
+  enc->params.base_frame = NULL;
+
   return enc;
 }
 
+drachen_encoder* drachen_create_encoder_ex(FILE* out,
+                                           uint32_t frame_size,
+                                           const uint32_t* xform,
+                                           const drachen_stream_params* p) {
+  drachen_xform_spec identity;
+
+  if (xform)
+    return create_encoder(out, frame_size, xform, NULL, p);
+
+  memset(&identity, 0, sizeof(identity));
+  identity.kind = DRACHEN_XFORM_IDENTITY;
+  return create_encoder(out, frame_size, NULL, &identity, p);
+}
+
+drachen_encoder* drachen_create_encoder_spec(FILE* out,
+                                             uint32_t frame_size,
+                                             const drachen_xform_spec* spec,
+                                             const drachen_stream_params* p) {
+  return create_encoder(out, frame_size, NULL, spec, p);
+}
+
+/* Validates the transform table just read into the given decoder, setting
+ * the error field if it is invalid. Identity tables are discarded.
+ */
+static void validate_xform(drachen_encoder* enc) {
+  uint32_t i;
+
+  enc->xform_is_identity = 1;
+  for (i = 0; i < enc->frame_size; ++i) {
+    if (enc->xform[i] >= enc->frame_size) {
+      enc->error = DRACHEN_BAD_XFORM;
+      return;
+    }
+    if (enc->xform[i] != i)
+      enc->xform_is_identity = 0;
+  }
+
+  /* The identity needs no table */
+  if (enc->xform_is_identity) {
+    free(enc->xform);
+    enc->xform = NULL;
+  } else {
+    drachen_plan_xform(enc);
+  }
+}
+
+/* Reads the transform descriptor (see write_xform_desc()) into the given
+ * decoder, setting the error field on failure.
+ */
+static void read_xform_desc(drachen_encoder* enc) {
+  uint32_t desc[7], i;
+  drachen_xform_spec spec;
+
+  memset(&spec, 0, sizeof(spec));
+  if (!fread(desc, sizeof(uint32_t), 1, enc->file)) {
+    enc->error = ferror(enc->file)? errno : DRACHEN_PREMATURE_EOF;
+    return;
+  }
+
+  switch (swab32(desc[0], enc)) {
+  case DRACHEN_XFORM_IDENTITY:
+    break;
+
+  case DRACHEN_XFORM_IMAGE:
+    if (!fread(desc+1, 6*sizeof(uint32_t), 1, enc->file)) {
+      enc->error = ferror(enc->file)? errno : DRACHEN_PREMATURE_EOF;
+      return;
+    }
+
+    for (i = 1; i < 7; ++i)
+      desc[i] = swab32(desc[i], enc);
+
+    spec.kind = DRACHEN_XFORM_IMAGE;
+    spec.offset = desc[1];
+    spec.cols = desc[2];
+    spec.rows = desc[3];
+    spec.num_components = desc[4];
+    spec.block_width = desc[5];
+    spec.block_height = desc[6];
+    if (drachen_normalise_xform_spec(&spec, enc->frame_size)) {
+      enc->error = DRACHEN_BAD_XFORM;
+      return;
+    }
+
+    enc->xform_spec = spec;
+    enc->xform_is_identity = 0;
+    break;
+
+  case DRACHEN_XFORM_RECORD:
+    if (!fread(desc+1, 5*sizeof(uint32_t), 1, enc->file)) {
+      enc->error = ferror(enc->file)? errno : DRACHEN_PREMATURE_EOF;
+      return;
+    }
+
+    for (i = 1; i < 6; ++i)
+      desc[i] = swab32(desc[i], enc);
+
+    spec.kind = DRACHEN_XFORM_RECORD;
+    spec.offset = desc[1];
+    spec.record_size = desc[2];
+    spec.num_records = desc[3];
+    spec.split_bytes = desc[4];
+    spec.num_fields = desc[5];
+
+    /* Every field is at least one byte */
+    if (spec.num_fields > spec.record_size) {
+      enc->error = DRACHEN_BAD_XFORM;
+      return;
+    }
+
+    if (spec.num_fields) {
+      enc->record_fields = malloc(sizeof(unsigned) * spec.num_fields);
+      if (!enc->record_fields) {
+        enc->error = ENOMEM;
+        return;
+      }
+
+      for (i = 0; i < spec.num_fields; ++i) {
+        if (!fread(desc, 4, 1, enc->file)) {
+          enc->error = ferror(enc->file)? errno : DRACHEN_PREMATURE_EOF;
+          return;
+        }
+        enc->record_fields[i] = swab32(desc[0], enc);
+      }
+      spec.field_sizes = enc->record_fields;
+    }
+
+    if (drachen_normalise_xform_spec(&spec, enc->frame_size)) {
+      enc->error = DRACHEN_BAD_XFORM;
+      return;
+    }
+
+    enc->xform_spec = spec;
+    enc->xform_is_identity = 0;
+    break;
+
+  case XFORM_DESC_TABLE:
+    enc->xform = malloc(sizeof(uint32_t)*enc->frame_size);
+    if (!enc->xform) {
+      enc->error = ENOMEM;
+      return;
+    }
+
+    if (!drachen_read_packed_xform(enc))
+      validate_xform(enc);
+    break;
+
+  default:
+    enc->error = DRACHEN_UNSUPPORTED;
+    break;
+  }
+}
+
+/* Reads the bit-plane region into the given decoder, setting the error field
+ * on failure.
+ */
+static void read_bitplane_region(drachen_encoder* enc) {
+  uint32_t region[2];
+
+  if (!fread(region, sizeof(region), 1, enc->file)) {
+    enc->error = ferror(enc->file)? errno : DRACHEN_PREMATURE_EOF;
+    return;
+  }
+
+  region[0] = swab32(region[0], enc);
+  region[1] = swab32(region[1], enc);
+  if (region[0] > region[1] || region[1] > enc->frame_size ||
+      (region[1] - region[0]) % 8) {
+    enc->error = DRACHEN_UNSUPPORTED;
+    return;
+  }
+
+  enc->params.bitplane_begin = region[0];
+  enc->params.bitplane_end = region[1];
+  enc->error = alloc_bitplane_frame(enc);
+}
+
+/* Reads the number of reference frames into the given decoder and allocates
+ * them, setting the error field on failure.
+ */
+static void read_num_references(drachen_encoder* enc) {
+  uint32_t n;
+
+  if (!fread(&n, 4, 1, enc->file)) {
+    enc->error = ferror(enc->file)? errno : DRACHEN_PREMATURE_EOF;
+    return;
+  }
+
+  n = swab32(n, enc);
+  if (!n || n > DRACHEN_MAX_REFERENCES) {
+    enc->error = DRACHEN_UNSUPPORTED;
+    return;
+  }
+
+  enc->params.num_references = n;
+  enc->error = alloc_refs(enc);
+}
+
 drachen_encoder* drachen_create_decoder(FILE* in,
                                         uint32_t frame_size) {
-  /* Create a dummy for early error reporting */
-  drachen_encoder* dummy = drachen_alloc_encoder(0, 1), * enc;
+  /* Create a dummy for early error reporting. Like the real decoder, it owns
+   * the file.
+   */
+  drachen_encoder* dummy = drachen_alloc_encoder(in, 1), * enc;
 
   /* Read the header first */
   char magic[8];
   unsigned char endian32[4], endian16[2];
-  uint32_t real_frame_size, i;
+  uint32_t real_frame_size, features = 0, i;
 
   if (!dummy) return NULL;
 
@@ -109,15 +652,33 @@ drachen_encoder* drachen_create_decoder(FILE* in,
       !fread(endian32, 4, 1, in) ||
       !fread(endian16, 2, 1, in) ||
       !fread(&real_frame_size, 4, 1, in)) {
-    dummy->error = errno;
+    dummy->error = ferror(in)? errno : DRACHEN_PREMATURE_EOF;
     return dummy;
   }
 
-  if (magic[sizeof(magic)-1] || strcmp(magic, "Drachen")) {
+  if (memcmp(magic, "Drachen", 7)) {
     dummy->error = DRACHEN_BAD_MAGIC;
     return dummy;
   }
 
+  /* The final byte of the magic is the format version */
+  if (magic[7] == DRACHEN_VERSION_FEATURES) {
+    if (!fread(&features, 4, 1, in)) {
+      dummy->error = ferror(in)? errno : DRACHEN_PREMATURE_EOF;
+      return dummy;
+    }
+
+    features = swab32a(features, endian32);
+  } else if (magic[7]) {
+    dummy->error = DRACHEN_UNSUPPORTED;
+    return dummy;
+  }
+
+  if (features & ~DRACHEN_KNOWN_FEATURES) {
+    dummy->error = DRACHEN_UNSUPPORTED;
+    return dummy;
+  }
+
   real_frame_size = swab32a(real_frame_size, endian32);
 
   /* Ensure the frame size matches what was expected, if anything was
@@ -129,41 +690,152 @@ drachen_encoder* drachen_create_decoder(FILE* in,
   }
 
   /* We now know enough to create a real decoder */
-  free(dummy);
+  dummy->file = NULL;
+  drachen_free(dummy);
 
   enc = drachen_alloc_encoder(in, real_frame_size);
   if (!enc) return NULL;
-  /* Read the transform table */
-  if (!fread(enc->xform, real_frame_size*sizeof(uint32_t), 1, in)) {
-    enc->error = errno;
+  enc->params.features = features;
+  if (features & (DRACHEN_FEATURE_CRC32C | DRACHEN_FEATURE_BASE_FRAME))
+    drachen_crc32c_init();
+  if ((features & DRACHEN_FEATURE_LINEAR) &&
+      (enc->error = alloc_prev2_frame(enc)))
+    return enc;
+  if ((features & DRACHEN_FEATURE_BACKGROUND) &&
+      (enc->error = alloc_background(enc)))
     return enc;
-  }
 
   /* Copy the endianness */
   memcpy(enc->endian32, endian32, sizeof(endian32));
   memcpy(enc->endian16, endian16, sizeof(endian16));
-  /* Swab the transform table, and validate indices */
-  for (i = 0; i < frame_size; ++i) {
-    enc->xform[i] = swab32(enc->xform[i], enc);
-    if (enc->xform[i] >= frame_size) {
-      enc->error = DRACHEN_BAD_XFORM;
+
+  if (features & DRACHEN_FEATURE_XFORM_DESC) {
+    read_xform_desc(enc);
+  } else {
+    /* Read the transform table */
+    enc->xform = malloc(sizeof(uint32_t)*real_frame_size);
+    if (!enc->xform) {
+      enc->error = ENOMEM;
       return enc;
     }
+    if (!fread(enc->xform, real_frame_size*sizeof(uint32_t), 1, in)) {
+      enc->error = ferror(in)? errno : DRACHEN_PREMATURE_EOF;
+      return enc;
+    }
+
+    for (i = 0; i < real_frame_size; ++i)
+      enc->xform[i] = swab32(enc->xform[i], enc);
+    validate_xform(enc);
+  }
+
+  if (!enc->error && (features & DRACHEN_FEATURE_BITPLANES))
+    read_bitplane_region(enc);
+  if (!enc->error && (features & DRACHEN_FEATURE_REFERENCES))
+    read_num_references(enc);
+  if (!enc->error && (features & (DRACHEN_FEATURE_DISPLACED |
+                                  DRACHEN_FEATURE_SPATIAL))) {
+    if (fread(&enc->params.row_stride, 4, 1, in))
+      enc->params.row_stride = swab32(enc->params.row_stride, enc);
+    else
+      enc->error = ferror(in)? errno : DRACHEN_PREMATURE_EOF;
+  }
+  if (!enc->error && (features & DRACHEN_FEATURE_BASE_FRAME)) {
+    if (fread(&enc->params.base_crc, 4, 1, in))
+      enc->params.base_crc = swab32(enc->params.base_crc, enc);
+    else
+      enc->error = ferror(in)? errno : DRACHEN_PREMATURE_EOF;
+    enc->base_pending = 1;
+  }
+  if (!enc->error && (features & DRACHEN_FEATURE_BACKGROUND)) {
+    if (fread(&enc->params.background_shift, 4, 1, in))
+      enc->params.background_shift = swab32(enc->params.background_shift,
+                                            enc);
+    else
+      enc->error = ferror(in)? errno : DRACHEN_PREMATURE_EOF;
+    if (!enc->error && (!enc->params.background_shift ||
+                        enc->params.background_shift >
+                        DRACHEN_MAX_BACKGROUND_SHIFT))
+      enc->error = DRACHEN_UNSUPPORTED;
   }
 
   /* OK */
   return enc;
 }
 
+drachen_encoder* drachen_create_decoder_base(FILE* in,
+                                             uint32_t frame_size,
+                                             const unsigned char* base) {
+  drachen_encoder* enc = drachen_create_decoder(in, frame_size);
+
+  if (enc && !enc->error && enc->base_pending)
+    drachen_set_base_frame(enc, base);
+  return enc;
+}
+
+int drachen_set_base_frame(drachen_encoder* dec, const unsigned char* base) {
+  if (dec->error) return dec->error;
+  if (!dec->base_pending || dec->roi || !base)
+    return dec->error = EINVAL;
+
+  if (drachen_crc32c(0, base, dec->frame_size) != dec->params.base_crc)
+    return dec->error = DRACHEN_WRONG_BASE_FRAME;
+
+  seed_prev_frame(dec, base, 1);
+  dec->base_pending = 0;
+  return 0;
+}
+
+void drachen_get_stream_params(const drachen_encoder* enc,
+                               drachen_stream_params* params) {
+  *params = enc->params;
+}
+
 int drachen_free(drachen_encoder* enc) {
+  uint32_t i;
   int err;
+  if (enc->stream_file) {
+    fclose(enc->file);
+    enc->file = enc->stream_file;
+  }
   if (enc->file && (err = fclose(enc->file)))
     return err;
 
   free(enc->prev_frame);
   free(enc->curr_frame);
-  free(enc->xform);
+  if (enc->prev2_frame) free(enc->prev2_frame);
+  if (enc->refs) {
+    for (i = 0; i < enc->params.num_references; ++i)
+      if (enc->refs[i]) free(enc->refs[i]);
+    free(enc->refs);
+  }
+  if (enc->ref_crc) free(enc->ref_crc);
+  if (enc->background) free(enc->background);
+  if (enc->background_frame) free(enc->background_frame);
+  if (enc->xform) free(enc->xform);
+  if (enc->plan) drachen_free_xform_plan(enc->plan);
+  if (enc->record_fields) free(enc->record_fields);
+  if (enc->bitplane_frame) free(enc->bitplane_frame);
   if (enc->tmp_data) free(enc->tmp_data);
+  if (enc->last_name) free(enc->last_name);
+  if (enc->next_name) free(enc->next_name);
+  if (enc->block_meths) free(enc->block_meths);
+  if (enc->block_offset) free(enc->block_offset);
+  if (enc->block_end) free(enc->block_end);
+  if (enc->lossy_frame) free(enc->lossy_frame);
+  if (enc->body_file) fclose(enc->body_file);
+  if (enc->body_mem) free(enc->body_mem);
+  if (enc->body) free(enc->body);
+  if (enc->coded) free(enc->coded);
+  if (enc->rans_table) free(enc->rans_table);
+  if (enc->roi) free(enc->roi);
+  if (enc->roi_ranges) free(enc->roi_ranges);
+  if (enc->roi_map) free(enc->roi_map);
+  if (enc->inverse_xform) free(enc->inverse_xform);
+  if (enc->change_mask) free(enc->change_mask);
+  if (enc->changed) free(enc->changed);
+#ifdef HAVE_SYS_INOTIFY_H
+  if (enc->notify_fd >= 0) close(enc->notify_fd);
+#endif
   free(enc);
   return 0;
 }
@@ -176,7 +848,7 @@ const char* drachen_get_error(const drachen_encoder* enc) {
   if (enc->error == 0)
     return NULL;
   else if (enc->error > 0)
-    return strerror(errno);
+    return strerror(enc->error);
   else switch (enc->error) {
     case DRACHEN_BAD_MAGIC:
       return "Invalid magic at start of file.";
@@ -188,6 +860,12 @@ const char* drachen_get_error(const drachen_encoder* enc) {
       return "Input stream overran stated bounds.";
     case DRACHEN_PREMATURE_EOF:
       return "Unexpected end of file.";
+    case DRACHEN_BAD_CHECKSUM:
+      return "Frame does not match its checksum.";
+    case DRACHEN_UNSUPPORTED:
+      return "File uses a format feature which is not supported.";
+    case DRACHEN_WRONG_BASE_FRAME:
+      return "File's base frame is missing or does not match.";
     default:
       return "An unknown error occurred.";
   }
@@ -202,6 +880,16 @@ void drachen_set_block_size(drachen_encoder* enc,
   enc->block_size = spec;
 }
 
+void drachen_set_optimal_segments(drachen_encoder* enc, int optimal) {
+  enc->optimal_segments = optimal;
+}
+
+void drachen_set_max_error(drachen_encoder* enc, unsigned max_error,
+                           uint32_t target_size) {
+  enc->max_error = max_error > 255? 255 : max_error;
+  enc->target_size = target_size;
+}
+
 void drachen_make_image_xform_matrix(uint32_t* xform,
                                      uint32_t offset,
                                      uint32_t cols,
@@ -242,6 +930,172 @@ void drachen_make_image_xform_matrix(uint32_t* xform,
   }
 }
 
+/* Reduces *block until it is evenly divisible into size, as
+ * drachen_make_image_xform_matrix() does.
+ */
+static void fit_block(unsigned* block, uint32_t size) {
+  if (!*block) *block = 1;
+  if (*block > size) *block = size;
+  while (*block > 1 && size % *block) --*block;
+}
+
+/* Returns the position of sample (x,y) within a plane which is cols wide,
+ * when the samples are grouped into blocks of bw by bh (which must divide
+ * evenly into the plane).
+ */
+static uint32_t block_order(uint32_t x, uint32_t y, uint32_t cols,
+                            unsigned bw, unsigned bh) {
+  return ((y / bh) * (cols / bw) + x / bw) * bw * bh +
+    (y % bh) * bw + x % bw;
+}
+
+void drachen_make_yuv420_xform_matrix(uint32_t* xform,
+                                      uint32_t offset,
+                                      uint32_t cols,
+                                      uint32_t rows,
+                                      int interleaved_chroma,
+                                      unsigned block_width,
+                                      unsigned block_height) {
+  uint32_t ccols = (cols+1)/2, crows = (rows+1)/2, csize = ccols*crows;
+  uint32_t chroma = offset + cols*rows, x, y, c;
+  unsigned cbw = block_width/2, cbh = block_height/2;
+
+  for (x = 0; x < offset; ++x)
+    xform[x] = x;
+
+  fit_block(&block_width, cols);
+  fit_block(&block_height, rows);
+  for (y = 0; y < rows; ++y)
+    for (x = 0; x < cols; ++x)
+      xform[offset + y*cols + x] =
+        offset + block_order(x, y, cols, block_width, block_height);
+
+  fit_block(&cbw, ccols);
+  fit_block(&cbh, crows);
+  for (c = 0; c < 2; ++c)
+    for (y = 0; y < crows; ++y)
+      for (x = 0; x < ccols; ++x)
+        xform[chroma + (interleaved_chroma?
+                        (y*ccols + x)*2 + c :
+                        c*csize + y*ccols + x)] =
+          chroma + c*csize + block_order(x, y, ccols, cbw, cbh);
+}
+
+void drachen_make_bayer_xform_matrix(uint32_t* xform,
+                                     uint32_t offset,
+                                     uint32_t cols,
+                                     uint32_t rows,
+                                     unsigned bytes_per_sample,
+                                     unsigned block_width,
+                                     unsigned block_height) {
+  uint32_t scols = cols/2, srows = rows/2, ssize = scols*srows;
+  uint32_t x, y, k, i = offset, plane;
+
+  for (x = 0; x < offset; ++x)
+    xform[x] = x;
+
+  fit_block(&block_width, scols);
+  fit_block(&block_height, srows);
+  for (y = 0; y < rows; ++y) {
+    for (x = 0; x < cols; ++x) {
+      for (k = 0; k < bytes_per_sample; ++k) {
+        plane = k*4 + (y & 1)*2 + (x & 1);
+        xform[i++] = offset + plane*ssize +
+          block_order(x/2, y/2, scols, block_width, block_height);
+      }
+    }
+  }
+}
+
+void drachen_make_record_xform_matrix(uint32_t* xform,
+                                      uint32_t offset,
+                                      uint32_t record_size,
+                                      uint32_t num_records,
+                                      const unsigned* field_sizes,
+                                      unsigned num_fields,
+                                      int split_bytes) {
+  drachen_xform_spec spec;
+  uint32_t i, end = offset + record_size*num_records;
+
+  memset(&spec, 0, sizeof(spec));
+  spec.kind = DRACHEN_XFORM_RECORD;
+  spec.offset = offset;
+  spec.record_size = record_size;
+  spec.num_records = num_records;
+  spec.field_sizes = field_sizes;
+  spec.num_fields = num_fields;
+  spec.split_bytes = split_bytes;
+
+  for (i = 0; i < end; ++i)
+    xform[i] = drachen_xform_spec_index(&spec, i);
+}
+
 void drachen_zero_prev(drachen_encoder* enc, uint32_t off) {
-  memset(enc->prev_frame+off, 0, enc->frame_size - off);
+  uint32_t i, begin;
+
+  /* The frame before is zeroed too, so that nothing is predicted from it
+   * either.
+   */
+  enc->prev_crc_valid = 0;
+  if (!enc->roi) {
+    memset(enc->prev_frame+off, 0, enc->frame_size - off);
+    if (enc->prev2_frame)
+      memset(enc->prev2_frame+off, 0, enc->frame_size - off);
+    return;
+  }
+
+  /* Only the region of interest is stored */
+  for (i = 0; i < enc->num_roi; ++i) {
+    if (enc->roi[i].end <= off) continue;
+    begin = enc->roi[i].begin > off? enc->roi[i].begin : off;
+    memset(enc->prev_frame + enc->roi[i].base + begin - enc->roi[i].begin,
+           0, enc->roi[i].end - begin);
+    if (enc->prev2_frame)
+      memset(enc->prev2_frame + enc->roi[i].base + begin - enc->roi[i].begin,
+             0, enc->roi[i].end - begin);
+  }
+}
+
+int drachen_reserve_name(char** buf, uint32_t* cap, uint32_t len) {
+  uint32_t new_cap;
+  char* p;
+
+  if (*cap >= len)
+    return 0;
+
+  new_cap = *cap? *cap*2 : 64;
+  if (new_cap < len)
+    new_cap = len;
+  p = realloc(*buf, new_cap);
+  if (!p)
+    return ENOMEM;
+
+  *buf = p;
+  *cap = new_cap;
+  return 0;
+}
+
+uint32_t drachen_increment_name(char* dst, const char* src, uint32_t len) {
+  uint32_t i = len;
+
+  while (i && (src[i-1] < '0' || src[i-1] > '9'))
+    --i;
+  if (!i)
+    return 0;
+
+  memcpy(dst, src, len);
+  /* Carry through the 9s of the number */
+  while (i && dst[i-1] >= '0' && dst[i-1] <= '9') {
+    --i;
+    if (dst[i] != '9') {
+      ++dst[i];
+      return len;
+    }
+    dst[i] = '0';
+  }
+
+  /* All 9s; the number gains a digit */
+  memmove(dst + i + 1, dst + i, len - i);
+  dst[i] = '1';
+  return len + 1;
 }
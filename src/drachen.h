@@ -45,6 +45,167 @@ extern "C" {
  * This is not an error, and will never be returned by drachen_error().
  */
 #define DRACHEN_END_OF_STREAM -6
+/**
+ * Indicates that a frame did not match the checksum stored with it.
+ */
+#define DRACHEN_BAD_CHECKSUM -7
+/**
+ * Indicates that the input file uses a format version or feature which this
+ * version of libdrachen does not understand.
+ */
+#define DRACHEN_UNSUPPORTED -8
+/**
+ * Indicates that a stream was encoded against a base frame (see
+ * DRACHEN_FEATURE_BASE_FRAME) which has not been given to the decoder, or
+ * which does not match the one given.
+ */
+#define DRACHEN_WRONG_BASE_FRAME -9
+
+/* Optional stream features (see drachen_stream_params) */
+/**
+ * Each frame is followed by a CRC-32C of its name and contents, which is
+ * checked whenever the frame is decoded.
+ */
+#define DRACHEN_FEATURE_CRC32C 0x00000001u
+/**
+ * The header describes the transform compactly rather than storing the full
+ * reverse transformation matrix. Transforms with a drachen_xform_spec are
+ * stored as just their parameters, so that a decoder can start without
+ * reading (or keeping) a table at all; other transforms are stored
+ * compressed.
+ */
+#define DRACHEN_FEATURE_XFORM_DESC 0x00000002u
+/**
+ * A region of the transformed frame (see drachen_stream_params) is split
+ * into bit planes before encoding: bit k of every byte in the region is
+ * gathered into plane k. This suits flags and noisy samples, of which only a
+ * few low bits change at random between frames, since the planes of the
+ * other bits then never change at all. (Values which change by small steps,
+ * such as counters, usually do better without it, since carries make their
+ * planes change more than their bytes.) Usually, a transform is also used to
+ * bring the bytes of such values with the same significance together, so
+ * that the region can cover just the low bytes.
+ */
+#define DRACHEN_FEATURE_BITPLANES 0x00000004u
+/**
+ * Segments may predict 16-bit or 32-bit little-endian words from the
+ * previous frame, subtracting whole words with carry, rather than each byte
+ * separately. A 16-bit value going from 0x00FF to 0x0100 then changes by 1,
+ * rather than by 1 in one byte and by 0xFF in the other, which compresses
+ * far better. The encoder chooses the word width for each segment, falling
+ * back to bytes wherever they do better, so this never costs much. Words
+ * are aligned to the start of the transformed frame, so this only helps
+ * where the transform keeps the bytes of each value together and aligned,
+ * such as with no transform or with records whose bytes are not split.
+ */
+#define DRACHEN_FEATURE_WORD_DELTA 0x00000008u
+/**
+ * Segments may predict each byte from the two previous frames as
+ * 2*prev - prevprev, so that values which move by a constant step every
+ * frame, such as ramps and counters, cost nothing at all once under way. With
+ * DRACHEN_FEATURE_WORD_DELTA as well, this is also done on 16-bit and 32-bit
+ * words, so that steps carry properly between bytes. The encoder chooses the
+ * predictor for each segment. This needs another frame of memory in both the
+ * encoder and the decoder.
+ */
+#define DRACHEN_FEATURE_LINEAR 0x00000010u
+/**
+ * The encoder and decoder keep a small set of reference frames besides the
+ * previous frame (see drachen_stream_params), into which frames are stored
+ * as they are encoded, and from which segments may be predicted. Streams
+ * which return to an earlier state, such as a display switching between a
+ * few screens, then cost little more than when the state was last seen. A
+ * frame identical to the previous frame or to a reference is found by its
+ * checksum and written as a single byte after its name, without being
+ * encoded at all.
+ *
+ * By default, each frame which is not such a duplicate is stored into the
+ * slots in turn, so that they hold the most recent distinct frames; the
+ * encoder can instead pin particular frames (see drachen_pin_frame()).
+ */
+#define DRACHEN_FEATURE_REFERENCES 0x00000020u
+/**
+ * Segments may predict from the previous frame displaced by a signed number
+ * of bytes, so that content which has moved, such as a scrolled terminal, a
+ * panning camera or a ring buffer captured at a moving offset, costs little
+ * more than content which has not. The encoder searches a few displacements
+ * for each block: those of a few bytes, those of up to a few rows (see
+ * drachen_stream_params), and whichever won for the block before, so that a
+ * displacement found once is followed from block to block.
+ */
+#define DRACHEN_FEATURE_DISPLACED 0x00000040u
+/**
+ * Segments may predict each byte from the byte before it, or from the byte a
+ * row before it (see drachen_stream_params), in the same frame, rather than
+ * from another frame. This suits the first frame of a stream and frames
+ * after a scene cut, which otherwise have nothing useful to be predicted
+ * from.
+ */
+#define DRACHEN_FEATURE_SPATIAL 0x00000080u
+/**
+ * Segments may pack each byte, less the fixed value subtracted from all of
+ * them, into exactly as many bits as their range needs, from 1 to 7, rather
+ * than only into 4 or 8. Segments whose bytes take only two, four or eight
+ * values, such as the noisy low bits of a sensor, then shrink accordingly.
+ * The encoder chooses packing for each segment wherever it does better.
+ */
+#define DRACHEN_FEATURE_PACKED 0x00000100u
+/**
+ * The segments of each frame may be entropy-coded as a whole, with a table of
+ * byte frequencies for the frame, which takes out what the run-length and
+ * packed codings leave of skewed byte distributions without having to
+ * compress the whole archive afterwards. The encoder codes each frame only
+ * where that makes it smaller; frames stay separate, so streaming and
+ * seeking work as before.
+ */
+#define DRACHEN_FEATURE_ENTROPY 0x00000200u
+/**
+ * Segment headers are coded compactly: the modes of recent segments of the
+ * frame are referred to by a short code, and lengths are coded in as few
+ * bytes as they need, so that small blocks cost little more than their
+ * payload. A frame identical to the previous one needs just one byte after
+ * its name.
+ */
+#define DRACHEN_FEATURE_COMPACT_SEGMENTS 0x00000400u
+/**
+ * Frame names are coded against the name of the frame before: as the length
+ * of the prefix they share followed by the rest of the name, or, for a name
+ * which is the previous one with its last number incremented (keeping any
+ * leading zeros), as just a single byte, no more than an empty name would
+ * take. Names such as paths of numbered files then cost almost nothing, and
+ * decoders build each name from the one before rather than reading it byte
+ * by byte.
+ */
+#define DRACHEN_FEATURE_NAME_DELTA 0x00000800u
+/**
+ * The first frame is predicted from a base frame supplied by the caller,
+ * such as a calibration image or a reference configuration, rather than
+ * from zeroes, so that a stream which starts close to a known state does not
+ * pay for a full first frame. The header stores only the CRC-32C of the base
+ * frame, by which decoders check (or look up) the one they are given; see
+ * drachen_stream_params and drachen_set_base_frame().
+ */
+#define DRACHEN_FEATURE_BASE_FRAME 0x00001000u
+/**
+ * The encoder and decoder keep a background model besides the previous
+ * frame: a running average of every frame so far, which each frame moves a
+ * fixed fraction of the way towards (see drachen_stream_params), kept to a
+ * fraction of a byte in integer arithmetic so that both sides agree exactly.
+ * Segments may be predicted from it. Where a fixed camera or sensor sees
+ * something which does not change but is noisy, the average is far closer to
+ * each frame than the previous frame is, so such regions shrink to small
+ * differences, or none at all. This needs three more bytes of memory per
+ * frame byte in both the encoder and the decoder.
+ */
+#define DRACHEN_FEATURE_BACKGROUND 0x00002000u
+/**
+ * The largest number of reference frames a stream may have.
+ */
+#define DRACHEN_MAX_REFERENCES 14
+/**
+ * The largest background_shift a stream may have.
+ */
+#define DRACHEN_MAX_BACKGROUND_SHIFT 8
 
 /**
  * Opaque type which stores Drachen encoding/decoding information.
@@ -63,6 +224,125 @@ typedef struct {
   uint32_t segment_end, block_size;
 } drachen_block_spec;
 
+/**
+ * Describes the half-open range of bytes [begin,end) within an untransformed
+ * frame.
+ *
+ * @see drachen_set_roi().
+ */
+typedef struct {
+  uint32_t begin, end;
+} drachen_range;
+
+/**
+ * Describes the optional features of a stream, which are fixed when the
+ * stream is created.
+ *
+ * Streams which use any features are written in version 2 of the format,
+ * which older versions of libdrachen cannot read.
+ *
+ * @see drachen_create_encoder_ex().
+ */
+typedef struct {
+  /**
+   * Bitwise OR of DRACHEN_FEATURE_* constants.
+   */
+  uint32_t features;
+  /**
+   * With DRACHEN_FEATURE_BITPLANES, the half-open range of bytes
+   * [bitplane_begin,bitplane_end) of the transformed frame which is split
+   * into bit planes. The length of the range is rounded down to a multiple
+   * of 8 when the encoder is created. Ignored without that feature.
+   */
+  uint32_t bitplane_begin, bitplane_end;
+  /**
+   * With DRACHEN_FEATURE_REFERENCES, the number of reference frames, from 1
+   * to DRACHEN_MAX_REFERENCES. Each costs another frame of memory in both
+   * the encoder and the decoder. Ignored without that feature.
+   */
+  uint32_t num_references;
+  /**
+   * With DRACHEN_FEATURE_DISPLACED or DRACHEN_FEATURE_SPATIAL, the length
+   * in bytes of a row of the transformed frame, for frames which have rows,
+   * or 0. Ignored without either feature.
+   */
+  uint32_t row_stride;
+  /**
+   * With DRACHEN_FEATURE_BASE_FRAME, the untransformed frame, frame_size
+   * bytes long, from which the first frame is predicted. It is only read
+   * while the encoder is created, and must not be NULL then; it is NULL in
+   * the parameters of an encoder or decoder. Ignored without that feature.
+   */
+  const unsigned char* base_frame;
+  /**
+   * With DRACHEN_FEATURE_BASE_FRAME, the CRC-32C of base_frame. This is
+   * computed when the encoder is created, and read from the header by
+   * decoders; it is ignored when creating an encoder.
+   */
+  uint32_t base_crc;
+  /**
+   * With DRACHEN_FEATURE_BACKGROUND, how slowly the background model follows
+   * the frames, from 1 to DRACHEN_MAX_BACKGROUND_SHIFT: each frame moves it
+   * 1/2^background_shift of the way from where it was. The model starts as
+   * the first frame (or the base frame, with DRACHEN_FEATURE_BASE_FRAME).
+   * Ignored without that feature.
+   */
+  uint32_t background_shift;
+} drachen_stream_params;
+
+/* Kinds of parametric transform (see drachen_xform_spec) */
+/**
+ * The identity transform, which leaves the frame unchanged.
+ */
+#define DRACHEN_XFORM_IDENTITY 0
+/**
+ * The transform for uncompressed images produced by
+ * drachen_make_image_xform_matrix().
+ */
+#define DRACHEN_XFORM_IMAGE 1
+/**
+ * The transform for arrays of fixed-size records produced by
+ * drachen_make_record_xform_matrix().
+ */
+#define DRACHEN_XFORM_RECORD 2
+
+/**
+ * Describes a transform by its parameters rather than by a table of indices.
+ * Such transforms are applied with simple nested copy loops, which is much
+ * faster than the per-byte table lookup needed for arbitrary transforms, and
+ * no table need be kept in memory.
+ *
+ * @see drachen_create_encoder_spec().
+ */
+typedef struct {
+  /**
+   * One of the DRACHEN_XFORM_* constants.
+   */
+  int kind;
+  /**
+   * For DRACHEN_XFORM_IMAGE, the parameters to
+   * drachen_make_image_xform_matrix(). Bytes outside of the image are not
+   * moved.
+   */
+  uint32_t offset, cols, rows;
+  unsigned num_components, block_width, block_height;
+  /**
+   * For DRACHEN_XFORM_RECORD, the parameters (other than offset, which is
+   * shared with images) to drachen_make_record_xform_matrix(). The
+   * field_sizes array is copied when the spec is used to create an encoder.
+   */
+  uint32_t record_size, num_records;
+  const unsigned* field_sizes;
+  unsigned num_fields;
+  int split_bytes;
+} drachen_xform_spec;
+
+/**
+ * Initialises the given drachen_stream_params to the defaults, which describe
+ * a plain stream readable by any version of libdrachen.
+ */
+void drachen_default_stream_params(drachen_stream_params*);
+
 /**
  * Creates an encoder to write a new stream to the given FILE, which has frames
  * of the size specified in the second argument. If the third argument is
@@ -80,19 +360,101 @@ typedef struct {
  *     destination[transform[i]] = source[i];
  * The default transformation matrix is the identity matrix; that is, it results
  * in a simple copy of the source data.
+ *
+ * For large frames, an arbitrary matrix is analysed when the encoder (or a
+ * decoder for its stream) is created, so that each frame can be transformed
+ * in cache-sized pieces. This takes time and memory proportional to the frame
+ * size; transforms which can be described by a drachen_xform_spec should use
+ * drachen_create_encoder_spec() instead.
  */
 drachen_encoder* drachen_create_encoder(FILE*, uint32_t, const uint32_t*);
 
+/**
+ * Like drachen_create_encoder(), but the stream uses the features described
+ * by the final argument. If it is NULL, this is equivalent to
+ * drachen_create_encoder().
+ */
+drachen_encoder* drachen_create_encoder_ex(FILE*, uint32_t, const uint32_t*,
+                                           const drachen_stream_params*);
+
+/**
+ * Like drachen_create_encoder_ex(), but the transform is described by the
+ * third argument, which is copied. This is equivalent to passing the table
+ * produced by drachen_make_xform_matrix(), but faster.
+ *
+ * If the spec is not valid for the frame size (for example, if an image does
+ * not fit within the frame), an encoder in the EINVAL error state is
+ * returned.
+ */
+drachen_encoder* drachen_create_encoder_spec(FILE*, uint32_t,
+                                             const drachen_xform_spec*,
+                                             const drachen_stream_params*);
+
+/**
+ * Examines a sample of frames from a stream and suggests a transform and
+ * block size specification for encoding it, for when the layout of the data
+ * is not known in advance.
+ *
+ * frames is an array of num_frames pointers (at least one) to consecutive
+ * frames, each frame_size bytes long; a few frames from the start of the
+ * stream are usually enough. The sample is searched for interleaved
+ * components and for the stride of rows or records, and the most promising
+ * image and record transforms are tried by encoding the sample with them
+ * (which takes a few times as long as encoding the sample normally). The one
+ * which needs the fewest bytes, or the identity if none does better, is
+ * stored into *spec, and the best block sizes for it into blocks, which must
+ * have room for two elements. Both are suitable for passing to
+ * drachen_create_encoder_spec() and drachen_set_block_size().
+ *
+ * Returns 0 on success, or an error code on failure.
+ */
+int drachen_suggest_xform(drachen_xform_spec* spec,
+                          drachen_block_spec* blocks,
+                          const unsigned char*const* frames,
+                          unsigned num_frames,
+                          uint32_t frame_size);
+
 /**
  * Creates an encoder which is ready to decode from the given file. If the
  * second argument is non-zero, this call fails if the input file does not use
  * exactly that frame size.
  *
  * On success, returns an encoder. On failure, returns NULL if memory was
- * exhausted, or an encoder in an error state (see drachen_error).
+ * exhausted, or an encoder in an error state (see drachen_error). In either
+ * of the latter cases, the file is still owned by the encoder, and is closed
+ * by drachen_free().
  */
 drachen_encoder* drachen_create_decoder(FILE*, uint32_t);
 
+/**
+ * Like drachen_create_decoder(), but if the stream was encoded against a base
+ * frame (see DRACHEN_FEATURE_BASE_FRAME), the third argument is given to
+ * drachen_set_base_frame(). It is ignored for other streams, and may be
+ * NULL.
+ */
+drachen_encoder* drachen_create_decoder_base(FILE*, uint32_t,
+                                             const unsigned char*);
+
+/**
+ * Gives the given decoder the base frame its stream was encoded against (see
+ * DRACHEN_FEATURE_BASE_FRAME), which is copied. Until this is done, decoding
+ * fails with DRACHEN_WRONG_BASE_FRAME; the base_crc of the stream parameters
+ * (see drachen_get_stream_params()) may be used to find the right frame.
+ *
+ * This must be called before the first frame is decoded and before
+ * drachen_set_roi(). Returns 0 on success, DRACHEN_WRONG_BASE_FRAME if the
+ * frame does not match the checksum in the header, or EINVAL if the stream
+ * has no base frame or it has already been given. Failure puts the decoder
+ * into an error state.
+ */
+int drachen_set_base_frame(drachen_encoder*, const unsigned char*);
+
+/**
+ * Stores the features used by the stream of the given encoder or decoder into
+ * the second argument.
+ */
+void drachen_get_stream_params(const drachen_encoder*, drachen_stream_params*);
+
 /**
  * Frees all memory used by the given encoder, closes its file, and frees the
  * encoder itself.
@@ -123,6 +485,44 @@ int drachen_free(drachen_encoder*);
  */
 void drachen_set_block_size(drachen_encoder*, const drachen_block_spec*);
 
+/**
+ * Sets whether the given encoder chooses its segments by their total cost,
+ * rather than simply starting a new segment wherever the best encoding method
+ * for a block differs from that for the block before. When set, the encoder
+ * weighs the cost of every block under the methods chosen for the blocks
+ * around it, including the headers each new segment needs, and picks the
+ * segments which minimise the size of the frame. This yields fewer, larger
+ * segments, which are also quicker to decode, and makes small block sizes
+ * worthwhile, at the cost of encoding more slowly.
+ *
+ * This does not affect the format of the stream. It is off by default.
+ */
+void drachen_set_optimal_segments(drachen_encoder*, int);
+
+/**
+ * Allows the given encoder to alter each byte of the frames it encodes by up
+ * to max_error (in either direction, without wrapping around), so that more
+ * of each frame can use the cheaper encoding methods. Where a byte is within
+ * max_error of its value in the previous frame it is left at that value, and
+ * otherwise the differences are rounded so that they repeat and span a
+ * smaller range. Every frame is decoded exactly as altered, and frames are
+ * predicted from the altered frames before them, so the errors do not
+ * accumulate. Bytes split into bit planes (see DRACHEN_FEATURE_BITPLANES) are
+ * never altered, since their bits belong to different bytes.
+ *
+ * If target_size is non-zero, each frame is instead altered by the least
+ * error, up to max_error, for which its segments are expected to take no
+ * more than target_size bytes; frames which fit anyway are encoded exactly.
+ * The expectation does not count entropy coding (see
+ * DRACHEN_FEATURE_ENTROPY), which makes frames smaller still. Finding the
+ * error takes a few trial encodings of the frame.
+ *
+ * This does not affect the format of the stream. By default, max_error is 0,
+ * and frames are encoded exactly.
+ */
+void drachen_set_max_error(drachen_encoder*, unsigned max_error,
+                           uint32_t target_size);
+
 /**
  * Encodes a new frame via the given encoder. buffer is an array of bytes whose
  * length must be at least the frame size of the encoder. name is a
@@ -134,6 +534,17 @@ void drachen_set_block_size(drachen_encoder*, const drachen_block_spec*);
  */
 int drachen_encode(drachen_encoder*, const unsigned char* buffer,
                    const char* name);
+
+/**
+ * For streams with DRACHEN_FEATURE_REFERENCES, stores the next frame encoded
+ * by the given encoder into the given reference slot, and keeps it there
+ * until another frame is pinned to the same slot; other frames are then
+ * stored into the remaining slots in turn. This suits states which recur
+ * throughout the stream, such as a calibration frame.
+ *
+ * Returns 0 on success, or EINVAL if the stream has no such slot.
+ */
+int drachen_pin_frame(drachen_encoder*, unsigned slot);
 /**
  * Decodes the next frame from the given decoder, storing it in buffer, which
  * must have a length greater than or equal to the frame size. If name is
@@ -153,6 +564,146 @@ int drachen_encode(drachen_encoder*, const unsigned char* buffer,
 int drachen_decode(unsigned char* buffer, char* name, uint32_t namelen,
                    drachen_encoder*);
 
+/**
+ * Decodes up to max_frames frames from the given decoder in one call. buffer
+ * must be at least (max_frames*frame_size) bytes long; frame i is stored at
+ * (buffer + i*frame_size). The number of frames actually decoded is stored in
+ * *num_frames; this is less than max_frames only if the end of the stream or
+ * an error was encountered.
+ *
+ * If names is non-NULL, it is a buffer of names_len bytes (which must be at
+ * least one) into which the names of the frames are packed, each terminated
+ * by a NUL byte, and name_offsets must be an array of at least max_frames
+ * elements, into which the offset of each frame's name within names is
+ * stored. Names which do not fit within the remaining space are truncated;
+ * once the buffer is full, the remaining frames all share the empty name at
+ * its end. If names is NULL, frame names are discarded.
+ *
+ * For small frames, this is considerably faster than calling
+ * drachen_decode() repeatedly, in particular when the stream uses the
+ * identity transform, in which case frames are decoded directly into buffer.
+ *
+ * Returns 0 if at least one frame was decoded. If the end of the stream was
+ * reached before any frame could be decoded, returns DRACHEN_END_OF_STREAM.
+ * On failure, sets the error field in the decoder and returns non-zero;
+ * *num_frames still indicates how many frames were decoded successfully.
+ */
+int drachen_decode_batch(unsigned char* buffer, uint32_t max_frames,
+                         uint32_t* num_frames,
+                         char* names, uint32_t names_len,
+                         uint32_t* name_offsets,
+                         drachen_encoder*);
+
+/**
+ * Decodes the next frame from the given decoder, like drachen_decode(), and
+ * reports which byte ranges of the untransformed frame changed relative to
+ * the previous frame.
+ *
+ * Unlike drachen_decode(), buffer is updated in place: it must contain the
+ * previous frame (or all zeroes before the first frame), and only the bytes
+ * which changed are written. A byte is considered changed unless the segment
+ * encoding it states that it is a plain copy of the previous frame; thus, the
+ * reported ranges may include bytes whose values happen to be the same as
+ * before.
+ *
+ * The changed ranges are written, in ascending order and with adjacent ranges
+ * merged, into the array changes, which has room for max_changes elements
+ * (which must be at least one); the number of ranges stored is written to
+ * *num_changes. If more ranges are needed than fit, the final range is
+ * extended to cover the rest, so the reported ranges always cover every
+ * change. An entirely unchanged frame results in zero ranges, and is detected
+ * without touching the frame data at all.
+ *
+ * Returns the same values as drachen_decode().
+ */
+int drachen_decode_changes(unsigned char* buffer, char* name, uint32_t namelen,
+                           drachen_range* changes, uint32_t max_changes,
+                           uint32_t* num_changes,
+                           drachen_encoder*);
+
+/**
+ * Decodes the next frame from the given decoder, but instead of producing the
+ * frame, only validates it. This checks the structure of every segment and,
+ * if the stream has DRACHEN_FEATURE_CRC32C, the checksum of the frame; it is
+ * the cheapest way to read a stream, since the reverse transformation is
+ * skipped entirely. name and namelen are as with drachen_decode().
+ *
+ * Returns the same values as drachen_decode(); in particular,
+ * DRACHEN_BAD_CHECKSUM indicates a frame which does not match its checksum.
+ */
+int drachen_verify(char* name, uint32_t namelen, drachen_encoder*);
+
+/**
+ * Enables or disables "follow" mode on the given decoder, for reading a
+ * stream which is still being written.
+ *
+ * In follow mode, a frame which is only partially present in the input is
+ * not an error. Instead, the decoder rewinds to the start of that frame and
+ * reports DRACHEN_END_OF_STREAM (or, for drachen_decode_batch(), stops before
+ * it), so that a later call reads the frame again once it is complete. Thus,
+ * DRACHEN_END_OF_STREAM only means that no further frame is available yet.
+ * Rewinding requires the input file to be seekable; for other inputs, follow
+ * mode has no effect, since reads simply block until more data is present.
+ *
+ * @see drachen_wait_for_data().
+ */
+void drachen_set_follow(drachen_encoder*, int);
+
+/**
+ * Blocks until the input file of the given decoder may have grown, or until
+ * timeout_ms milliseconds have passed, whichever is first. Where supported,
+ * changes to the file are noticed as soon as they happen (via inotify);
+ * otherwise, this simply waits for the timeout. Spurious returns are
+ * possible.
+ *
+ * This is intended to be called after a decoder in follow mode reports
+ * DRACHEN_END_OF_STREAM. Returns 0 on success, or the value of errno if
+ * waiting failed.
+ */
+int drachen_wait_for_data(drachen_encoder*, unsigned timeout_ms);
+
+/**
+ * Restricts the given decoder to the "region of interest" described by the
+ * second argument, an array of num_ranges drachen_ranges within the
+ * untransformed frame. The ranges may be given in any order and may
+ * overlap; every end must be less than or equal to the frame size. The array
+ * is copied, so it remains owned by the caller.
+ *
+ * Unless the stream uses one of the features below, every byte of a frame is
+ * predicted only from the same byte of earlier frames, so the decoder then
+ * only keeps history for the bytes within the region; segments which lie
+ * entirely outside of it are parsed only as far as is necessary to skip them.
+ * With DRACHEN_FEATURE_DISPLACED or DRACHEN_FEATURE_SPATIAL, any byte may be
+ * predicted from any other, of the same frame or an earlier one, so the whole
+ * frame is kept and nothing is saved over drachen_decode().
+ * With DRACHEN_FEATURE_BITPLANES, a region which includes any byte within the
+ * bit planes keeps all of them, since each byte needs bits from every plane.
+ * With DRACHEN_FEATURE_WORD_DELTA, the region is widened to whole aligned
+ * groups of four bytes of the transformed frame, since words can only be
+ * decoded whole.
+ *
+ * Frames must then be read with drachen_decode_roi(); drachen_decode(),
+ * drachen_decode_batch(), drachen_decode_changes() and drachen_verify() fail
+ * with EINVAL.
+ *
+ * This may be called at most once per decoder, but need not be called before
+ * the first frame is decoded.
+ *
+ * Returns 0 on success; returns non-zero and sets the decoder's error field on
+ * failure.
+ */
+int drachen_set_roi(drachen_encoder*, const drachen_range*,
+                    unsigned num_ranges);
+
+/**
+ * Decodes the next frame from a decoder which has a region of interest (see
+ * drachen_set_roi()). This behaves exactly like drachen_decode(), except that
+ * only bytes within the region of interest are written into buffer; all other
+ * bytes are left untouched.
+ */
+int drachen_decode_roi(unsigned char* buffer, char* name, uint32_t namelen,
+                       drachen_encoder*);
+
 /**
  * Returns the error status of the given encoder.
  *
@@ -197,6 +748,10 @@ uint32_t drachen_frame_size(const drachen_encoder*);
  * reordered so that sub-pixels belonging to the same block are contiguous. If
  * block_width is not evenly divisible into cols, or block_height into rows, it
  * is resized so that it is.
+ *
+ * Images with multi-byte samples are handled by treating each byte as a
+ * component; for example, 16-bit greyscale is encoded well with
+ * num_components 2, which separates the low and high bytes.
  */
 void drachen_make_image_xform_matrix(uint32_t*,
                                      uint32_t offset,
@@ -206,6 +761,91 @@ void drachen_make_image_xform_matrix(uint32_t*,
                                      unsigned block_width,
                                      unsigned block_height);
 
+/**
+ * Creates a transformation matrix optimal for encoding an uncompressed YUV
+ * 4:2:0 image, storing it into the first argument, which must be at least
+ * (offset+cols*rows+2*((cols+1)/2)*((rows+1)/2)) long (elements beyond that
+ * length will not be touched).
+ *
+ * The image consists of a plane of cols by rows luma samples at offset,
+ * followed by the chroma samples for each 2x2 pixel square. If
+ * interleaved_chroma is zero, these are a plane of U samples followed by a
+ * plane of V samples (as in I420); otherwise, they are a single plane of U/V
+ * pairs (as in NV12), which is split into separate U and V planes.
+ *
+ * Within each plane, samples are grouped into blocks of block_width by
+ * block_height luma samples, or half that size for chroma, as with
+ * drachen_make_image_xform_matrix().
+ */
+void drachen_make_yuv420_xform_matrix(uint32_t*,
+                                      uint32_t offset,
+                                      uint32_t cols,
+                                      uint32_t rows,
+                                      int interleaved_chroma,
+                                      unsigned block_width,
+                                      unsigned block_height);
+
+/**
+ * Creates a transformation matrix optimal for encoding a raw Bayer mosaic
+ * (such as RGGB) from a camera sensor, storing it into the first argument,
+ * which must be at least (offset+bytes_per_sample*cols*rows) long (elements
+ * beyond that length will not be touched).
+ *
+ * The mosaic is cols by rows samples, each bytes_per_sample bytes wide (in
+ * any byte order), starting at offset; cols and rows must both be even. The
+ * samples at each of the four positions of the 2x2 colour filter pattern are
+ * split into their own subplane, and each byte of a sample into its own
+ * group of subplanes, so that (for example) the rarely-changing high bytes
+ * of 16-bit samples are all together. Within each subplane, samples are
+ * grouped into blocks of block_width by block_height, as with
+ * drachen_make_image_xform_matrix().
+ */
+void drachen_make_bayer_xform_matrix(uint32_t*,
+                                     uint32_t offset,
+                                     uint32_t cols,
+                                     uint32_t rows,
+                                     unsigned bytes_per_sample,
+                                     unsigned block_width,
+                                     unsigned block_height);
+
+/**
+ * Creates a transformation matrix optimal for encoding an array of
+ * fixed-size binary records, storing it into the first argument, which must
+ * be at least (offset+record_size*num_records) long (elements beyond that
+ * length will not be touched).
+ *
+ * offset specifies the byte offset of the first record. No byte reordering
+ * happens before the offset.
+ *
+ * The layout of each record is given by the num_fields elements of
+ * field_sizes, which are the sizes in bytes of the fields of the record, in
+ * order. Each must be at least one, and their sum may not exceed
+ * record_size; any bytes left over at the end of the record are treated as
+ * one more field. Bytes are reordered so that each field is in a single,
+ * contiguous block, in which the values of the field for each record follow
+ * each other.
+ *
+ * If split_bytes is non-zero, multi-byte fields are further split into one
+ * block per byte position, so that (for example) the high bytes of a counter,
+ * which rarely change, are all together.
+ */
+void drachen_make_record_xform_matrix(uint32_t*,
+                                      uint32_t offset,
+                                      uint32_t record_size,
+                                      uint32_t num_records,
+                                      const unsigned* field_sizes,
+                                      unsigned num_fields,
+                                      int split_bytes);
+
+/**
+ * Stores the transformation matrix described by the third argument, for
+ * frames of the size given by the second, into the first argument, which must
+ * be at least that long. If the spec is not valid for the frame size, the
+ * identity matrix is produced.
+ */
+void drachen_make_xform_matrix(uint32_t*, uint32_t,
+                               const drachen_xform_spec*);
+
 /**
  * Zeroes out the "previous frame" for the given encoder.
  *
@@ -22,13 +22,49 @@
 #include "drachen.h"
 
 /* Command-line options (initialised to 0) */
-static int co_is_encoding, co_is_decoding, co_dryrun;
+static int co_is_encoding, co_is_decoding, co_is_verifying, co_dryrun;
+static int co_checksum;
+static int co_compact_header;
+static int co_word_delta;
+static int co_linear;
+static unsigned co_references;
+static int co_displaced;
+static int co_spatial;
+static int co_packed;
+static int co_entropy;
+static int co_compact_segments;
+static int co_optimal_segments;
+static unsigned co_max_error, co_target_size;
+static int co_name_delta;
+static const char* co_base_frame;
+static unsigned co_background_shift;
+static unsigned co_row_stride;
+static int co_bitplanes;
+static unsigned co_bitplane_begin, co_bitplane_end;
+static int co_follow;
 static int co_zero_frames;
 static const char* co_primary_filename;
 static const char*const* co_encoding_input_files;
 static unsigned co_num_encoding_input_files;
 static unsigned co_image_off, co_image_comps,
   co_image_nr, co_image_nc, co_image_bw, co_image_bh;
+/* Pixel formats accepted by --img-format, in the order of
+ * image_format_names.
+ */
+enum image_format {
+  IMG_INTERLEAVED = 0, IMG_MONO16, IMG_YUV420, IMG_NV12, IMG_BAYER8,
+  IMG_BAYER16
+};
+static const char*const image_format_names[] = {
+  "interleaved", "mono16", "yuv420", "nv12", "bayer8", "bayer16", NULL
+};
+static int co_image_format;
+/* Maximum number of fields accepted by --record-fields */
+#define MAX_RECORD_FIELDS 256
+static unsigned co_record_size, co_record_off,
+  co_record_fields[MAX_RECORD_FIELDS], co_num_record_fields;
+static int co_record_split;
+static int co_auto_xform;
 static unsigned co_block_size;
 static int co_force;
 static const char* co_sequential_output_name;
@@ -42,6 +78,14 @@ static int co_verbosity, co_timing_statistics, co_nowarn;
 static const char* co_this;
 /* End command-line options */
 
+/* How long to wait for a followed archive to grow before checking it again
+ * anyway.
+ */
+#define FOLLOW_POLL_INTERVAL_MS 10
+
+/* How many frames from the start of the input --auto-xform examines */
+#define AUTO_XFORM_FRAMES 3
+
 static inline void l_syserr(const char* message) {
   fprintf(stderr, "%s: error: %s: %s\n",
           co_this, message, strerror(errno));
@@ -111,34 +155,60 @@ static inline void l_debug(const char* message) {
     fprintf(stderr, "%s: DEBUG: %s\n", co_this, message);
 }
 
-static int do_encode(void), do_decode(void);
+static int do_encode(void), do_decode(void), do_verify(void);
 
-static const char short_options[] = "hVfo:O:X:R:C:W:H:b:uNn:a:z:s:vtwedDZ";
+static const char short_options[] =
+  "hVfo:O:X:R:C:W:H:G:b:uNn:a:z:s:vtwedDZckFxl:P:r:SAB:mLK:M:I:pEygji:q:Q:U:";
 #ifdef HAVE_GETOPT_LONG
 static const struct option long_options[] = {
   { "allow-unsafe-names",  0, NULL, 'u' },
+  { "auto-xform",          0, NULL, 'A' },
+  { "background",          1, NULL, 'U' },
+  { "base-frame",          1, NULL, 'i' },
   { "begin",               1, NULL, 'a' },
+  { "bit-planes",          1, NULL, 'B' },
   { "block-size",          1, NULL, 'b' },
+  { "checksum",            0, NULL, 'k' },
+  { "compact-header",      0, NULL, 'x' },
+  { "compact-segments",    0, NULL, 'y' },
   { "decode",              0, NULL, 'd' },
+  { "displaced",           1, NULL, 'M' },
   { "dry-run",             0, NULL, 'D' },
   { "encode",              0, NULL, 'e' },
   { "end",                 1, NULL, 'z' },
+  { "entropy",             0, NULL, 'E' },
+  { "follow",              0, NULL, 'F' },
   { "force",               0, NULL, 'f' },
   { "help",                0, NULL, 'h' },
   { "img-block-height",    1, NULL, 'H' },
   { "img-block-width",     1, NULL, 'W' },
   { "img-body-offset",     1, NULL, 'O' },
+  { "img-format",          1, NULL, 'G' },
   { "img-num-cols",        1, NULL, 'C' },
   { "img-num-components",  1, NULL, 'X' },
   { "img-num-rows",        1, NULL, 'R' },
+  { "linear",              0, NULL, 'L' },
+  { "max-error",           1, NULL, 'q' },
+  { "name-delta",          0, NULL, 'j' },
   { "no-warnings",         0, NULL, 'w' },
   { "number-by-output",    0, NULL, 'N' },
   { "numeric-output-fmt",  1, NULL, 'n' },
+  { "optimal-segments",    0, NULL, 'g' },
   { "output",              0, NULL, 'o' },
+  { "pack",                0, NULL, 'p' },
+  { "record-fields",       1, NULL, 'l' },
+  { "record-offset",       1, NULL, 'P' },
+  { "record-size",         1, NULL, 'r' },
+  { "record-split-bytes",  0, NULL, 'S' },
+  { "references",          1, NULL, 'K' },
   { "show-timing",         0, NULL, 't' },
+  { "spatial",             1, NULL, 'I' },
   { "stride",              1, NULL, 's' },
+  { "target-size",         1, NULL, 'Q' },
   { "verbose",             0, NULL, 'v' },
+  { "verify",              0, NULL, 'c' },
   { "version",             0, NULL, 'V' },
+  { "word-delta",          0, NULL, 'm' },
   { "zero-frames",         0, NULL, 'Z' },
   {0},
 };
@@ -158,9 +228,93 @@ static void uint_arg_or_die(unsigned* dst,
   *dst = (unsigned)val;
 }
 
+static void image_format_arg_or_die(void) {
+  int i;
+
+  for (i = 0; image_format_names[i]; ++i) {
+    if (!strcmp(optarg, image_format_names[i])) {
+      co_image_format = i;
+      return;
+    }
+  }
+
+  fprintf(stderr, "%s: invalid pixel format for img-format: %s\n",
+          co_this, optarg);
+  exit(255);
+}
+
+/* Returns the number of bytes occupied by the image described by the image
+ * options.
+ */
+static unsigned long long image_size(void) {
+  unsigned long long pixels =
+    (unsigned long long)co_image_nc * co_image_nr;
+
+  switch (co_image_format) {
+  case IMG_YUV420:
+  case IMG_NV12:
+    return pixels + 2ULL * ((co_image_nc+1)/2) * ((co_image_nr+1)/2);
+
+  case IMG_MONO16:
+  case IMG_BAYER16:
+    return 2 * pixels;
+
+  case IMG_BAYER8:
+    return pixels;
+
+  default:
+    return co_image_comps * pixels;
+  }
+}
+
+static void bitplanes_arg_or_die(void) {
+  char* endptr;
+  unsigned long begin, end = 0;
+
+  begin = strtoul(optarg, &endptr, 0);
+  if (*endptr == ',')
+    end = strtoul(endptr+1, &endptr, 0);
+  if (*endptr || strchr(optarg, '-') || !strchr(optarg, ',') ||
+      begin > end || end > 0xFFFFFFFFul) {
+    fprintf(stderr, "%s: invalid range for bit-planes: %s\n",
+            co_this, optarg);
+    exit(255);
+  }
+
+  co_bitplanes = 1;
+  co_bitplane_begin = begin;
+  co_bitplane_end = end;
+}
+
+static void record_fields_arg_or_die(void) {
+  char* endptr;
+  const char* field = optarg;
+  long int val;
+
+  co_num_record_fields = 0;
+  do {
+    val = strtol(field, &endptr, 0);
+    if (endptr == field || (*endptr && *endptr != ',') || val <= 0) {
+      fprintf(stderr, "%s: invalid field sizes for record-fields: %s\n",
+              co_this, optarg);
+      exit(255);
+    }
+
+    if (co_num_record_fields == MAX_RECORD_FIELDS) {
+      fprintf(stderr, "%s: too many fields for record-fields (max %d)\n",
+              co_this, MAX_RECORD_FIELDS);
+      exit(255);
+    }
+
+    co_record_fields[co_num_record_fields++] = (unsigned)val;
+    field = endptr + 1;
+  } while (*endptr);
+}
+
 static const char*const usage_statement =
-"Usage: drachencode -e [-fvtwD] [parameters] -o outfile infiles...\n"
-"       drachencode -d [-fvtwDZ] [parameters] [-n format] [infile]\n"
+"Usage: drachencode -e [-fvtwDkxAmLpEygj] [parameters] -o outfile infiles...\n"
+"       drachencode -d [-fvtwDZF] [parameters] [-n format] [infile]\n"
+"       drachencode -c [-vtw] [infile]\n"
 "Encodes or decodes libdrachen files from or into individual named files.\n"
 "\n"
 "All options are listed below.\n"
@@ -171,23 +325,87 @@ static const char*const usage_statement =
   "    Even when using filenames from the archive (no --numeric-output-fmt),\n"
   "    use all names verbatim, other than the empty string. By default,\n"
   "    all forward slashes and initial dots are replaced before extraction.\n"
+  "-A, --auto-xform\n"
+  "    On encoding, examine the first few input files for the layout of an\n"
+  "    image or array of records, and reorder the bytes and choose the block\n"
+  "    size accordingly, as if the best image or record options had been\n"
+  "    given. Use --verbose to see what was chosen. This cannot be combined\n"
+  "    with the image or record options.\n"
+  "-U, --background=shift\n"
+  "    On encoding, keep a background model, an average of the frames so\n"
+  "    far which each frame moves 1/2^shift of the way towards (shift being\n"
+  "    1 to 8), and allow segments to predict from it where that does\n"
+  "    better. This suits fixed cameras and sensors, where parts which do\n"
+  "    not change are noisy; larger shifts average away more noise, but\n"
+  "    follow real changes more slowly. Archives using this cannot be read\n"
+  "    by older versions of libdrachen.\n"
+  "-i, --base-frame=file\n"
+  "    On encoding, predict the first frame from file, which should be one\n"
+  "    frame long, rather than from zeroes, so that input which starts close\n"
+  "    to a known state (such as a calibration image) does not pay for a\n"
+  "    whole first frame. The archive only records the checksum of file\n"
+  "    (shown with --verbose), and the same file must be given to decode or\n"
+  "    verify it; a directory may be given instead, in which the file named\n"
+  "    by the checksum, as eight hexadecimal digits, is used. Archives using\n"
+  "    this cannot be read by older versions of libdrachen.\n"
   "-a, --begin=index\n"
   "    When decoding, do not output frames before the index'th one.\n"
+  "-B, --bit-planes=begin,end\n"
+  "    On encoding, split bytes begin (inclusive) to end (exclusive) of each\n"
+  "    frame, after any reordering of bytes, into bit planes: bit k of every\n"
+  "    byte in the range is gathered into plane k. This helps when a few\n"
+  "    low bits of the values there change at random, such as with flags or\n"
+  "    noisy samples, but not with counters. The length of the range is\n"
+  "    rounded down to a multiple of 8. Archives with bit planes cannot be\n"
+  "    read by older versions of libdrachen.\n"
   "-b, --block-size=size\n"
   "    Sets the block size for encoding, in bytes.\n"
   "    Block size does not significantly affect encoding speed (except for\n"
   "    extreme values). Adjusting the block size from the default may give\n"
   "    better compression ratios.\n"
+  "-k, --checksum\n"
+  "    On encoding, store a CRC-32C checksum with every frame, which is\n"
+  "    checked whenever the frame is decoded or verified. Archives with\n"
+  "    checksums cannot be read by older versions of libdrachen.\n"
+  "-x, --compact-header\n"
+  "    On encoding, describe the byte reordering (see --img-num-cols and\n"
+  "    --record-size) in the archive header by its parameters, rather than\n"
+  "    storing a table of four bytes per frame byte. This makes the archive\n"
+  "    quicker to open for decoding, especially with large frames. Archives\n"
+  "    with compact headers cannot be read by older versions of libdrachen.\n"
+  "-y, --compact-segments\n"
+  "    On encoding, code the header of each segment of a frame in fewer\n"
+  "    bytes, mostly one, by referring back to the segments before it. This\n"
+  "    suits small blocks and frames which change little; an unchanged\n"
+  "    frame then takes one byte besides its name. Archives using this\n"
+  "    cannot be read by older versions of libdrachen.\n"
   "-d, --decode\n"
-  "    Perform decoding. This option is mutually exclusive with --encode;\n"
-  "    exactly one of the two must be specified.\n"
+  "    Perform decoding. This option is mutually exclusive with --encode\n"
+  "    and --verify; exactly one of the three must be specified.\n"
+  "-M, --displaced=stride\n"
+  "    On encoding, allow segments to predict from the previous frame\n"
+  "    displaced by a number of bytes, where that does better. This suits\n"
+  "    content which scrolls or pans. The encoder tries displacements of a\n"
+  "    few bytes and, if stride is not zero, of a few rows of stride bytes\n"
+  "    (after any reordering of bytes). Archives using this cannot be read\n"
+  "    by older versions of libdrachen.\n"
   "-D, --dry-run\n"
   "    Do everything but file writing.\n"
   "-e, --encode\n"
-  "    Perform encoding. This option is mutually exclusive with --decode;\n"
-  "    exactly one of the two must be specified.\n"
+  "    Perform encoding. This option is mutually exclusive with --decode\n"
+  "    and --verify; exactly one of the three must be specified.\n"
   "-z, --end=index\n"
   "    When decoding, do not output frames at or after the index'th one.\n"
+  "-E, --entropy\n"
+  "    On encoding, entropy-code the segments of each frame, where that\n"
+  "    makes the frame smaller. This takes out most of what compressing the\n"
+  "    archive afterwards would, while keeping frames separate. Archives\n"
+  "    using this cannot be read by older versions of libdrachen.\n"
+  "-F, --follow\n"
+  "    When decoding, keep waiting for more frames once the end of the\n"
+  "    archive is reached, like tail -f, for archives which are still being\n"
+  "    written. A partially written frame is read again once it is\n"
+  "    complete. Use --end to stop after a certain number of frames.\n"
   "-f, --force\n"
   "    On decoding, allow overwriting of files. On encoding, allow implicitly\n"
   "    writing to standard output (this makes --output optional).\n"
@@ -195,6 +413,7 @@ static const char*const usage_statement =
   "    Print this help message and exit.\n"
   "-H, --img-block-height=height\n"
   "-W, --img-block-width=width\n"
+  "-G, --img-format=format\n"
   "-O, --img-offset=offset\n"
   "-C, --img-num-cols=ncols\n"
   "-X, --img-num-components=ncomps\n"
@@ -213,6 +432,37 @@ static const char*const usage_statement =
   "    is not given, one is assumed.\n"
   "    Either all or none of these options must be given, except for\n"
   "    --img-offset and --img-num-components, which are always optional.\n"
+  "    Instead of --img-num-components, --img-format may name the layout of\n"
+  "    the pixels, which is one of:\n"
+  "      interleaved   ncomps bytes per pixel (the default)\n"
+  "      mono16        16-bit greyscale; low and high bytes are split\n"
+  "      yuv420        planar YUV 4:2:0 (I420)\n"
+  "      nv12          YUV 4:2:0 with interleaved chroma, which is split\n"
+  "      bayer8        8-bit Bayer mosaic, split into four subplanes\n"
+  "      bayer16       16-bit Bayer mosaic, split into four subplanes for\n"
+  "                    each of the low and high bytes\n"
+  "    For yuv420 and nv12, the block size applies to luma, and is halved\n"
+  "    for chroma. For the Bayer formats, ncols and nrows must be even, and\n"
+  "    the block size applies within each subplane.\n"
+  "-L, --linear\n"
+  "    On encoding, allow segments to predict each byte as twice its value\n"
+  "    in the previous frame less its value in the frame before, where that\n"
+  "    does better. This suits values which move by a steady step every\n"
+  "    frame. With --word-delta, this is also done on 16-bit and 32-bit\n"
+  "    words. Archives using this cannot be read by older versions of\n"
+  "    libdrachen.\n"
+  "-q, --max-error=error\n"
+  "    On encoding, allow each byte of every frame (after any reordering of\n"
+  "    bytes) to be stored up to error above or below its real value, so\n"
+  "    that frames take fewer bytes. Decoded frames are then not exactly\n"
+  "    the input, but errors do not build up from frame to frame. Bytes in\n"
+  "    --bit-planes are always exact. See also --target-size. This does not\n"
+  "    affect which versions of libdrachen can read the archive.\n"
+  "-j, --name-delta\n"
+  "    On encoding, store the name of each frame as the part which differs\n"
+  "    from the name of the frame before, and names of numbered files which\n"
+  "    follow on from the one before in a single byte. Archives using this\n"
+  "    cannot be read by older versions of libdrachen.\n"
   "-w, --no-warnings\n"
   "    Suppress any warnings that may be issued.\n"
   "-N, --number-by-output\n"
@@ -222,18 +472,73 @@ static const char*const usage_statement =
   "    Instead of using files embedded in the archive on decoding, instead\n"
   "    use format (a printf-compatible string which will receive exactly one\n"
   "    integer argument) to derive filenames from a zero-based frame index.\n"
+  "-g, --optimal-segments\n"
+  "    On encoding, choose the segments of each frame to minimise its size\n"
+  "    overall, rather than block by block, so that frames have fewer, larger\n"
+  "    segments. This encodes more slowly, but decodes faster, and does not\n"
+  "    affect which versions of libdrachen can read the archive.\n"
   "-o, --output=outfile\n"
   "    On encoding, write to outfile instead of standard output. The name\n"
   "    \"-\" means to use standard output, even if --force was not given.\n"
+  "-p, --pack\n"
+  "    On encoding, allow segments to pack each byte into as few bits as\n"
+  "    their range needs, from 1 to 7, where that does better. This suits\n"
+  "    noisy data whose values vary only a little. Archives using this\n"
+  "    cannot be read by older versions of libdrachen.\n"
+  "-l, --record-fields=sizes\n"
+  "-P, --record-offset=offset\n"
+  "-r, --record-size=size\n"
+  "-S, --record-split-bytes\n"
+  "    On encoding, reorder the input bytes to be optimal for an array of\n"
+  "    records which are size bytes long, the first of which is located at\n"
+  "    byte offset offset, and which fill the rest of the frame. sizes is a\n"
+  "    comma-separated list of the sizes of the fields in each record, in\n"
+  "    bytes; any remainder of the record is treated as one more field.\n"
+  "    Bytes are rearranged so that the values of each field are in a run\n"
+  "    by themselves. With --record-split-bytes, every byte position of\n"
+  "    every field is in a run by itself instead.\n"
+  "    If no --record-fields is given, the whole record is one field. If no\n"
+  "    --record-offset is given, zero is assumed. These options cannot be\n"
+  "    combined with the image options.\n"
+  "-K, --references=count\n"
+  "    On encoding, keep count (1 to 14) earlier frames besides the\n"
+  "    previous one, from which segments may be predicted; by default, the\n"
+  "    most recent distinct frames. A frame identical to one of them, or to\n"
+  "    the previous frame, is stored as a single byte. This suits input\n"
+  "    which returns to earlier states. Archives using this cannot be read\n"
+  "    by older versions of libdrachen.\n"
   "-t, --show-timing\n"
   "    Show timing and speed statistics.\n"
+  "-I, --spatial=stride\n"
+  "    On encoding, allow segments to predict each byte from the byte\n"
+  "    before it or, if stride is not zero, from the byte stride bytes\n"
+  "    before it, in the same frame, where that does better. This mostly\n"
+  "    helps the first frame and frames after a scene change. If both this\n"
+  "    and --displaced are given, the same stride is used for both.\n"
+  "    Archives using this cannot be read by older versions of libdrachen.\n"
   "-s, --stride=stride\n"
   "    On decoding, only output frames whose index is evenly divisible by\n"
   "    stride.\n"
+  "-Q, --target-size=size\n"
+  "    With --max-error, only allow as much error in each frame as needed\n"
+  "    for it to be expected to take no more than size bytes (besides its\n"
+  "    name), up to the given error; frames which fit anyway are stored\n"
+  "    exactly.\n"
   "-v, --verbose\n"
   "    Print more messages. Each use of this option increases the verbosity.\n"
+  "-c, --verify\n"
+  "    Check the structure of every frame in the archive, and the checksum\n"
+  "    of every frame if it has them (see --checksum), without producing\n"
+  "    any output. This is much faster than a --dry-run decode.\n"
   "-V, --version\n"
   "    Print version number and exit.\n"
+  "-m, --word-delta\n"
+  "    On encoding, allow segments to predict 16-bit or 32-bit little-endian\n"
+  "    words from the previous frame, rather than single bytes, where that\n"
+  "    does better. This helps with multi-byte samples which change by small\n"
+  "    amounts, as long as their bytes are kept together and aligned to the\n"
+  "    start of the frame (after any reordering of bytes). Archives using\n"
+  "    this cannot be read by older versions of libdrachen.\n"
   "-Z, --zero-frames\n"
   "    On decoding, pretend the previous frame, starting at img-offset, is\n"
   "    entirely zero. This has interesting effects for video.\n"
@@ -242,6 +547,7 @@ static const char*const usage_statement =
 int main(int argc, char*const* argv) {
   int opt, has_consumed_fmt_input;
   unsigned i;
+  unsigned long fields_size;
   co_this = argv[0];
 
   while (-1 != (opt =
@@ -270,6 +576,80 @@ int main(int argc, char*const* argv) {
       co_is_decoding = 1;
       break;
 
+    case 'c':
+      co_is_verifying = 1;
+      break;
+
+    case 'k':
+      co_checksum = 1;
+      break;
+
+    case 'x':
+      co_compact_header = 1;
+      break;
+
+    case 'm':
+      co_word_delta = 1;
+      break;
+
+    case 'L':
+      co_linear = 1;
+      break;
+
+    case 'K':
+      uint_arg_or_die(&co_references, "references");
+      break;
+
+    case 'M':
+      co_displaced = 1;
+      uint_arg_or_die(&co_row_stride, "displaced");
+      break;
+
+    case 'I':
+      co_spatial = 1;
+      uint_arg_or_die(&co_row_stride, "spatial");
+      break;
+
+    case 'p':
+      co_packed = 1;
+      break;
+
+    case 'E':
+      co_entropy = 1;
+      break;
+
+    case 'y':
+      co_compact_segments = 1;
+      break;
+
+    case 'g':
+      co_optimal_segments = 1;
+      break;
+
+    case 'j':
+      co_name_delta = 1;
+      break;
+
+    case 'i':
+      co_base_frame = optarg;
+      break;
+
+    case 'U':
+      uint_arg_or_die(&co_background_shift, "background");
+      break;
+
+    case 'q':
+      uint_arg_or_die(&co_max_error, "max-error");
+      break;
+
+    case 'Q':
+      uint_arg_or_die(&co_target_size, "target-size");
+      break;
+
+    case 'F':
+      co_follow = 1;
+      break;
+
     case 'D':
       co_dryrun = 1;
       break;
@@ -294,6 +674,10 @@ int main(int argc, char*const* argv) {
       uint_arg_or_die(&co_image_off, "img-offset");
       break;
 
+    case 'G':
+      image_format_arg_or_die();
+      break;
+
     case 'C':
       uint_arg_or_die(&co_image_nc, "img-num-cols");
       break;
@@ -302,6 +686,30 @@ int main(int argc, char*const* argv) {
       uint_arg_or_die(&co_image_comps, "img-num-components");
       break;
 
+    case 'l':
+      record_fields_arg_or_die();
+      break;
+
+    case 'P':
+      uint_arg_or_die(&co_record_off, "record-offset");
+      break;
+
+    case 'r':
+      uint_arg_or_die(&co_record_size, "record-size");
+      break;
+
+    case 'S':
+      co_record_split = 1;
+      break;
+
+    case 'B':
+      bitplanes_arg_or_die();
+      break;
+
+    case 'A':
+      co_auto_xform = 1;
+      break;
+
     case 'R':
       uint_arg_or_die(&co_image_nr, "img-num-rows");
       break;
@@ -358,14 +766,15 @@ int main(int argc, char*const* argv) {
   }
 
   /* Validate options */
-  if (!(co_is_decoding ^ co_is_encoding)) {
-    l_error("Exactly one of --encode or --decode must be specified.");
+  if (co_is_decoding + co_is_encoding + co_is_verifying != 1) {
+    l_error("Exactly one of --encode, --decode or --verify must be "
+            "specified.");
     return 255;
   }
 
   if (co_is_encoding &&
       (co_image_nc || co_image_nr || co_image_bw || co_image_bh ||
-       co_image_off || co_image_comps) &&
+       co_image_off || co_image_comps || co_image_format) &&
       !(co_image_nc && co_image_nr && co_image_bw && co_image_bh)) {
     l_error("Either no image options, or at least --img-num-cols,\n"
             "--img-num-rows, --img-block-width, and --img-block-height\n"
@@ -373,9 +782,44 @@ int main(int argc, char*const* argv) {
     return 255;
   }
 
+  if (co_image_comps && co_image_format) {
+    l_error("--img-num-components cannot be combined with --img-format.");
+    return 255;
+  }
+
+  if ((co_image_format == IMG_BAYER8 || co_image_format == IMG_BAYER16) &&
+      (co_image_nc % 2 || co_image_nr % 2)) {
+    l_error("Bayer mosaics must have an even number of rows and columns.");
+    return 255;
+  }
+
   if (co_image_nc && !co_image_comps)
     co_image_comps = 1;
 
+  if (co_is_encoding &&
+      (co_num_record_fields || co_record_off || co_record_split) &&
+      !co_record_size) {
+    l_error("--record-size must be given with the other record options.");
+    return 255;
+  }
+
+  if (co_record_size && co_image_nc) {
+    l_error("Record and image options cannot be combined.");
+    return 255;
+  }
+
+  if (co_auto_xform && (co_record_size || co_image_nc)) {
+    l_error("--auto-xform cannot be combined with image or record options.");
+    return 255;
+  }
+
+  for (i = 0, fields_size = 0; i < co_num_record_fields; ++i)
+    fields_size += co_record_fields[i];
+  if (co_record_size && fields_size > co_record_size) {
+    l_error("The record fields are larger than --record-size.");
+    return 255;
+  }
+
   /* Validate the format string, if given */
   if (co_sequential_output_name) {
     has_consumed_fmt_input = 0;
@@ -438,6 +882,11 @@ int main(int argc, char*const* argv) {
     l_warn("Actual block height will differ from what you specified.");
   }
 
+  if (co_follow && !co_is_decoding) {
+    l_error("--follow is only meaningful with --decode.");
+    return 255;
+  }
+
   if (co_dryrun && co_is_encoding) {
     l_report("Changing output file to /dev/null to perform dry-run.");
     co_primary_filename = "/dev/null";
@@ -467,7 +916,7 @@ int main(int argc, char*const* argv) {
       return 255;
     }
 
-    return do_decode();
+    return co_is_verifying? do_verify() : do_decode();
   }
 }
 
@@ -483,19 +932,182 @@ static const char*const data_suffices[] = {
   "YB",
 };
 
+/* Reads the given input file into buffer, which is frame_size bytes long.
+ * Returns 0 on success or an exit status on failure.
+ */
+static int read_input_frame(unsigned char* buffer, uint32_t frame_size,
+                            const char* filename) {
+  FILE* infile;
+  uint32_t amt_read;
+
+  infile = fopen(filename, "rb");
+  if (!infile) {
+    l_sysferr("Could not open input file", filename);
+    return 254;
+  }
+
+  amt_read = fread(buffer, 1, frame_size, infile);
+  if (ferror(infile)) {
+    l_sysferr("Could not read from input file", filename);
+    fclose(infile);
+    return 254;
+  }
+
+  if (EOF != fgetc(infile)) {
+    l_warns("File is longer than frame size; it will be truncated",
+            filename);
+  }
+
+  fclose(infile);
+
+  if (amt_read < frame_size) {
+    l_warns("File is shorter than frame size; other bytes assumed zero.",
+            filename);
+    memset(buffer+amt_read, 0, frame_size-amt_read);
+  }
+
+  return 0;
+}
+
+/* Chooses the transform and block sizes for --auto-xform from the first few
+ * input files. Returns 0 on success or an exit status on failure.
+ */
+static int auto_xform(drachen_xform_spec* xform_spec,
+                      drachen_block_spec* blocks,
+                      uint32_t frame_size) {
+  unsigned char* frames[AUTO_XFORM_FRAMES];
+  unsigned num_frames = 0, i;
+  int status = 0, err;
+
+  while (num_frames < AUTO_XFORM_FRAMES &&
+         num_frames < co_num_encoding_input_files) {
+    frames[num_frames] = malloc(frame_size);
+    if (!frames[num_frames]) {
+      l_syserr("Could not allocate sample buffer");
+      status = 254;
+      goto finish;
+    }
+
+    ++num_frames;
+    if ((status = read_input_frame(frames[num_frames-1], frame_size,
+                                   co_encoding_input_files[num_frames-1])))
+      goto finish;
+  }
+
+  if ((err = drachen_suggest_xform(xform_spec, blocks,
+                                   (const unsigned char*const*)frames,
+                                   num_frames, frame_size))) {
+    errno = err;
+    l_syserr("Could not choose a transform");
+    status = 254;
+    goto finish;
+  }
+
+  switch (xform_spec->kind) {
+  case DRACHEN_XFORM_IMAGE:
+    l_reportf("Using image transform: offset %u, %u cols, %u rows, "
+              "%u components, %ux%u blocks.\n",
+              (unsigned)xform_spec->offset, (unsigned)xform_spec->cols,
+              (unsigned)xform_spec->rows, xform_spec->num_components,
+              xform_spec->block_width, xform_spec->block_height);
+    break;
+
+  case DRACHEN_XFORM_RECORD:
+    l_reportf("Using record transform: offset %u, %u records of %u bytes.\n",
+              (unsigned)xform_spec->offset,
+              (unsigned)xform_spec->num_records,
+              xform_spec->record_size);
+    break;
+
+  default:
+    l_reportf("Not reordering bytes.\n");
+    break;
+  }
+  l_reportf("Using block size of %u bytes.\n",
+            (unsigned)blocks[xform_spec->offset? 1 : 0].block_size);
+
+  finish:
+  for (i = 0; i < num_frames; ++i)
+    free(frames[i]);
+
+  return status;
+}
+
+/* Gives the given decoder the base frame named by --base-frame, if its
+ * archive was encoded against one. If a directory was named, the frame is the
+ * file within it named by the checksum of the base frame. Returns 0 on
+ * success or an exit status on failure.
+ */
+static int load_base_frame(drachen_encoder* enc) {
+  drachen_stream_params params;
+  struct stat statbuf;
+  const char* filename = co_base_frame;
+  char* path = NULL;
+  unsigned char* base = NULL;
+  int status = 0;
+
+  drachen_get_stream_params(enc, &params);
+  if (!(params.features & DRACHEN_FEATURE_BASE_FRAME)) {
+    if (co_base_frame)
+      l_warn("Archive has no base frame; ignoring --base-frame.");
+    return 0;
+  }
+
+  if (!co_base_frame) {
+    l_error("Archive was encoded against a base frame; use --base-frame.");
+    return 255;
+  }
+
+  if (!stat(co_base_frame, &statbuf) && S_ISDIR(statbuf.st_mode)) {
+    path = malloc(strlen(co_base_frame) + 10);
+    if (!path) {
+      l_syserr("Could not allocate base frame path");
+      return 254;
+    }
+
+    sprintf(path, "%s/%08x", co_base_frame, (unsigned)params.base_crc);
+    filename = path;
+  }
+
+  base = malloc(drachen_frame_size(enc));
+  if (!base) {
+    l_syserr("Could not allocate base frame");
+    status = 254;
+    goto finish;
+  }
+
+  if ((status = read_input_frame(base, drachen_frame_size(enc), filename)))
+    goto finish;
+
+  if (drachen_set_base_frame(enc, base)) {
+    l_errore(filename, enc);
+    status = 254;
+  }
+
+  finish:
+  if (base) free(base);
+  if (path) free(path);
+  return status;
+}
+
 static int do_encode(void) {
-  FILE* file = 0, *infile = 0;
+  FILE* file = 0;
   drachen_encoder* enc = NULL;
   struct stat statbuf;
-  uint32_t frame_size, amt_read;
-  uint32_t* custom_xform = NULL;
-  unsigned char* buffer = NULL;
+  uint32_t frame_size;
+  drachen_xform_spec xform_spec;
+  uint32_t* xform = NULL;
+  unsigned char* buffer = NULL, * base = NULL;
   int status = 0;
   unsigned i;
   clock_t enc_start, enc_end, total_time = 0;
   unsigned long long total_data;
   unsigned data_suffix = 0;
   drachen_block_spec custom_blocks[2];
+  drachen_stream_params params;
+
+  memset(&xform_spec, 0, sizeof(xform_spec));
+  xform_spec.kind = DRACHEN_XFORM_IDENTITY;
 
   if (!co_primary_filename || !strcmp(co_primary_filename, "-"))
     file = stdin;
@@ -533,35 +1145,74 @@ static int do_encode(void) {
   l_reportf("Using frame size of %u bytes.\n", (unsigned)frame_size);
 
   if (co_image_bw) {
-    if (frame_size < co_image_off + co_image_comps*co_image_nr*co_image_nc) {
+    if (frame_size < co_image_off + image_size()) {
       l_error("Frames are too small for the image parameters you specified.");
       status = 255;
       goto finish;
     }
 
-    if (frame_size > co_image_nc + co_image_comps*co_image_nr*co_image_nc)
+    if (frame_size > co_image_off + image_size())
       l_warn("Frame size is larger than the space used by the image parms.");
 
-    custom_xform = malloc(sizeof(uint32_t)*frame_size);
-    if (!custom_xform) {
-      l_syserr("Could not allocate image transform buffer");
-      status = 254;
+    switch (co_image_format) {
+    case IMG_YUV420:
+    case IMG_NV12:
+    case IMG_BAYER8:
+    case IMG_BAYER16:
+      /* These have no parametric form, so build the table */
+      xform = malloc(sizeof(uint32_t) * frame_size);
+      if (!xform) {
+        l_syserr("Could not allocate transform");
+        status = 254;
+        goto finish;
+      }
+
+      for (i = co_image_off + image_size(); i < frame_size; ++i)
+        xform[i] = i;
+
+      if (co_image_format == IMG_YUV420 || co_image_format == IMG_NV12)
+        drachen_make_yuv420_xform_matrix(xform, co_image_off,
+                                         co_image_nc, co_image_nr,
+                                         co_image_format == IMG_NV12,
+                                         co_image_bw, co_image_bh);
+      else
+        drachen_make_bayer_xform_matrix(xform, co_image_off,
+                                        co_image_nc, co_image_nr,
+                                        co_image_format == IMG_BAYER16? 2 : 1,
+                                        co_image_bw, co_image_bh);
+      break;
+
+    default:
+      xform_spec.kind = DRACHEN_XFORM_IMAGE;
+      xform_spec.offset = co_image_off;
+      xform_spec.cols = co_image_nc;
+      xform_spec.rows = co_image_nr;
+      xform_spec.num_components =
+        co_image_format == IMG_MONO16? 2 : co_image_comps;
+      xform_spec.block_width = co_image_bw;
+      xform_spec.block_height = co_image_bh;
+      break;
+    }
+  } else if (co_record_size) {
+    if (frame_size < co_record_off + co_record_size) {
+      l_error("Frames are too small for the record parameters you specified.");
+      status = 255;
       goto finish;
     }
 
-    /* Initialise the whole thing first in case the image doesn't cover the
-     * whole thing.
-     */
-    for (i = 0; i < frame_size; ++i)
-      custom_xform[i] = i;
-
-    drachen_make_image_xform_matrix(custom_xform,
-                                    co_image_off,
-                                    co_image_nc,
-                                    co_image_nr,
-                                    co_image_comps,
-                                    co_image_bw,
-                                    co_image_bh);
+    if ((frame_size - co_record_off) % co_record_size)
+      l_warn("Frame size is not a whole number of records.");
+
+    xform_spec.kind = DRACHEN_XFORM_RECORD;
+    xform_spec.offset = co_record_off;
+    xform_spec.record_size = co_record_size;
+    xform_spec.num_records = (frame_size - co_record_off) / co_record_size;
+    xform_spec.field_sizes = co_record_fields;
+    xform_spec.num_fields = co_num_record_fields;
+    xform_spec.split_bytes = co_record_split;
+  } else if (co_auto_xform) {
+    if ((status = auto_xform(&xform_spec, custom_blocks, frame_size)))
+      goto finish;
   }
 
   buffer = malloc(frame_size);
@@ -571,12 +1222,93 @@ static int do_encode(void) {
     goto finish;
   }
 
-  enc = drachen_create_encoder(file, frame_size, custom_xform);
+  drachen_default_stream_params(&params);
+  if (co_checksum)
+    params.features |= DRACHEN_FEATURE_CRC32C;
+  if (co_compact_header)
+    params.features |= DRACHEN_FEATURE_XFORM_DESC;
+  if (co_word_delta)
+    params.features |= DRACHEN_FEATURE_WORD_DELTA;
+  if (co_linear)
+    params.features |= DRACHEN_FEATURE_LINEAR;
+  if (co_references) {
+    if (co_references > DRACHEN_MAX_REFERENCES) {
+      l_error("Too many reference frames.");
+      status = 255;
+      goto finish;
+    }
+
+    params.features |= DRACHEN_FEATURE_REFERENCES;
+    params.num_references = co_references;
+  }
+  if (co_displaced)
+    params.features |= DRACHEN_FEATURE_DISPLACED;
+  if (co_spatial)
+    params.features |= DRACHEN_FEATURE_SPATIAL;
+  if (co_packed)
+    params.features |= DRACHEN_FEATURE_PACKED;
+  if (co_entropy)
+    params.features |= DRACHEN_FEATURE_ENTROPY;
+  if (co_compact_segments)
+    params.features |= DRACHEN_FEATURE_COMPACT_SEGMENTS;
+  if (co_name_delta)
+    params.features |= DRACHEN_FEATURE_NAME_DELTA;
+  if (co_background_shift) {
+    if (co_background_shift > DRACHEN_MAX_BACKGROUND_SHIFT) {
+      l_error("Background shift too large.");
+      status = 255;
+      goto finish;
+    }
+
+    params.features |= DRACHEN_FEATURE_BACKGROUND;
+    params.background_shift = co_background_shift;
+  }
+  params.row_stride = co_row_stride;
+  if (co_bitplanes) {
+    if (co_bitplane_end > frame_size) {
+      l_error("The bit-plane range extends past the end of the frame.");
+      status = 255;
+      goto finish;
+    }
+
+    params.features |= DRACHEN_FEATURE_BITPLANES;
+    params.bitplane_begin = co_bitplane_begin;
+    params.bitplane_end = co_bitplane_end;
+  }
+  if (co_base_frame) {
+    base = malloc(frame_size);
+    if (!base) {
+      l_syserr("Could not allocate base frame");
+      status = 254;
+      goto finish;
+    }
+
+    if ((status = read_input_frame(base, frame_size, co_base_frame)))
+      goto finish;
+
+    params.features |= DRACHEN_FEATURE_BASE_FRAME;
+    params.base_frame = base;
+  }
+
+  if (xform)
+    enc = drachen_create_encoder_ex(file, frame_size, xform, &params);
+  else
+    enc = drachen_create_encoder_spec(file, frame_size, &xform_spec, &params);
   if (!enc) {
     l_syserr("Could not allocate encoder");
     status = 254;
     goto finish;
   }
+  if (drachen_error(enc)) {
+    l_errore(co_primary_filename? co_primary_filename : "<default>", enc);
+    status = 254;
+    goto finish;
+  }
+
+  if (co_base_frame) {
+    drachen_get_stream_params(enc, &params);
+    l_reportf("Base frame checksum is %08x.\n", (unsigned)params.base_crc);
+  }
 
   if (co_block_size) {
     custom_blocks[0].segment_end = 0xFFFFFFFFu;
@@ -597,39 +1329,21 @@ static int do_encode(void) {
         custom_blocks[0].block_size = co_image_bw;
     }
 
+    drachen_set_block_size(enc, custom_blocks);
+  } else if (co_auto_xform) {
     drachen_set_block_size(enc, custom_blocks);
   }
+  drachen_set_optimal_segments(enc, co_optimal_segments);
+  if (co_target_size && !co_max_error)
+    l_warn("--target-size has no effect without --max-error.");
+  drachen_set_max_error(enc, co_max_error, co_target_size);
 
   for (i = 0; i < co_num_encoding_input_files; ++i) {
     l_report(co_encoding_input_files[i]);
 
-    infile = fopen(co_encoding_input_files[i], "rb");
-    if (!infile) {
-      l_sysferr("Could not open input file", co_encoding_input_files[i]);
-      status = 254;
+    if ((status = read_input_frame(buffer, frame_size,
+                                   co_encoding_input_files[i])))
       goto finish;
-    }
-
-    amt_read = fread(buffer, 1, frame_size, infile);
-    if (ferror(infile)) {
-      l_sysferr("Could not read from input file", co_encoding_input_files[i]);
-      status = 254;
-      goto finish;
-    }
-
-    if (EOF != fgetc(infile)) {
-      l_warns("File is longer than frame size; it will be truncated",
-              co_encoding_input_files[i]);
-    }
-
-    fclose(infile);
-    infile = NULL;
-
-    if (amt_read < frame_size) {
-      l_warns("File is shorter than frame size; other bytes assumed zero.",
-              co_encoding_input_files[i]);
-      memset(buffer+amt_read, 0, frame_size-amt_read);
-    }
 
     enc_start = clock();
     status = drachen_encode(enc, buffer, co_encoding_input_files[i]);
@@ -678,9 +1392,9 @@ static int do_encode(void) {
   }
 
   finish:
-  if (infile) fclose(infile);
   if (buffer) free(buffer);
-  if (custom_xform) free(custom_xform);
+  if (base) free(base);
+  if (xform) free(xform);
   if (enc) {
     drachen_free(enc);
     file = NULL;
@@ -713,6 +1427,21 @@ int do_decode(void) {
   }
 
   enc = drachen_create_decoder(infile, 0);
+  /* When following, the headers may not have been completely written yet */
+  while (co_follow && infile != stdin && enc &&
+         drachen_error(enc) == DRACHEN_PREMATURE_EOF) {
+    drachen_free(enc);
+    enc = NULL;
+    usleep(FOLLOW_POLL_INTERVAL_MS * 1000);
+    infile = fopen(co_primary_filename, "rb");
+    if (!infile) {
+      l_sysferr("Could not open input file", co_primary_filename);
+      status = 254;
+      goto finish;
+    }
+
+    enc = drachen_create_decoder(infile, 0);
+  }
   if (!enc) {
     l_syserr("Could not allocate decoder");
     status = 254;
@@ -724,6 +1453,12 @@ int do_decode(void) {
     goto finish;
   }
 
+  if ((status = load_base_frame(enc)))
+    goto finish;
+
+  if (co_follow)
+    drachen_set_follow(enc, 1);
+
   frame_size = drachen_frame_size(enc);
   l_reportf("Decoding with frame size %u\n", (unsigned)frame_size);
   buffer = malloc(frame_size);
@@ -734,9 +1469,20 @@ int do_decode(void) {
   }
 
   for (current_frame = 0; !co_end || current_frame < co_end; ++current_frame) {
-    dec_start = clock();
-    status = drachen_decode(buffer, filename, sizeof(filename), enc);
-    dec_end = clock();
+    while (1) {
+      dec_start = clock();
+      status = drachen_decode(buffer, filename, sizeof(filename), enc);
+      dec_end = clock();
+
+      if (status != DRACHEN_END_OF_STREAM || !co_follow)
+        break;
+
+      if (drachen_wait_for_data(enc, FOLLOW_POLL_INTERVAL_MS)) {
+        l_syserr("Could not wait for more input");
+        status = 254;
+        goto finish;
+      }
+    }
 
     if (status == DRACHEN_END_OF_STREAM) {
       status = 0;
@@ -851,3 +1597,74 @@ int do_decode(void) {
   if (infile) fclose(infile);
   return status;
 }
+
+int do_verify(void) {
+  FILE* infile = NULL;
+  drachen_encoder* enc = NULL;
+  drachen_stream_params params;
+  unsigned current_frame;
+  char filename[256];
+  clock_t start;
+  int status = 0;
+
+  if (!co_primary_filename || !strcmp(co_primary_filename, "-"))
+    infile = stdin;
+  else
+    infile = fopen(co_primary_filename, "rb");
+
+  if (!infile) {
+    l_sysferr("Could not open input file", co_primary_filename);
+    status = 254;
+    goto finish;
+  }
+
+  enc = drachen_create_decoder(infile, 0);
+  if (!enc) {
+    l_syserr("Could not allocate decoder");
+    status = 254;
+    goto finish;
+  }
+  if (drachen_error(enc)) {
+    l_errore(co_primary_filename? co_primary_filename : "<default>", enc);
+    status = 254;
+    goto finish;
+  }
+
+  if ((status = load_base_frame(enc)))
+    goto finish;
+
+  drachen_get_stream_params(enc, &params);
+  if (!(params.features & DRACHEN_FEATURE_CRC32C))
+    l_warn("Archive has no checksums; only its structure can be verified.");
+
+  filename[0] = 0;
+  start = clock();
+  for (current_frame = 0; ; ++current_frame) {
+    status = drachen_verify(filename, sizeof(filename), enc);
+    if (status == DRACHEN_END_OF_STREAM) {
+      status = 0;
+      break;
+    }
+
+    if (status) {
+      fprintf(stderr, "%s: error: frame %u: %s: %s\n", co_this,
+              current_frame, filename, drachen_get_error(enc));
+      goto finish;
+    }
+
+    l_report_extraf("%5d %s\n", current_frame, filename);
+  }
+
+  l_reportf("%u frames verified.\n", current_frame);
+  if (co_timing_statistics)
+    fprintf(stderr, "Verified in %u ms\n",
+            (unsigned)((clock()-start)*1000/CLOCKS_PER_SEC));
+
+  finish:
+  if (enc) {
+    drachen_free(enc);
+    infile = NULL;
+  }
+  if (infile) fclose(infile);
+  return status;
+}
@@ -62,6 +62,23 @@ static unsigned signed_stats(signed* minout,
   return (unsigned)(((signed int)max)-((signed int)min)) + 1;
 }
 
+/* Returns the narrower of the unsigned and signed ranges of data less pred */
+static unsigned residual_range(const unsigned char* data,
+                               const unsigned char* pred, unsigned len) {
+  unsigned char umin = 0xFF, umax = 0;
+  signed char smin = 127, smax = -128;
+  unsigned i;
+  for (i = 0; i < len; ++i) {
+    unsigned char ch = data[i] - pred[i];
+    if (ch < umin) umin = ch;
+    if (ch > umax) umax = ch;
+    if ((signed char)ch < smin) smin = ch;
+    if ((signed char)ch > smax) smax = ch;
+  }
+
+  return umax - umin < smax - smin? umax - umin + 1 : smax - smin + 1;
+}
+
 static inline unsigned ceildiv(unsigned dividend, unsigned divisor) {
   return (dividend+1)/divisor;
 }
@@ -69,6 +86,13 @@ static inline unsigned ceildiv(unsigned dividend, unsigned divisor) {
 typedef struct encoding_method {
   unsigned compression;
   int is_signed, sub_prev, sub_fixed;
+  /* With sub_prev, the PRED_* constant for what is subtracted, and for
+   * PRED_REF, the slot of the reference, or for PRED_DISPLACED, the
+   * displacement
+   */
+  int predictor;
+  unsigned ref;
+  int32_t disp;
   unsigned char fixed_sub;
 } encoding_method;
 
@@ -115,9 +139,87 @@ static unsigned rle_count_runs_max(unsigned* longest_run,
   return cnt;
 }
 
+/* The pack_extra argument of optimal_encoding_method() when packing may not
+ * be used
+ */
+#define NO_PACKING (~0u)
+
+/* Returns the number of bits needed for the values 0 to range-1 */
+static inline unsigned range_bits(unsigned range) {
+  unsigned bits = 0;
+  while ((1u << bits) < range)
+    ++bits;
+  return bits;
+}
+
+/* Returns the length of len bytes packed into the given number of bits */
+static inline unsigned packed_len(unsigned len, unsigned bits) {
+  return ((uint64_t)len*bits + 7)/8;
+}
+
+/* Returns whether meth packs its bytes (see DRACHEN_FEATURE_PACKED) */
+static inline int is_packed(const encoding_method* meth) {
+  return meth->compression >= EX_CMPPACK << EE_CMP_SHIFT;
+}
+
+/* Replaces *meth, whose body is expected to be *cost bytes long, with packing
+ * (see DRACHEN_FEATURE_PACKED) if that would be shorter. umin and uran are
+ * the unsigned minimum and range of the residuals, and smin and sran the
+ * signed ones; sub_prev says which residuals they are. pack_extra is the
+ * number of header bytes packing needs which *meth does not.
+ *
+ * Subtracting either minimum leaves values from 0 to the range less one;
+ * small signed values can instead be sign-extended without a fixed byte.
+ */
+static void consider_packing(encoding_method* meth, unsigned* cost,
+                             unsigned len, int sub_prev, unsigned pack_extra,
+                             unsigned umin, unsigned uran,
+                             signed smin, unsigned sran) {
+  signed smax = smin + (signed)sran - 1;
+  unsigned bits, sbits, plen;
+  int is_signed = 0;
+  unsigned char fixed_sub;
+
+  if (uran <= sran) {
+    bits = range_bits(uran);
+    fixed_sub = umin;
+  } else {
+    bits = range_bits(sran);
+    fixed_sub = smin;
+  }
+
+  sbits = 1 + range_bits(-smin > smax + 1? -smin : smax + 1);
+  if (fixed_sub && packed_len(len, sbits) < packed_len(len, bits) + 1) {
+    bits = sbits;
+    fixed_sub = 0;
+    is_signed = 1;
+  }
+
+  if (bits < 1 || bits > 7)
+    return;
+
+  plen = packed_len(len, bits);
+  if (plen + !!fixed_sub + pack_extra <
+      *cost + meth->sub_fixed + (is_packed(meth)? pack_extra : 0)) {
+    memset(meth, 0, sizeof(*meth));
+    meth->compression = (EX_CMPPACK + bits - 1) << EE_CMP_SHIFT;
+    meth->is_signed = is_signed;
+    meth->sub_prev = sub_prev;
+    meth->sub_fixed = !!fixed_sub;
+    meth->fixed_sub = fixed_sub;
+    *cost = plen;
+  }
+}
+
+/* Chooses the method for encoding len bytes of data predicted bytewise from
+ * prev, and sets *cost to the expected length of the body. Packing is
+ * weighed too unless pack_extra is NO_PACKING.
+ */
 static encoding_method optimal_encoding_method(const unsigned char* data,
                                                const unsigned char* prev,
-                                               unsigned len) {
+                                               unsigned len,
+                                               unsigned* cost,
+                                               unsigned pack_extra) {
   unsigned char zero[len], test[len];
   const unsigned char* test_data;
   /* Stats for min/med/max with zero and prev subtracted, unsigned and
@@ -156,6 +258,7 @@ static encoding_method optimal_encoding_method(const unsigned char* data,
       assert(0);
     }
 
+    *cost = 0;
     return meth;
   }
 
@@ -209,6 +312,14 @@ static encoding_method optimal_encoding_method(const unsigned char* data,
       expected_len = other_len;
     }
 
+    if (pack_extra != NO_PACKING) {
+      consider_packing(&meth, &expected_len, len, 0, pack_extra,
+                       uminz, uranz, sminz, sranz);
+      consider_packing(&meth, &expected_len, len, 1, pack_extra,
+                       uminp, uranp, sminp, sranp);
+    }
+
+    *cost = expected_len;
     return meth;
   }
 
@@ -281,6 +392,14 @@ static encoding_method optimal_encoding_method(const unsigned char* data,
     if (meth.compression == EE_CMPR48 || meth.compression == EE_CMPR88)
       meth.sub_fixed = 0;
 
+    if (pack_extra != NO_PACKING) {
+      consider_packing(&meth, &expected_len, len, 0, pack_extra,
+                       uminz, uranz, sminz, sranz);
+      consider_packing(&meth, &expected_len, len, 1, pack_extra,
+                       uminp, uranp, sminp, sranp);
+    }
+
+    *cost = expected_len;
     return meth;
   }
 
@@ -343,6 +462,210 @@ static encoding_method optimal_encoding_method(const unsigned char* data,
   if (meth.compression == EE_CMPR88)
     meth.sub_fixed = 0;
 
+  if (pack_extra != NO_PACKING) {
+    consider_packing(&meth, &expected_len, len, 0, pack_extra,
+                     uminz, uranz, sminz, sranz);
+    consider_packing(&meth, &expected_len, len, 1, pack_extra,
+                     uminp, uranp, sminp, sranp);
+  }
+
+  *cost = expected_len;
+  return meth;
+}
+
+/* Displacements of up to this many bytes, and of up to this many rows, are
+ * always tried by search_displacement()
+ */
+#define DISP_BYTES 4
+#define DISP_ROWS 4
+
+/* Finds the displacement (see PRED_DISPLACED) of the previous frame which best
+ * matches the len bytes at data, at the given offset, whose counterparts in
+ * the previous frame are at prev. Only a few candidates are tried: small
+ * displacements, displacements by whole rows, and the winner for the previous
+ * block and its neighbours, each judged by the sum of absolute differences.
+ * Returns the best displacement, or 0 if none beats the previous frame
+ * itself.
+ */
+static int32_t search_displacement(const unsigned char* data,
+                                   const unsigned char* prev,
+                                   uint32_t offset, unsigned len,
+                                   drachen_encoder* enc) {
+  int64_t cand[3 + 2*DISP_BYTES + 2*DISP_ROWS], d;
+  const int64_t row = enc->params.row_stride;
+  uint32_t sad, best_sad = drachen_sad(data, prev, len);
+  int32_t best = 0;
+  unsigned n = 0, i;
+
+  if (!best_sad)
+    return 0;
+
+  if (enc->last_disp) {
+    cand[n++] = enc->last_disp;
+    cand[n++] = (int64_t)enc->last_disp - 1;
+    cand[n++] = (int64_t)enc->last_disp + 1;
+  }
+  for (i = 1; i <= DISP_BYTES; ++i) {
+    cand[n++] = i;
+    cand[n++] = -(int64_t)i;
+  }
+  for (i = 1; row && i <= DISP_ROWS; ++i) {
+    cand[n++] = i*row;
+    cand[n++] = -(int64_t)i*row;
+  }
+
+  for (i = 0; i < n; ++i) {
+    d = cand[i];
+    /* Only displacements from entirely within the frame are considered */
+    if (!d || d < INT32_MIN || d > INT32_MAX ||
+        (int64_t)offset + d < 0 ||
+        (int64_t)offset + d + len > enc->frame_size)
+      continue;
+
+    sad = drachen_sad(data, prev + d, len);
+    if (sad < best_sad) {
+      best_sad = sad;
+      best = d;
+    }
+  }
+
+  if (best)
+    enc->last_disp = best;
+  return best;
+}
+
+/* Chooses the method for encoding the len bytes at data, at the given offset
+ * within the frame, predicted from prev and prev2.
+ */
+static encoding_method choose_encoding_method(const unsigned char* data,
+                                              const unsigned char* prev,
+                                              const unsigned char* prev2,
+                                              uint32_t offset, unsigned len,
+                                              drachen_encoder* enc) {
+  static const int predictors[] = {
+    PRED_PREV16, PRED_PREV32, PRED_LINEAR, PRED_LINEAR16, PRED_LINEAR32,
+  };
+  static const int spatial[] = { PRED_LEFT, PRED_UP };
+  unsigned char pred[len];
+  encoding_method meth, pmeth;
+  unsigned cost, pcost, pack, p, i, s;
+  unsigned range, prev_range = 0, linear_range = 0;
+  uint32_t dist, skip;
+  int32_t d;
+
+  /* Packing needs the mode byte, which the other predictors need anyway */
+  pack = (enc->params.features & DRACHEN_FEATURE_PACKED)? 0 : NO_PACKING;
+
+  meth = optimal_encoding_method(data, prev, len, &cost,
+                                 pack == NO_PACKING? NO_PACKING : 1);
+  if (is_packed(&meth))
+    ++cost;
+  if (meth.sub_prev)
+    meth.predictor = PRED_PREV;
+  if (meth.compression == EE_CMPZER && !meth.sub_fixed)
+    return meth;
+
+  /* Try the other predictors. To optimal_encoding_method(), each looks like
+   * predicting bytes from whatever would make the byte differences come out
+   * as the residuals.
+   *
+   * Words only differ from bytes where a carry crosses between bytes, and
+   * only do better when that narrows the residuals, so they are weighed only
+   * for the blocks where it does.
+   */
+  if (has_predictor(enc, PRED_PREV16))
+    prev_range = residual_range(data, prev, len);
+  for (p = 0; p < sizeof(predictors)/sizeof(predictors[0]); ++p) {
+    if (!has_predictor(enc, predictors[p]))
+      continue;
+
+    memcpy(pred, data, len);
+    drachen_sub_prediction(pred, predictors[p], prev, prev2, offset, len);
+    for (i = 0; i < len; ++i)
+      pred[i] = data[i] - pred[i];
+
+    range = residual_range(data, pred, len);
+    if (predictors[p] == PRED_LINEAR)
+      linear_range = range;
+    else if (range >= (predictors[p] == PRED_PREV16 ||
+                       predictors[p] == PRED_PREV32?
+                       prev_range : linear_range))
+      continue;
+
+    pmeth = optimal_encoding_method(data, pred, len, &pcost, pack);
+    /* This also needs the mode byte */
+    if (pmeth.sub_prev &&
+        pcost + pmeth.sub_fixed + 1 < cost + meth.sub_fixed) {
+      meth = pmeth;
+      meth.predictor = predictors[p];
+      cost = pcost + 1;
+    }
+  }
+
+  /* And each reference which holds a frame, which also needs the slot
+   * byte
+   */
+  for (s = 0; s < enc->params.num_references; ++s) {
+    if (!(enc->ref_valid & (1u << s)) || !has_predictor(enc, PRED_REF))
+      continue;
+
+    pmeth = optimal_encoding_method(data, enc->refs[s] + offset, len,
+                                    &pcost, pack);
+    if (pmeth.sub_prev &&
+        pcost + pmeth.sub_fixed + 2 < cost + meth.sub_fixed) {
+      meth = pmeth;
+      meth.predictor = PRED_REF;
+      meth.ref = s;
+      cost = pcost + 2;
+    }
+  }
+
+  /* And the background model, which needs only the mode byte */
+  if (has_predictor(enc, PRED_BACKGROUND)) {
+    pmeth = optimal_encoding_method(data, enc->background_frame + offset, len,
+                                    &pcost, pack);
+    if (pmeth.sub_prev &&
+        pcost + pmeth.sub_fixed + 1 < cost + meth.sub_fixed) {
+      meth = pmeth;
+      meth.predictor = PRED_BACKGROUND;
+      cost = pcost + 1;
+    }
+  }
+
+  /* And the previous frame displaced, which also needs the displacement */
+  if (has_predictor(enc, PRED_DISPLACED) &&
+      (d = search_displacement(data, prev, offset, len, enc))) {
+    pmeth = optimal_encoding_method(data, prev + d, len, &pcost, pack);
+    if (pmeth.sub_prev &&
+        pcost + pmeth.sub_fixed + 5 < cost + meth.sub_fixed) {
+      meth = pmeth;
+      meth.predictor = PRED_DISPLACED;
+      meth.disp = d;
+      cost = pcost + 5;
+    }
+  }
+
+  /* And the bytes before within the same frame, which the decoder will
+   * already have when it gets here
+   */
+  for (p = 0; p < sizeof(spatial)/sizeof(spatial[0]); ++p) {
+    if (!has_predictor(enc, spatial[p]))
+      continue;
+
+    dist = spatial_dist(enc, spatial[p]);
+    skip = offset < dist? (dist - offset < len? dist - offset : len) : 0;
+    memset(pred, 0, skip);
+    memcpy(pred + skip, data + skip - dist, len - skip);
+
+    pmeth = optimal_encoding_method(data, pred, len, &pcost, pack);
+    if (pmeth.sub_prev &&
+        pcost + pmeth.sub_fixed + 1 < cost + meth.sub_fixed) {
+      meth = pmeth;
+      meth.predictor = spatial[p];
+      cost = pcost + 1;
+    }
+  }
+
   return meth;
 }
 
@@ -577,51 +900,267 @@ static int (*const compressors[8])(FILE*, const unsigned char*, uint32_t) = {
   NULL,
 };
 
-static int encode_one_element(FILE* out,
-                              encoding_method meth,
-                              const unsigned char* data,
-                              const unsigned char* prev,
-                              uint32_t len,
-                              drachen_encoder* enc) {
+/* Values packed by compressor_packed() per write */
+#define PACK_CHUNK 512
+
+/* Packs the n bytes at data into bits bits each at out, eight at a time:
+ * each group of eight is gathered into one 64-bit word, of which the low
+ * bits bytes are written. A last group of fewer than eight is padded with
+ * zero bits to a whole group.
+ */
+static inline void pack_bits(unsigned char* out, const unsigned char* data,
+                             unsigned n, unsigned bits) {
+  const unsigned mask = (1u << bits) - 1;
+  uint64_t v;
+  unsigned i, j;
+
+  for (i = 0; i < n; i += 8, out += bits) {
+    v = 0;
+    for (j = 0; j < 8; ++j)
+      v |= (uint64_t)(i + j < n? data[i + j] & mask : 0) << j*bits;
+    for (j = 0; j < bits; ++j)
+      out[j] = v >> 8*j;
+  }
+}
+
+static int compressor_packed(FILE* out, const unsigned char* data,
+                             uint32_t len, unsigned bits) {
+  unsigned char buf[PACK_CHUNK*7/8];
+  uint32_t n;
+
+  while (len) {
+    n = len < PACK_CHUNK? len : PACK_CHUNK;
+
+    /* With constant widths, the loops of pack_bits() unroll completely */
+    switch (bits) {
+    case 1: pack_bits(buf, data, n, 1); break;
+    case 2: pack_bits(buf, data, n, 2); break;
+    case 3: pack_bits(buf, data, n, 3); break;
+    case 4: pack_bits(buf, data, n, 4); break;
+    case 5: pack_bits(buf, data, n, 5); break;
+    case 6: pack_bits(buf, data, n, 6); break;
+    case 7: pack_bits(buf, data, n, 7); break;
+    }
+
+    if (!fwrite(buf, packed_len(n, bits), 1, out))
+      return errno;
+
+    data += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+/* Writes the usual header of a segment coded with meth */
+static int write_element_header(FILE* out, const encoding_method* meth,
+                                uint32_t len) {
   unsigned char len8;
   uint16_t len16;
-  const unsigned char* data_to_encode;
-  unsigned i;
-  int status;
+  /* A byte holds lengths up to 257, and a short only those from 259, so 258
+   * needs an int
+   */
   unsigned char head =
     (len == 1? EE_LENONE :
-     len <= 258? EE_LENBYT :
-     len <= (65535+259)? EE_LENSRT :
+     len <= 257? EE_LENBYT :
+     len != 258 && len <= (65535+259)? EE_LENSRT :
      EE_LENINT) |
-    meth.compression |
-    (meth.is_signed? EE_RLESEX : 0) |
-    (meth.sub_fixed? EE_ININCR : 0) |
-    (meth.sub_prev ? EE_PRVADD : 0);
+    (meth->sub_fixed? EE_ININCR : 0);
+  int extended = (meth->sub_prev && meth->predictor != PRED_PREV) ||
+    is_packed(meth);
+  unsigned char mode;
+
+  if (extended) {
+    head |= EE_EXTEND | (meth->is_signed? EE_EXTSEX : 0);
+    mode = (meth->compression >> EE_CMP_SHIFT) |
+      meth->predictor << EX_PRED_SHIFT;
+  } else {
+    head |= meth->compression |
+      (meth->is_signed? EE_RLESEX : 0) |
+      (meth->sub_prev ? EE_PRVADD : 0);
+  }
 
   /* Write header */
   if (EOF == fputc(head, out))
     return errno;
 
   /* Write length, if needed */
-  if (len > 1) {
-    if (len <= 258) {
-      len8 = (unsigned char)(len-2);
-      if (!fwrite(&len8, 1, 1, out))
-        return errno;
-    } else if (len <= (65535+259)) {
-      len16 = (uint16_t)(len-259);
-      if (!fwrite(&len16, 2, 1, out))
-        return errno;
-    } else {
-      if (!fwrite(&len, 4, 1, out))
-        return errno;
-    }
+  switch (head & EE_LENENC) {
+  case EE_LENBYT:
+    len8 = (unsigned char)(len-2);
+    if (!fwrite(&len8, 1, 1, out))
+      return errno;
+    break;
+
+  case EE_LENSRT:
+    len16 = (uint16_t)(len-259);
+    if (!fwrite(&len16, 2, 1, out))
+      return errno;
+    break;
+
+  case EE_LENINT:
+    if (!fwrite(&len, 4, 1, out))
+      return errno;
+    break;
   }
 
+  /* Write mode byte, if extended, and any reference slot or displacement */
+  if (extended && EOF == fputc(mode, out))
+    return errno;
+  if (extended && meth->predictor == PRED_REF &&
+      EOF == fputc(meth->ref, out))
+    return errno;
+  if (extended && meth->predictor == PRED_DISPLACED &&
+      !fwrite(&meth->disp, 4, 1, out))
+    return errno;
+
   /* Write offset byte, if used */
-  if (meth.sub_fixed && !fwrite(&meth.fixed_sub, 1, 1, out))
+  if (meth->sub_fixed && !fwrite(&meth->fixed_sub, 1, 1, out))
     return errno;
 
+  return 0;
+}
+
+/* Writes a varint: seven bits at a time, least significant first, with the
+ * top bit of each byte set if more follow.
+ */
+static int write_varint(FILE* out, uint32_t value) {
+  while (value >= 0x80) {
+    if (EOF == fputc((value & 0x7F) | 0x80, out))
+      return errno;
+    value >>= 7;
+  }
+
+  return EOF == fputc(value, out)? errno : 0;
+}
+
+static inline int same_mode(const struct segment_mode* a,
+                            const struct segment_mode* b) {
+  return a->cmptyp == b->cmptyp && a->rlesex == b->rlesex &&
+    a->inincr == b->inincr &&
+    a->predictor == b->predictor && a->ref == b->ref && a->disp == b->disp;
+}
+
+/* Writes the compact header (see CH_MODE) of a segment coded with meth,
+ * keeping the dictionary of modes up to date.
+ */
+static int write_compact_header(FILE* out, const encoding_method* meth,
+                                uint32_t offset, uint32_t len,
+                                drachen_encoder* enc) {
+  struct segment_mode mode;
+  unsigned k, code;
+  int status;
+
+  /* The dictionary starts afresh with each frame */
+  if (!offset)
+    reset_modes(enc);
+
+  memset(&mode, 0, sizeof(mode));
+  mode.cmptyp = meth->compression >> EE_CMP_SHIFT;
+  /* Only some compressions care about sign extension; leaving it clear for
+   * the others lets more segments share modes.
+   */
+  if (is_packed(meth) || (mode.cmptyp >= (EE_CMPR44 >> EE_CMP_SHIFT) &&
+                          mode.cmptyp != (EE_CMPZER >> EE_CMP_SHIFT)))
+    mode.rlesex = !!meth->is_signed;
+  mode.inincr = !!meth->sub_fixed;
+  if (meth->sub_prev) {
+    mode.predictor = meth->predictor;
+    if (meth->predictor == PRED_REF)
+      mode.ref = meth->ref;
+    if (meth->predictor == PRED_DISPLACED)
+      mode.disp = meth->disp;
+  }
+
+  for (k = 0; k < COMPACT_MODES; ++k)
+    if (same_mode(&mode, enc->modes + k))
+      break;
+
+  code = offset + len == enc->frame_size? CH_LENREST :
+    len - 1 <= CH_LENMAX? len - 1 : CH_LENVAR;
+
+  if (EOF == fputc((k < COMPACT_MODES? k : CH_NEWMODE) |
+                   code << CH_LEN_SHIFT, out))
+    return errno;
+  if (code == CH_LENVAR) {
+    status = write_varint(out, len - (CH_LENMAX + 2));
+    if (status)
+      return status;
+  }
+
+  if (k < COMPACT_MODES) {
+    use_mode(enc, k);
+  } else {
+    add_mode(enc, &mode);
+    if (EOF == fputc(mode.cmptyp | mode.predictor << EX_PRED_SHIFT, out) ||
+        EOF == fputc((mode.rlesex? CM_SEX : 0) | (mode.inincr? CM_INCR : 0),
+                     out))
+      return errno;
+    if (mode.predictor == PRED_REF && EOF == fputc(mode.ref, out))
+      return errno;
+    if (mode.predictor == PRED_DISPLACED && !fwrite(&mode.disp, 4, 1, out))
+      return errno;
+  }
+
+  if (mode.inincr && EOF == fputc(meth->fixed_sub, out))
+    return errno;
+
+  return 0;
+}
+
+/* Stores at dst what the compressor of meth is given for the len bytes at
+ * data, at the given offset, predicted from prev and prev2.
+ */
+static void residuals(unsigned char* dst, const encoding_method* meth,
+                      const unsigned char* data,
+                      const unsigned char* prev,
+                      const unsigned char* prev2,
+                      uint32_t offset, uint32_t len,
+                      const drachen_encoder* enc) {
+  uint32_t i;
+
+  /* The prediction is subtracted before the offset, since it is added back
+   * after it.
+   */
+  memcpy(dst, data, len);
+  if (meth->sub_prev && (meth->predictor == PRED_LEFT ||
+                         meth->predictor == PRED_UP))
+    drachen_sub_spatial(dst, data - offset, offset, len,
+                        spatial_dist(enc, meth->predictor));
+  else if (meth->sub_prev && meth->predictor == PRED_DISPLACED)
+    drachen_sub_displaced(dst, prev - offset, enc->frame_size,
+                          offset, len, meth->disp);
+  else if (meth->sub_prev)
+    drachen_sub_prediction(dst, meth->predictor,
+                           meth->predictor == PRED_REF?
+                           enc->refs[meth->ref] + offset :
+                           meth->predictor == PRED_BACKGROUND?
+                           enc->background_frame + offset : prev,
+                           prev2, offset, len);
+
+  if (meth->sub_fixed)
+    for (i = 0; i < len; ++i)
+      dst[i] -= meth->fixed_sub;
+}
+
+static int encode_one_element(FILE* out,
+                              encoding_method meth,
+                              const unsigned char* data,
+                              const unsigned char* prev,
+                              const unsigned char* prev2,
+                              uint32_t offset,
+                              uint32_t len,
+                              drachen_encoder* enc) {
+  const unsigned char* data_to_encode;
+  int status;
+
+  if (enc->params.features & DRACHEN_FEATURE_COMPACT_SEGMENTS)
+    status = write_compact_header(out, &meth, offset, len, enc);
+  else
+    status = write_element_header(out, &meth, len);
+  if (status)
+    return status;
+
   /* Write the body, if any.
    * (EE_CMPZER never has a body).
    */
@@ -637,15 +1176,7 @@ static int encode_one_element(FILE* out,
         enc->tmp_data_len = len;
       }
 
-      memcpy(enc->tmp_data, data, len);
-      if (meth.sub_fixed)
-        for (i = 0; i < len; ++i)
-          enc->tmp_data[i] -= meth.fixed_sub;
-
-      if (meth.sub_prev)
-        for (i = 0; i < len; ++i)
-          enc->tmp_data[i] -= prev[i];
-
+      residuals(enc->tmp_data, &meth, data, prev, prev2, offset, len, enc);
       data_to_encode = enc->tmp_data;
     } else {
       /* Use the raw input data */
@@ -653,9 +1184,14 @@ static int encode_one_element(FILE* out,
     }
 
     /* Compress the body */
-    status = (*compressors[meth.compression >> EE_CMP_SHIFT])(out,
-                                                              data_to_encode,
-                                                              len);
+    if (is_packed(&meth))
+      status = compressor_packed(out, data_to_encode, len,
+                                 packed_width(meth.compression >>
+                                              EE_CMP_SHIFT));
+    else
+      status = (*compressors[meth.compression >> EE_CMP_SHIFT])(out,
+                                                                data_to_encode,
+                                                                len);
     /* Fail if the compressor failed. */
     if (status)
       return status;
@@ -664,39 +1200,272 @@ static int encode_one_element(FILE* out,
   return 0;
 }
 
-int drachen_encode(drachen_encoder* enc,
-                   const unsigned char* buffer,
-                   const char* name) {
-  uint32_t start_of_curr, offset, i, bs;
+/* Returns the given offset into prev2_frame, or NULL if there is none. */
+static inline const unsigned char* prev2_at(const drachen_encoder* enc,
+                                            uint32_t offset) {
+  return enc->prev2_frame? enc->prev2_frame + offset : NULL;
+}
+
+/* Returns the length of the block at the given offset, advancing *spec past
+ * the block size specs it finishes.
+ */
+static uint32_t block_len(const drachen_block_spec** spec, uint32_t offset,
+                          const drachen_encoder* enc) {
+  /* This is either the block size for the current segment, or whatever's
+   * left in that segment.
+   */
+  uint32_t bs = (*spec)->block_size;
+  if (offset + bs >= (*spec)->segment_end) {
+    bs = (*spec)->segment_end - offset;
+    ++*spec;
+  }
+  /* Check for going off the end of the frame */
+  if (offset + bs > enc->frame_size)
+    bs = enc->frame_size - offset;
+
+  return bs;
+}
+
+/* A body length, in bits, which no segment can have */
+#define INFEASIBLE (~(uint64_t)0)
+
+/* Returns the length in bits of the body meth gives the len residuals at
+ * res, or INFEASIBLE if they do not fit its compression. Both the fit and
+ * the runs are found in the same pass.
+ */
+static uint64_t body_bits(const encoding_method* meth,
+                          const unsigned char* res, uint32_t len) {
+  unsigned cmptyp = meth->compression >> EE_CMP_SHIFT;
+  unsigned bits, maxrun, runlen = 0, runs = 0, bias;
+  unsigned char run = 0;
+  uint32_t i;
+
+  switch (meth->compression) {
+  case EE_CMPR88: bits = 8; maxrun = 256; break;
+  case EE_CMPR48: bits = 8; maxrun = 16;  break;
+  case EE_CMPR28: bits = 8; maxrun = 4;   break;
+  case EE_CMPR44: bits = 4; maxrun = 16;  break;
+  case EE_CMPR26: bits = 6; maxrun = 4;   break;
+  case EE_CMPHLF: bits = 4; maxrun = 0;   break;
+  case EE_CMPZER: bits = 0; maxrun = 0;   break;
+  case EE_CMPNON: return (uint64_t)len*8;
+  default:
+    bits = packed_width(cmptyp);
+    maxrun = 0;
+    break;
+  }
+
+  /* Sign-extended values are biased into the unsigned range of the same
+   * number of bits
+   */
+  bias = meth->is_signed? (1u << bits) >> 1 : 0;
+  for (i = 0; i < len; ++i) {
+    if (bits < 8 && (((res[i] + bias) & 0xFF) >> bits))
+      return INFEASIBLE;
+
+    if (runlen && res[i] == run && runlen < maxrun) {
+      ++runlen;
+    } else {
+      ++runs;
+      run = res[i];
+      runlen = 1;
+    }
+  }
+
+  switch (meth->compression) {
+  case EE_CMPR88: return (uint64_t)runs*16;
+  case EE_CMPR48: return (uint64_t)runs*12;
+  case EE_CMPR28: return (uint64_t)runs*10;
+  case EE_CMPR44:
+  case EE_CMPR26: return (uint64_t)runs*8;
+  default:        return (uint64_t)len*bits;
+  }
+}
+
+/* Returns the expected length in bytes of the header of a segment coded with
+ * meth, assuming a one-byte length
+ */
+static unsigned header_cost(const encoding_method* meth,
+                            const drachen_encoder* enc) {
+  unsigned cost = 2 + !!meth->sub_fixed;
+  int extended = (meth->sub_prev && meth->predictor != PRED_PREV) ||
+    is_packed(meth);
+
+  /* Compact headers are one byte, but a mode not used recently needs two
+   * more, and anything its predictor needs.
+   */
+  if (extended)
+    cost += (enc->params.features & DRACHEN_FEATURE_COMPACT_SEGMENTS)? 0 : 1;
+  if (extended && meth->predictor == PRED_REF)
+    cost += 1;
+  if (extended && meth->predictor == PRED_DISPLACED)
+    cost += 4;
+
+  return cost;
+}
+
+/* The number of partial segmentations optimal_segmentation() keeps */
+#define SEGMENTATION_BEAM 8
+
+/* Chooses where the segments of curr_frame begin, and the method of each,
+ * for encode_frame_body(). Every block is first given its own best method,
+ * then a shortest-path search over the blocks weighs continuing each
+ * segment so far into the block (with its body costing whatever the block
+ * costs with that method, if it can be coded with it at all) against
+ * starting a new segment with the block's own method (adding the cost of a
+ * header). Only the SEGMENTATION_BEAM cheapest segmentations so far with
+ * distinct methods for their last segment are kept.
+ *
+ * On return, block_offset[0..*num_blocks] are the offsets of the blocks, and
+ * for each block which begins a segment, block_meths holds its method and
+ * block_end the index of the block after the segment.
+ */
+static int optimal_segmentation(uint32_t* num_blocks, drachen_encoder* enc) {
+  struct {
+    uint32_t start;
+    uint64_t cost;
+  } live[SEGMENTATION_BEAM], next[SEGMENTATION_BEAM + 1], cand;
+  const drachen_block_spec* block_size = enc->block_size;
+  unsigned num_live = 0, num_next, k, j;
+  uint32_t n = 0, b, offset, len, cap;
+  uint64_t best, bits;
+  void* p;
+
+  /* The blocks, and the best method for each alone */
+  for (offset = 0; offset < enc->frame_size; offset += len, ++n) {
+    if (n + 1 >= enc->blocks_cap) {
+      cap = enc->blocks_cap? enc->blocks_cap*2 : 256;
+      if (!(p = realloc(enc->block_meths, cap*sizeof(encoding_method))))
+        return ENOMEM;
+      enc->block_meths = p;
+      if (!(p = realloc(enc->block_offset, cap*sizeof(uint32_t))))
+        return ENOMEM;
+      enc->block_offset = p;
+      if (!(p = realloc(enc->block_end, cap*sizeof(uint32_t))))
+        return ENOMEM;
+      enc->block_end = p;
+      enc->blocks_cap = cap;
+    }
+
+    len = block_len(&block_size, offset, enc);
+    enc->block_offset[n] = offset;
+    enc->block_meths[n] = choose_encoding_method(enc->curr_frame+offset,
+                                                 enc->prev_frame+offset,
+                                                 prev2_at(enc, offset),
+                                                 offset, len, enc);
+  }
+  enc->block_offset[n] = enc->frame_size;
+  *num_blocks = n;
+
+  for (b = 0; b < n; ++b) {
+    offset = enc->block_offset[b];
+    len = enc->block_offset[b+1] - offset;
+    {
+      unsigned char res[len];
+
+      /* Start a new segment after the cheapest segmentation so far */
+      best = 0;
+      for (k = 0; k < num_live; ++k)
+        if (!k || live[k].cost < best)
+          best = live[k].cost;
+
+      residuals(res, enc->block_meths + b, enc->curr_frame+offset,
+                enc->prev_frame+offset, prev2_at(enc, offset),
+                offset, len, enc);
+      next[0].start = b;
+      next[0].cost = best + 8*header_cost(enc->block_meths + b, enc) +
+        body_bits(enc->block_meths + b, res, len);
+      num_next = 1;
+
+      /* Or continue each segment so far */
+      for (k = 0; k < num_live; ++k) {
+        cand = live[k];
+        for (j = 0; j < num_next; ++j)
+          if (!memcmp(enc->block_meths + cand.start,
+                      enc->block_meths + next[j].start,
+                      sizeof(encoding_method)))
+            break;
+        if (j < num_next && next[j].cost <= cand.cost)
+          continue;
+
+        residuals(res, enc->block_meths + cand.start, enc->curr_frame+offset,
+                  enc->prev_frame+offset, prev2_at(enc, offset),
+                  offset, len, enc);
+        bits = body_bits(enc->block_meths + cand.start, res, len);
+        if (bits == INFEASIBLE)
+          continue;
+        cand.cost += bits;
+
+        if (j < num_next) {
+          if (cand.cost < next[j].cost)
+            next[j] = cand;
+        } else {
+          next[num_next++] = cand;
+        }
+      }
+    }
+
+    /* Keep the cheapest first, recording where the last segment of the
+     * cheapest starts
+     */
+    for (k = 1; k < num_next; ++k)
+      for (j = k; j > 0 && next[j].cost < next[j-1].cost; --j) {
+        cand = next[j];
+        next[j] = next[j-1];
+        next[j-1] = cand;
+      }
+    num_live = num_next < SEGMENTATION_BEAM? num_next : SEGMENTATION_BEAM;
+    memcpy(live, next, num_live*sizeof(live[0]));
+    enc->block_end[b] = live[0].start;
+  }
+
+  /* Follow the cheapest segmentation back from the last block. block_end[b]
+   * is overwritten only once it has been read.
+   */
+  for (b = n; b > 0; b = k) {
+    k = enc->block_end[b-1];
+    enc->block_end[k] = b;
+  }
+
+  return 0;
+}
+
+/* Encodes the segments of curr_frame, predicting from prev_frame (and
+ * prev2_frame).
+ * Sets and returns the error field.
+ */
+static int encode_frame_body(drachen_encoder* enc) {
+  uint32_t start_of_curr, offset, bs, b, e, n;
   const drachen_block_spec* block_size = enc->block_size;
   encoding_method currmeth, nextmeth;
-  unsigned char* swap;
 
-  if (!fwrite(name, strlen(name)+1, 1, enc->file))
-    return enc->error = errno;
+  if (enc->optimal_segments) {
+    if ((enc->error = optimal_segmentation(&n, enc)))
+      return enc->error;
 
-  /* Transform the input frame according to the transformation matrix. */
-  for (i = 0; i < enc->frame_size; ++i)
-    enc->curr_frame[i] = buffer[enc->xform[i]];
+    for (b = 0; b < n && !enc->error; b = e) {
+      e = enc->block_end[b];
+      offset = enc->block_offset[b];
+      enc->error = encode_one_element(enc->file,
+                                      enc->block_meths[b],
+                                      enc->curr_frame+offset,
+                                      enc->prev_frame+offset,
+                                      prev2_at(enc, offset),
+                                      offset,
+                                      enc->block_offset[e] - offset,
+                                      enc);
+    }
+
+    return enc->error;
+  }
 
   start_of_curr = 0;
   for (offset = 0; offset < enc->frame_size; offset += bs) {
-    /* Determine the current block size.
-     * This is either the block size for the current segment, or whatever's
-     * left in that segment.
-     */
-    bs = block_size->block_size;
-    if (offset + bs >= block_size->segment_end) {
-      bs = block_size->segment_end - offset;
-      ++block_size;
-    }
-    /* Check for going off the end of the frame */
-    if (offset + bs > enc->frame_size)
-      bs = enc->frame_size - offset;
-
-    nextmeth = optimal_encoding_method(enc->curr_frame+offset,
-                                       enc->prev_frame+offset,
-                                       bs);
+    bs = block_len(&block_size, offset, enc);
+    nextmeth = choose_encoding_method(enc->curr_frame+offset,
+                                      enc->prev_frame+offset,
+                                      prev2_at(enc, offset),
+                                      offset, bs, enc);
     if (offset == 0)
       /* First segment */
       currmeth = nextmeth;
@@ -706,6 +1475,8 @@ int drachen_encode(drachen_encoder* enc,
                                       currmeth,
                                       enc->curr_frame+start_of_curr,
                                       enc->prev_frame+start_of_curr,
+                                      prev2_at(enc, start_of_curr),
+                                      start_of_curr,
                                       offset - start_of_curr,
                                       enc);
       if (enc->error)
@@ -717,17 +1488,425 @@ int drachen_encode(drachen_encoder* enc,
   }
 
   /* Finish the last segment */
-  enc->error = encode_one_element(enc->file,
-                                  currmeth,
-                                  enc->curr_frame+start_of_curr,
-                                  enc->prev_frame+start_of_curr,
-                                  enc->frame_size - start_of_curr,
-                                  enc);
+  return enc->error = encode_one_element(enc->file,
+                                         currmeth,
+                                         enc->curr_frame+start_of_curr,
+                                         enc->prev_frame+start_of_curr,
+                                         prev2_at(enc, start_of_curr),
+                                         start_of_curr,
+                                         enc->frame_size - start_of_curr,
+                                         enc);
+}
+
+/* Encodes the segments of curr_frame as encode_frame_body() does, but
+ * preceded by a BODY_* byte, rANS-coding them if that makes them smaller
+ * (see DRACHEN_FEATURE_ENTROPY).
+ * Sets and returns the error field.
+ */
+static int encode_coded_frame_body(drachen_encoder* enc) {
+  FILE* out = enc->file;
+  const unsigned char* body;
+  uint32_t len, coded_len = 0;
+  off_t end;
+
+  if (!enc->body_file) {
+#ifdef HAVE_OPEN_MEMSTREAM
+    enc->body_file = open_memstream(&enc->body_mem, &enc->body_mem_size);
+#else
+    enc->body_file = tmpfile();
+#endif
+    if (!enc->body_file)
+      return enc->error = errno;
+  }
+
+  /* The segments are written to the body file as usual */
+  if (fseeko(enc->body_file, 0, SEEK_SET))
+    return enc->error = errno;
+  enc->file = enc->body_file;
+  encode_frame_body(enc);
+  enc->file = out;
+  if (enc->error)
+    return enc->error;
+
+  if (fflush(enc->body_file) || (end = ftello(enc->body_file)) < 0)
+    return enc->error = errno;
+  if ((uint64_t)end > 0xFFFFFFFFu)
+    return enc->error = EFBIG;
+  len = end;
+
+#ifdef HAVE_OPEN_MEMSTREAM
+  body = (const unsigned char*)enc->body_mem;
+#else
+  if ((enc->error = drachen_reserve(&enc->body, &enc->body_size, len)))
+    return enc->error;
+  if (fseeko(enc->body_file, 0, SEEK_SET) ||
+      (len && !fread(enc->body, len, 1, enc->body_file)))
+    return enc->error = errno;
+  body = enc->body;
+#endif
+
+  /* Coding only pays if it saves more than the two lengths */
+  if (len > 8) {
+    if ((enc->error = drachen_reserve(&enc->coded, &enc->coded_size,
+                                      len - 9)))
+      return enc->error;
+    coded_len = drachen_rans_encode(enc->coded, len - 9, body, len);
+  }
+
+  if (coded_len) {
+    if (EOF == fputc(BODY_RANS, out) ||
+        !fwrite(&len, 4, 1, out) || !fwrite(&coded_len, 4, 1, out) ||
+        !fwrite(enc->coded, coded_len, 1, out))
+      return enc->error = errno;
+  } else {
+    if (EOF == fputc(BODY_PLAIN, out) ||
+        (len && !fwrite(body, len, 1, out)))
+      return enc->error = errno;
+  }
+
+  return 0;
+}
+
+/* The largest stride considered by drachen_write_packed_xform() */
+#define MAX_XFORM_STRIDE 16
+
+/* Returns the difference between index i of xform and its prediction from
+ * the index stride elements before.
+ */
+static inline uint32_t xform_delta(const uint32_t* xform, uint32_t i,
+                                   uint32_t stride) {
+  return xform[i] - (i >= stride? xform[i-stride] : i - stride);
+}
+
+int drachen_write_packed_xform(drachen_encoder* enc, const uint32_t* xform) {
+  uint32_t i, stride, best_stride = 1, changes, best_changes = 0xFFFFFFFFu;
+  unsigned plane;
+
+  /* Each index is stored as its difference from the index stride elements
+   * before, choosing the stride which gives the fewest changes between
+   * successive differences. For an image with n components, this is usually
+   * n, in which case nearly every difference is 1.
+   */
+  for (stride = 1; stride <= MAX_XFORM_STRIDE; ++stride) {
+    changes = 0;
+    for (i = 1; i < enc->frame_size && changes < best_changes; ++i)
+      changes += xform_delta(xform, i, stride) !=
+                 xform_delta(xform, i-1, stride);
+
+    if (changes < best_changes) {
+      best_changes = changes;
+      best_stride = stride;
+    }
+  }
+
+  if (!fwrite(&best_stride, 4, 1, enc->file))
+    return enc->error = errno;
+
+  /* The differences are stored as four byte planes, each encoded like a
+   * frame predicted from zeroes (prev_frame is still all zero when this is
+   * called). The decoder reads them before the rest of the header, so they
+   * must not depend on it.
+   */
+  enc->coding_xform = 1;
+  for (plane = 0; plane < 4 && !enc->error; ++plane) {
+    for (i = 0; i < enc->frame_size; ++i)
+      enc->curr_frame[i] = xform_delta(xform, i, best_stride) >> plane*8;
+
+    encode_frame_body(enc);
+  }
+  enc->coding_xform = 0;
+
+  return enc->error;
+}
+
+/* Sets *lo and *hi to the least and greatest differences from p which leave
+ * the byte c altered by at most e, without leaving the range of a byte.
+ */
+static inline void error_bounds(int* lo, int* hi, int c, int p, int e) {
+  *lo = (c > e? c - e : 0) - p;
+  *hi = (c + e < 255? c + e : 255) - p;
+}
+
+/* Stores into dst curr_frame with each byte outside the bit planes altered by
+ * at most error, as described for drachen_set_max_error(). Within each
+ * block, the differences from the previous frame are confined to the
+ * narrowest window every byte can reach: a single value if possible, which
+ * needs no body at all, or else one 2*error narrower than before. Each
+ * difference is then made as close to zero as the window allows.
+ */
+static void alter_frame(unsigned char* dst, unsigned error,
+                        const drachen_encoder* enc) {
+  const drachen_block_spec* block_size = enc->block_size;
+  const unsigned char* curr = enc->curr_frame, * prev = enc->prev_frame;
+  const uint32_t bp_begin = enc->params.bitplane_begin;
+  const uint32_t bp_end = enc->params.bitplane_end;
+  int lo, hi, low, high;
+  uint32_t offset, len, i;
+
+  for (offset = 0; offset < enc->frame_size; offset += len) {
+    len = block_len(&block_size, offset, enc);
+
+    /* Every byte can reach the window between the greatest least
+     * difference and the least greatest difference
+     */
+    low = -255;
+    high = 255;
+    for (i = offset; i < offset + len; ++i) {
+      if (i >= bp_begin && i < bp_end)
+        continue;
+
+      error_bounds(&lo, &hi, curr[i], prev[i], error);
+      if (lo > low)
+        low = lo;
+      if (hi < high)
+        high = hi;
+    }
+    if (low > high) {
+      lo = low;
+      low = high;
+      high = lo;
+    }
+
+    for (i = offset; i < offset + len; ++i) {
+      if (i >= bp_begin && i < bp_end) {
+        dst[i] = curr[i];
+        continue;
+      }
+
+      error_bounds(&lo, &hi, curr[i], prev[i], error);
+      if (lo < low)
+        lo = low;
+      if (hi > high)
+        hi = high;
+      dst[i] = prev[i] + (lo > 0? lo : hi < 0? hi : 0);
+    }
+  }
+}
+
+/* Returns the expected length in bits of the segments encode_frame_body()
+ * would give the given frame if it were curr_frame, ignoring optimal
+ * segments.
+ */
+static uint64_t frame_bits(const unsigned char* frame, drachen_encoder* enc) {
+  const drachen_block_spec* block_size = enc->block_size;
+  const int32_t last_disp = enc->last_disp;
+  encoding_method meth, last;
+  uint32_t offset, len;
+  uint64_t bits = 0;
+
+  memset(&last, 0, sizeof(last));
+  for (offset = 0; offset < enc->frame_size; offset += len) {
+    len = block_len(&block_size, offset, enc);
+    meth = choose_encoding_method(frame+offset, enc->prev_frame+offset,
+                                  prev2_at(enc, offset), offset, len, enc);
+    if (!offset || memcmp(&meth, &last, sizeof(encoding_method)))
+      bits += 8*header_cost(&meth, enc);
+    last = meth;
+
+    {
+      unsigned char res[len];
+
+      residuals(res, &meth, frame+offset, enc->prev_frame+offset,
+                prev2_at(enc, offset), offset, len, enc);
+      bits += body_bits(&meth, res, len);
+    }
+  }
+
+  /* The search for displacements must start from the same place when the
+   * frame is encoded for real.
+   */
+  enc->last_disp = last_disp;
+  return bits;
+}
+
+/* Alters curr_frame as allowed by drachen_set_max_error(), with the least
+ * error which brings it within the target size, if there is one. Returns 0
+ * or an error code.
+ */
+static int alter_curr_frame(drachen_encoder* enc) {
+  const uint64_t target = (uint64_t)enc->target_size * 8;
+  unsigned error = enc->max_error, lo = 1, mid, tried = 0;
+  unsigned char* swap;
+
+  if (!enc->max_error)
+    return 0;
+
+  if (!enc->lossy_frame &&
+      !(enc->lossy_frame = malloc(enc->frame_size? enc->frame_size : 1)))
+    return ENOMEM;
+
+  if (enc->target_size) {
+    if (frame_bits(enc->curr_frame, enc) <= target)
+      return 0;
+
+    /* Larger errors almost always make smaller frames */
+    while (lo < error) {
+      mid = (lo + error) / 2;
+      alter_frame(enc->lossy_frame, mid, enc);
+      tried = mid;
+      if (frame_bits(enc->lossy_frame, enc) <= target)
+        error = mid;
+      else
+        lo = mid + 1;
+    }
+  }
+
+  if (tried != error)
+    alter_frame(enc->lossy_frame, error, enc);
+
+  swap = enc->curr_frame;
+  enc->curr_frame = enc->lossy_frame;
+  enc->lossy_frame = swap;
+  return 0;
+}
+
+/* Returns the FC_DUP bits (unshifted) for curr_frame, whose CRC-32C is crc:
+ * FC_DUP_PREV if it is identical to prev_frame, one more than the slot of a
+ * reference it is identical to, or zero.
+ */
+static unsigned find_duplicate(const drachen_encoder* enc, uint32_t crc) {
+  unsigned s;
+
+  if (enc->prev_crc_valid && enc->prev_crc == crc &&
+      !memcmp(enc->prev_frame, enc->curr_frame, enc->frame_size))
+    return FC_DUP_PREV;
+
+  for (s = 0; s < enc->params.num_references; ++s)
+    if ((enc->ref_valid & (1u << s)) && enc->ref_crc[s] == crc &&
+        !memcmp(enc->refs[s], enc->curr_frame, enc->frame_size))
+      return s + 1;
+
+  return 0;
+}
+
+/* Returns the slot to store the current frame in, or -1. Duplicates are only
+ * stored if pinned, since they are already available.
+ */
+static int choose_ref_slot(drachen_encoder* enc, unsigned dup) {
+  const unsigned n = enc->params.num_references;
+  unsigned i, s;
+
+  if (enc->pin_ref >= 0)
+    return enc->pin_ref;
+  if (dup)
+    return -1;
+
+  for (i = 0; i < n; ++i) {
+    s = (enc->next_ref + i) % n;
+    if (!(enc->ref_pinned & (1u << s))) {
+      enc->next_ref = (s + 1) % n;
+      return s;
+    }
+  }
+
+  return -1;
+}
+
+int drachen_pin_frame(drachen_encoder* enc, unsigned slot) {
+  if (slot >= enc->params.num_references)
+    return enc->error = EINVAL;
+
+  enc->pin_ref = slot;
+  return 0;
+}
+
+/* Writes the name of a frame, coding it against the name of the last frame
+ * with DRACHEN_FEATURE_NAME_DELTA.
+ */
+static int encode_name(const char* name, drachen_encoder* enc) {
+  uint32_t len = strlen(name), prefix = 0, inc;
+  int status;
+
+  if (!(enc->params.features & DRACHEN_FEATURE_NAME_DELTA))
+    return fwrite(name, len+1, 1, enc->file)? 0 : errno;
+
+  if (drachen_reserve_name(&enc->next_name, &enc->next_name_cap,
+                           enc->last_name_len + 2))
+    return ENOMEM;
+
+  inc = drachen_increment_name(enc->next_name, enc->last_name,
+                               enc->last_name_len);
+  if (inc && inc == len && !memcmp(name, enc->next_name, len)) {
+    status = write_varint(enc->file, 0);
+  } else {
+    while (prefix < len && prefix < enc->last_name_len &&
+           name[prefix] == enc->last_name[prefix])
+      ++prefix;
+
+    status = write_varint(enc->file, prefix + 1);
+    if (!status && !fwrite(name + prefix, len - prefix + 1, 1, enc->file))
+      status = errno;
+  }
+
+  if (status)
+    return status;
+  if (drachen_reserve_name(&enc->last_name, &enc->last_name_cap, len + 1))
+    return ENOMEM;
+  memcpy(enc->last_name, name, len + 1);
+  enc->last_name_len = len;
+  return 0;
+}
+
+int drachen_encode(drachen_encoder* enc,
+                   const unsigned char* buffer,
+                   const char* name) {
+  uint32_t crc, frame_crc = 0;
+  unsigned dup = 0;
+  int store = -1;
+
+  /* Only decoders have a region of interest, and then hold too little of
+   * each frame
+   */
+  if (enc->roi)
+    return enc->error = EINVAL;
+
+  /* Transform the input frame according to the transformation matrix. */
+  drachen_transform_frame(enc->curr_frame, buffer, enc);
+  if ((enc->error = alter_curr_frame(enc)))
+    return enc->error;
+
+  if ((enc->error = encode_name(name, enc)))
+    return enc->error;
+
+  /* With references, a duplicate frame is just the control byte */
+  if (enc->refs) {
+    frame_crc = drachen_crc32c(0, enc->curr_frame, enc->frame_size);
+    dup = find_duplicate(enc, frame_crc);
+    store = choose_ref_slot(enc, dup);
+    if (EOF == fputc((store + 1) | dup << FC_DUP_SHIFT, enc->file))
+      return enc->error = errno;
+  }
+
+  if (!dup && (enc->params.features & DRACHEN_FEATURE_ENTROPY))
+    encode_coded_frame_body(enc);
+  else if (!dup)
+    encode_frame_body(enc);
+
+  /* Append the checksum of the name and transformed frame, if wanted */
+  if (!enc->error && (enc->params.features & DRACHEN_FEATURE_CRC32C)) {
+    crc = drachen_crc32c(0, name, strlen(name)+1);
+    crc = drachen_crc32c(crc, enc->curr_frame, enc->frame_size);
+    if (!fwrite(&crc, 4, 1, enc->file))
+      enc->error = errno;
+  }
+
+  if (!enc->error && enc->refs) {
+    if (store >= 0) {
+      memcpy(enc->refs[store], enc->curr_frame, enc->frame_size);
+      enc->ref_crc[store] = frame_crc;
+      enc->ref_valid |= 1u << store;
+      if (store == enc->pin_ref)
+        enc->ref_pinned |= 1u << store;
+    }
+
+    enc->pin_ref = -1;
+    enc->prev_crc = frame_crc;
+    enc->prev_crc_valid = 1;
+  }
 
   /* Update "prev" frame */
-  swap = enc->prev_frame;
-  enc->prev_frame = enc->curr_frame;
-  enc->curr_frame = swap;
+  update_background(enc, enc->curr_frame);
+  push_frame(enc);
 
   return enc->error;
 }
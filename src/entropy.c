@@ -0,0 +1,249 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "drachen.h"
+#include "common.h"
+
+/* Static-table rANS coding of frame bodies (see DRACHEN_FEATURE_ENTROPY).
+ *
+ * Frequencies are scaled to sum to RANS_SCALE. The coder has RANS_STATES
+ * 32-bit states, byte i being coded with state i % RANS_STATES, so that the
+ * decoder can work on several bytes at once; each state is kept within
+ * [RANS_L, RANS_L << 16) by moving 16-bit words in and out. The encoder
+ * works backwards from the last byte, so that the decoder works forwards.
+ */
+#define RANS_L (1u << 16)
+/* The fast loop of drachen_rans_decode() is written out for four states */
+#define RANS_STATES 4
+
+/* Scales the counts of each byte value in a body of total bytes to
+ * frequencies summing to RANS_SCALE, keeping every value which occurs.
+ */
+static void scale_freqs(uint32_t* freq, const uint32_t* count,
+                        uint32_t total) {
+  uint32_t sum = 0, excess;
+  unsigned s, most = 0;
+
+  for (s = 0; s < 256; ++s) {
+    freq[s] = ((uint64_t)count[s] << RANS_SCALE_BITS) / total;
+    if (count[s] && !freq[s])
+      freq[s] = 1;
+    sum += freq[s];
+    if (count[s] > count[most])
+      most = s;
+  }
+
+  /* The rounding error is given to or taken from the most common value,
+   * where it costs least, or else from whichever values can spare it.
+   */
+  if (sum <= RANS_SCALE) {
+    freq[most] += RANS_SCALE - sum;
+  } else if (freq[most] > sum - RANS_SCALE) {
+    freq[most] -= sum - RANS_SCALE;
+  } else {
+    excess = sum - RANS_SCALE;
+    while (excess)
+      for (s = 0; s < 256 && excess; ++s)
+        if (freq[s] > 1) {
+          --freq[s];
+          --excess;
+        }
+  }
+}
+
+uint32_t drachen_rans_encode(unsigned char* out, uint32_t limit,
+                             const unsigned char* in, uint32_t len) {
+  uint32_t count[256], freq[256], start[256], x[RANS_STATES], f, i, n;
+  unsigned char* p = out, * q = out + limit;
+  unsigned s, k;
+
+  if (!len || limit < 32)
+    return 0;
+
+  memset(count, 0, sizeof(count));
+  for (i = 0; i < len; ++i)
+    ++count[in[i]];
+  scale_freqs(freq, count, len);
+
+  /* The table: which values occur, then the frequency of each less one, in
+   * one byte if below 0x80, or else in two, high bits first.
+   */
+  memset(p, 0, 32);
+  for (s = 0, f = 0; s < 256; ++s) {
+    start[s] = f;
+    f += freq[s];
+    if (freq[s])
+      p[s >> 3] |= 1 << (s & 7);
+  }
+  p += 32;
+
+  for (s = 0; s < 256; ++s) {
+    if (!freq[s])
+      continue;
+    if (q - p < 2)
+      return 0;
+    if (freq[s] - 1 < 0x80) {
+      *p++ = freq[s] - 1;
+    } else {
+      *p++ = 0x80 | (freq[s] - 1) >> 8;
+      *p++ = freq[s] - 1;
+    }
+  }
+
+  /* The words, from the back of out */
+  for (k = 0; k < RANS_STATES; ++k)
+    x[k] = RANS_L;
+
+  for (i = len; i-- > 0; ) {
+    s = in[i];
+    f = freq[s];
+    k = i % RANS_STATES;
+    if (x[k] >= (uint64_t)f << (32 - RANS_SCALE_BITS)) {
+      if (q - p < 2)
+        return 0;
+      q -= 2;
+      q[0] = x[k];
+      q[1] = x[k] >> 8;
+      x[k] >>= 16;
+    }
+
+    x[k] = ((x[k] / f) << RANS_SCALE_BITS) + x[k] % f + start[s];
+  }
+
+  /* And the final states, which the decoder starts from */
+  for (k = RANS_STATES; k-- > 0; ) {
+    if (q - p < 4)
+      return 0;
+    q -= 4;
+    q[0] = x[k];
+    q[1] = x[k] >> 8;
+    q[2] = x[k] >> 16;
+    q[3] = x[k] >> 24;
+  }
+
+  n = out + limit - q;
+  memmove(p, q, n);
+  return p - out + n;
+}
+
+/* Decodes byte i from state x: the table entry for its slot holds the
+ * value in the low eight bits, the frequency less one in the next twelve,
+ * and the position of the slot within those of the value in the top twelve.
+ */
+#define RANS_DECODE(x, i) do {                                  \
+    e = table[x & (RANS_SCALE - 1)];                            \
+    out[i] = e;                                                 \
+    x = ((e >> 8 & 0xFFF) + 1) * (x >> RANS_SCALE_BITS) +       \
+      (e >> 20);                                                \
+  } while (0)
+
+/* Reads a word into state x if it has become too small, without
+ * branching; the input must have one.
+ */
+#define RANS_RENORM(x) do {                                     \
+    r = x < RANS_L;                                             \
+    w = p[0] | (uint32_t)p[1] << 8;                             \
+    x = x << (r << 4) | (w & -r);                               \
+    p += 2*r;                                                   \
+  } while (0)
+
+int drachen_rans_decode(unsigned char* out, uint32_t len,
+                        const unsigned char* in, uint32_t in_len,
+                        uint32_t* table) {
+  const unsigned char* p = in, * end = in + in_len;
+  uint32_t x[RANS_STATES], x0, x1, x2, x3, f, sum = 0, i, j, e, r, w, groups;
+  unsigned s, k;
+
+  if (in_len < 32)
+    return DRACHEN_OVERRUN;
+  p += 32;
+
+  for (s = 0; s < 256; ++s) {
+    if (!(in[s >> 3] & (1 << (s & 7))))
+      continue;
+
+    if (p == end)
+      return DRACHEN_OVERRUN;
+    f = *p++;
+    if (f & 0x80) {
+      if (p == end)
+        return DRACHEN_OVERRUN;
+      f = (f & 0x7F) << 8 | *p++;
+    }
+    ++f;
+
+    if (f > RANS_SCALE - sum)
+      return DRACHEN_OVERRUN;
+    for (j = 0; j < f; ++j)
+      table[sum + j] = s | (f - 1) << 8 | j << 20;
+    sum += f;
+  }
+
+  if (sum != RANS_SCALE || end - p < 4*RANS_STATES)
+    return DRACHEN_OVERRUN;
+
+  for (k = 0; k < RANS_STATES; ++k, p += 4)
+    x[k] = p[0] | (uint32_t)p[1] << 8 |
+      (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+
+  /* Every byte reads at most one word, so as many whole groups as there
+   * are words for can be decoded without checking for the end of the input.
+   * All the states of a group are advanced before any is renormalised, so
+   * that they only wait on each other for the position of their word.
+   */
+  for (i = 0; len - i >= RANS_STATES; ) {
+    groups = (end - p) / (2*RANS_STATES);
+    if (groups > (len - i) / RANS_STATES)
+      groups = (len - i) / RANS_STATES;
+    if (!groups)
+      break;
+
+    x0 = x[0], x1 = x[1], x2 = x[2], x3 = x[3];
+    for (; groups; --groups, i += RANS_STATES) {
+      RANS_DECODE(x0, i);
+      RANS_DECODE(x1, i + 1);
+      RANS_DECODE(x2, i + 2);
+      RANS_DECODE(x3, i + 3);
+      RANS_RENORM(x0);
+      RANS_RENORM(x1);
+      RANS_RENORM(x2);
+      RANS_RENORM(x3);
+    }
+    x[0] = x0, x[1] = x1, x[2] = x2, x[3] = x3;
+  }
+
+  for (; i < len; ++i) {
+    k = i % RANS_STATES;
+    RANS_DECODE(x[k], i);
+    if (x[k] < RANS_L) {
+      if (end - p < 2)
+        return DRACHEN_OVERRUN;
+      x[k] = x[k] << 16 | p[0] | (uint32_t)p[1] << 8;
+      p += 2;
+    }
+  }
+
+  /* The encoder started from RANS_L, and used every word */
+  for (k = 0; k < RANS_STATES; ++k)
+    if (x[k] != RANS_L)
+      return DRACHEN_OVERRUN;
+
+  return p == end? 0 : DRACHEN_OVERRUN;
+}
+
+int drachen_reserve(unsigned char** buf, uint32_t* size, uint32_t len) {
+  if (*buf && *size >= len)
+    return 0;
+
+  free(*buf);
+  *buf = malloc(len);
+  *size = *buf? len : 0;
+  return *buf? 0 : ENOMEM;
+}
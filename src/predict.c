@@ -0,0 +1,271 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <inttypes.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "drachen.h"
+#include "common.h"
+
+/* Predictors, and the word arithmetic they use (see
+ * DRACHEN_FEATURE_WORD_DELTA, DRACHEN_FEATURE_LINEAR,
+ * DRACHEN_FEATURE_DISPLACED and DRACHEN_FEATURE_SPATIAL).
+ *
+ * Words are little-endian, and aligned to the start of the transformed frame
+ * rather than to the start of the segment, so that a decoder with a region
+ * of interest can tell which bytes belong together without reading the
+ * segment headers. A word cut by either end of the segment is treated as a
+ * shorter word made of just the bytes within it, so that nothing carries
+ * into or out of the segment.
+ *
+ * With SSE2 (and so on x86, which is little-endian), sixteen bytes of whole
+ * words are added or subtracted at a time with the packed 8-, 16- or 32-bit
+ * instructions.
+ */
+
+/* Adds (or, with sub, subtracts) the len bytes at b to (from) those at a, as
+ * one little-endian number, storing the result at dst.
+ */
+static inline void word_bytes(unsigned char* dst, const unsigned char* a,
+                              const unsigned char* b, uint32_t len, int sub) {
+  /* a - b is a + ~b + 1 */
+  unsigned carry = !!sub, s;
+  uint32_t i;
+
+  for (i = 0; i < len; ++i) {
+    s = a[i] + (sub? (unsigned char)~b[i] : b[i]) + carry;
+    dst[i] = s;
+    carry = s >> 8;
+  }
+}
+
+static void word_arith(unsigned char* dst, const unsigned char* a,
+                       const unsigned char* b, uint32_t offset, uint32_t len,
+                       unsigned width, int sub) {
+  uint32_t i = (width - offset % width) % width;
+#ifdef __SSE2__
+  __m128i va, vb;
+#endif
+
+  if (width == 1) {
+#ifdef __SSE2__
+    for (i = 0; i + 16 <= len; i += 16) {
+      va = _mm_loadu_si128((const __m128i*)(a + i));
+      vb = _mm_loadu_si128((const __m128i*)(b + i));
+      va = sub? _mm_sub_epi8(va, vb) : _mm_add_epi8(va, vb);
+      _mm_storeu_si128((__m128i*)(dst + i), va);
+    }
+#endif
+    for (; i < len; ++i)
+      dst[i] = sub? a[i] - b[i] : a[i] + b[i];
+    return;
+  }
+
+  /* The end of a word begun before the segment */
+  if (i > len)
+    i = len;
+  word_bytes(dst, a, b, i, sub);
+
+#ifdef __SSE2__
+  for (; i + 16 <= len; i += 16) {
+    va = _mm_loadu_si128((const __m128i*)(a + i));
+    vb = _mm_loadu_si128((const __m128i*)(b + i));
+    if (width == 2)
+      va = sub? _mm_sub_epi16(va, vb) : _mm_add_epi16(va, vb);
+    else
+      va = sub? _mm_sub_epi32(va, vb) : _mm_add_epi32(va, vb);
+    _mm_storeu_si128((__m128i*)(dst + i), va);
+  }
+#endif
+
+  for (; i < len; i += width)
+    word_bytes(dst + i, a + i, b + i, len - i < width? len - i : width, sub);
+}
+
+/* Adds (or, with sub, subtracts) the prediction of the given predictor to
+ * (from) the len bytes at dst. The linear predictors predict 2*prev - prev2,
+ * which is the same as adding prev twice and subtracting prev2.
+ */
+static void prediction_arith(unsigned char* dst, int predictor,
+                             const unsigned char* prev,
+                             const unsigned char* prev2,
+                             uint32_t offset, uint32_t len, int sub) {
+  unsigned width = predictor_width(predictor);
+
+  switch (predictor) {
+  case PRED_PREV:
+  case PRED_PREV16:
+  case PRED_REF:
+  case PRED_BACKGROUND:
+  case PRED_PREV32:
+    word_arith(dst, dst, prev, offset, len, width, sub);
+    break;
+
+  case PRED_LINEAR:
+  case PRED_LINEAR16:
+  case PRED_LINEAR32:
+    word_arith(dst, dst, prev, offset, len, width, sub);
+    word_arith(dst, dst, prev, offset, len, width, sub);
+    word_arith(dst, dst, prev2, offset, len, width, !sub);
+    break;
+  }
+}
+
+void drachen_add_prediction(unsigned char* dst, int predictor,
+                            const unsigned char* prev,
+                            const unsigned char* prev2,
+                            uint32_t offset, uint32_t len) {
+  prediction_arith(dst, predictor, prev, prev2, offset, len, 0);
+}
+
+void drachen_sub_prediction(unsigned char* dst, int predictor,
+                            const unsigned char* prev,
+                            const unsigned char* prev2,
+                            uint32_t offset, uint32_t len) {
+  prediction_arith(dst, predictor, prev, prev2, offset, len, 1);
+}
+
+static void displaced_arith(unsigned char* dst, const unsigned char* frame,
+                            uint32_t size, uint32_t offset, uint32_t len,
+                            int32_t disp, int sub) {
+  int64_t from = (int64_t)offset + disp;
+  uint32_t begin = 0, end = len;
+
+  /* Only the bytes within the frame contribute anything */
+  if (from < 0)
+    begin = -from < (int64_t)len? (uint32_t)-from : len;
+  if (from + len > size)
+    end = from < (int64_t)size? (uint32_t)(size - from) : 0;
+
+  if (end > begin)
+    word_arith(dst + begin, dst + begin, frame + from + begin, 0,
+               end - begin, 1, sub);
+}
+
+void drachen_add_displaced(unsigned char* dst, const unsigned char* frame,
+                           uint32_t size, uint32_t offset, uint32_t len,
+                           int32_t disp) {
+  displaced_arith(dst, frame, size, offset, len, disp, 0);
+}
+
+void drachen_sub_displaced(unsigned char* dst, const unsigned char* frame,
+                           uint32_t size, uint32_t offset, uint32_t len,
+                           int32_t disp) {
+  displaced_arith(dst, frame, size, offset, len, disp, 1);
+}
+
+void drachen_add_spatial(unsigned char* frame, uint32_t offset, uint32_t len,
+                         uint32_t dist) {
+  unsigned char* p;
+  uint32_t i = 0;
+#ifdef __SSE2__
+  __m128i v, carry;
+#endif
+
+  /* Bytes with nothing before them are left as they are */
+  if (offset < dist)
+    i = dist - offset < len? dist - offset : len;
+  p = frame + offset;
+
+#ifdef __SSE2__
+  if (dist == 1 && i < len) {
+    /* A running sum: each vector is summed in log steps, then the last byte
+     * of the one before is added to all of it.
+     */
+    carry = _mm_set1_epi8(p[(int64_t)i - 1]);
+    for (; i + 16 <= len; i += 16) {
+      v = _mm_loadu_si128((const __m128i*)(p + i));
+      v = _mm_add_epi8(v, _mm_slli_si128(v, 1));
+      v = _mm_add_epi8(v, _mm_slli_si128(v, 2));
+      v = _mm_add_epi8(v, _mm_slli_si128(v, 4));
+      v = _mm_add_epi8(v, _mm_slli_si128(v, 8));
+      v = _mm_add_epi8(v, carry);
+      _mm_storeu_si128((__m128i*)(p + i), v);
+      carry = _mm_set1_epi8(p[i + 15]);
+    }
+  } else if (dist >= 16) {
+    /* Sixteen bytes never depend on each other */
+    for (; i + 16 <= len; i += 16) {
+      v = _mm_add_epi8(_mm_loadu_si128((const __m128i*)(p + i)),
+                       _mm_loadu_si128((const __m128i*)(p + i - dist)));
+      _mm_storeu_si128((__m128i*)(p + i), v);
+    }
+  }
+#endif
+
+  for (; i < len; ++i)
+    p[i] += p[(int64_t)i - dist];
+}
+
+void drachen_sub_spatial(unsigned char* dst, const unsigned char* frame,
+                         uint32_t offset, uint32_t len, uint32_t dist) {
+  uint32_t skip = 0;
+
+  if (offset < dist)
+    skip = dist - offset < len? dist - offset : len;
+
+  word_arith(dst + skip, dst + skip, frame + offset + skip - dist, 0,
+             len - skip, 1, 1);
+}
+
+uint32_t drachen_sad(const unsigned char* a, const unsigned char* b,
+                     uint32_t len) {
+  uint32_t i = 0, sum = 0;
+#ifdef __SSE2__
+  __m128i acc = _mm_setzero_si128();
+
+  for (; i + 16 <= len; i += 16)
+    acc = _mm_add_epi64(acc,
+                        _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(a + i)),
+                                     _mm_loadu_si128((const __m128i*)(b + i))));
+  sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+
+  for (; i < len; ++i)
+    sum += a[i] > b[i]? a[i] - b[i] : b[i] - a[i];
+
+  return sum;
+}
+
+/* The model holds each byte scaled by 256, and moves as
+ *   model - (model >> shift) + (byte << (8 - shift))
+ * which needs no signed shifts, and never leaves 16 bits: with a steady
+ * byte, it settles less than 2^shift above the byte scaled by 256, so its
+ * whole part is the byte itself. With SSE2, sixteen bytes are folded in at a
+ * time with the packed 16-bit instructions.
+ */
+void drachen_update_background(uint16_t* model, unsigned char* whole,
+                               const unsigned char* frame, uint32_t len,
+                               unsigned shift) {
+  uint32_t i = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i down = _mm_cvtsi32_si128(shift);
+  const __m128i up = _mm_cvtsi32_si128(8 - shift);
+  __m128i f, lo, hi;
+
+  for (; i + 16 <= len; i += 16) {
+    f = _mm_loadu_si128((const __m128i*)(frame + i));
+    lo = _mm_loadu_si128((const __m128i*)(model + i));
+    hi = _mm_loadu_si128((const __m128i*)(model + i + 8));
+    lo = _mm_add_epi16(_mm_sub_epi16(lo, _mm_srl_epi16(lo, down)),
+                       _mm_sll_epi16(_mm_unpacklo_epi8(f, zero), up));
+    hi = _mm_add_epi16(_mm_sub_epi16(hi, _mm_srl_epi16(hi, down)),
+                       _mm_sll_epi16(_mm_unpackhi_epi8(f, zero), up));
+    _mm_storeu_si128((__m128i*)(model + i), lo);
+    _mm_storeu_si128((__m128i*)(model + i + 8), hi);
+    _mm_storeu_si128((__m128i*)(whole + i),
+                     _mm_packus_epi16(_mm_srli_epi16(lo, 8),
+                                      _mm_srli_epi16(hi, 8)));
+  }
+#endif
+
+  for (; i < len; ++i) {
+    model[i] = model[i] - (model[i] >> shift) + (frame[i] << (8 - shift));
+    whole[i] = model[i] >> 8;
+  }
+}
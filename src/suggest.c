@@ -0,0 +1,373 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "drachen.h"
+#include "common.h"
+
+/* Automatic choice of transform (see drachen_suggest_xform()).
+ *
+ * Candidate geometries are found with the average magnitude difference
+ * function of the sample: for each lag L, the mean of |s[i]-s[i-L]| over a set
+ * of windows spread through the frame, where s is the first frame and, if
+ * there are more, also the change between the first two. Interleaved
+ * components show up as a minimum at a small lag, and rows or records as a
+ * minimum at their stride. Since that says little about how well the encoder
+ * will actually do, each candidate is then judged by encoding the sample with
+ * it.
+ */
+
+/* The largest row or record stride looked for */
+#define SUGGEST_MAX_LAG 32768
+/* The largest number of interleaved components looked for */
+#define SUGGEST_MAX_COMPONENTS 8
+/* The number and length of the windows the difference function is taken
+ * over
+ */
+#define SUGGEST_WINDOWS 64
+#define SUGGEST_WINDOW_LEN 64
+/* The number of strides tried */
+#define SUGGEST_STRIDES 4
+/* The largest stride also tried as a record size */
+#define SUGGEST_MAX_RECORD 256
+/* A lag whose score is within this many sixteenths of another is considered
+ * as good, so that the smallest of several equivalent lags is taken rather
+ * than one of its multiples.
+ */
+#define SUGGEST_SLACK 18
+
+struct sample {
+  const unsigned char*const* frames;
+  unsigned num_frames;
+  uint32_t frame_size;
+};
+
+struct suggestion {
+  drachen_xform_spec spec;
+  uint32_t block_size;
+  uint64_t cost;
+};
+
+/* Returns the mean absolute difference of the sample at the given lag, scaled
+ * by 256, or UINT64_MAX if the frame is too short.
+ */
+static uint64_t amdf(const struct sample* s, uint32_t lag) {
+  const unsigned char* f0 = s->frames[0];
+  const unsigned char* f1 = s->num_frames > 1? s->frames[1] : NULL;
+  uint64_t sum = 0, n = 0;
+  uint32_t w, i, begin, end;
+  signed char d, dl;
+
+  for (w = 0; w < SUGGEST_WINDOWS; ++w) {
+    if (s->frame_size <= SUGGEST_WINDOWS * SUGGEST_WINDOW_LEN) {
+      /* Small enough to use the whole thing */
+      if (w) break;
+      begin = 0;
+      end = s->frame_size;
+    } else {
+      begin = (uint64_t)(s->frame_size - SUGGEST_WINDOW_LEN) * w /
+        (SUGGEST_WINDOWS - 1);
+      end = begin + SUGGEST_WINDOW_LEN;
+    }
+
+    if (begin < lag)
+      begin = lag;
+    for (i = begin; i < end; ++i) {
+      sum += abs((int)f0[i] - (int)f0[i-lag]);
+      if (f1) {
+        d = f1[i] - f0[i];
+        dl = f1[i-lag] - f0[i-lag];
+        sum += abs((int)d - (int)dl);
+      }
+      ++n;
+    }
+  }
+
+  return n? sum * 256 / n : UINT64_MAX;
+}
+
+/* Returns the smallest lag from min to lag inclusive which divides evenly into
+ * lag and scores as well as it.
+ */
+static uint32_t smallest_equivalent_lag(const uint64_t* score, uint32_t min,
+                                        uint32_t lag) {
+  uint32_t d;
+
+  for (d = min; d < lag; ++d)
+    if (!(lag % d) && score[d] != UINT64_MAX &&
+        score[d] * 16 <= score[lag] * SUGGEST_SLACK)
+      return d;
+
+  return lag;
+}
+
+/* Sets up blocks to use block_size after the given offset. */
+static void make_blocks(drachen_block_spec* blocks, uint32_t offset,
+                        uint32_t block_size) {
+  if (offset) {
+    blocks->segment_end = offset;
+    blocks->block_size = offset;
+    ++blocks;
+  }
+
+  blocks->segment_end = 0xFFFFFFFFu;
+  blocks->block_size = block_size;
+}
+
+/* Encodes the sample with the given transform and block size, setting *cost
+ * to the number of bytes used for all but the first frame (or for the first,
+ * if there is only one). Returns 0 or an error code.
+ */
+static int trial_encode(uint64_t* cost, const struct sample* s,
+                        const drachen_xform_spec* spec, uint32_t block_size) {
+  FILE* out;
+  char* buf = NULL;
+  size_t len = 0;
+  drachen_encoder* enc;
+  drachen_stream_params params;
+  drachen_block_spec blocks[2];
+  off_t start, end;
+  unsigned i;
+  int err;
+
+#ifdef HAVE_OPEN_MEMSTREAM
+  out = open_memstream(&buf, &len);
+#else
+  out = tmpfile();
+#endif
+  if (!out)
+    return errno;
+
+  /* Describe the transform compactly, so that the header costs nothing
+   * worth mentioning.
+   */
+  drachen_default_stream_params(&params);
+  params.features = DRACHEN_FEATURE_XFORM_DESC;
+  enc = drachen_create_encoder_spec(out, s->frame_size, spec, &params);
+  if (!enc) {
+    fclose(out);
+    free(buf);
+    return ENOMEM;
+  }
+
+  make_blocks(blocks, spec->offset, block_size);
+  drachen_set_block_size(enc, blocks);
+
+  /* Only the changes between frames are of interest, so rather than encoding
+   * the first frame, just make it the one the second is predicted from.
+   */
+  i = 0;
+  err = drachen_error(enc);
+  if (!err && s->num_frames > 1)
+    drachen_transform_frame(enc->prev_frame, s->frames[i++], enc);
+
+  fflush(out);
+  start = ftello(out);
+  for (; !err && i < s->num_frames; ++i)
+    err = drachen_encode(enc, s->frames[i], "");
+
+  fflush(out);
+  end = ftello(out);
+  if (start < 0 || end < 0)
+    err = errno;
+
+  *cost = end - start;
+
+  drachen_free(enc);
+  free(buf);
+  return err;
+}
+
+/* Tries the given candidate, replacing *best with it if it does better.
+ * Candidates which turn out to be invalid are ignored.
+ */
+static int consider(struct suggestion* best, const struct sample* s,
+                    const drachen_xform_spec* spec, uint32_t block_size) {
+  uint64_t cost;
+  int err;
+
+  err = trial_encode(&cost, s, spec, block_size);
+  if (err == EINVAL)
+    return 0;
+  if (err)
+    return err;
+
+  if (cost < best->cost) {
+    best->spec = *spec;
+    best->block_size = block_size;
+    best->cost = cost;
+  }
+
+  return 0;
+}
+
+/* Tries an image of the given stride and components, at the start or the
+ * end of the frame.
+ */
+static int consider_image(struct suggestion* best, const struct sample* s,
+                          uint32_t stride, unsigned comps) {
+  drachen_xform_spec spec;
+  uint32_t rows = s->frame_size / stride;
+  int err;
+
+  if (stride % comps || rows < 2)
+    return 0;
+
+  memset(&spec, 0, sizeof(spec));
+  spec.kind = DRACHEN_XFORM_IMAGE;
+  spec.cols = stride / comps;
+  spec.rows = rows;
+  spec.num_components = comps;
+  spec.block_width = 16;
+  spec.block_height = 16;
+  if ((err = consider(best, s, &spec, 32)))
+    return err;
+
+  /* Headers usually come before images, rather than trailers after them */
+  spec.offset = s->frame_size - rows * stride;
+  if (spec.offset)
+    err = consider(best, s, &spec, 32);
+
+  return err;
+}
+
+/* Tries records of the given size, with every byte split out. */
+static int consider_records(struct suggestion* best, const struct sample* s,
+                            uint32_t record_size) {
+  drachen_xform_spec spec;
+
+  if (s->frame_size / record_size < 2)
+    return 0;
+
+  memset(&spec, 0, sizeof(spec));
+  spec.kind = DRACHEN_XFORM_RECORD;
+  spec.record_size = record_size;
+  spec.num_records = s->frame_size / record_size;
+  spec.split_bytes = 1;
+  return consider(best, s, &spec, 32);
+}
+
+int drachen_suggest_xform(drachen_xform_spec* spec,
+                          drachen_block_spec* blocks,
+                          const unsigned char*const* frames,
+                          unsigned num_frames,
+                          uint32_t frame_size) {
+  static const unsigned block_shapes[][2] = {
+    { 8, 8 }, { 32, 32 }, { 64, 4 }, { 0xFFFFFFFFu, 1 },
+  };
+  static const uint32_t block_sizes[] = { 8, 16, 64, 128, 256 };
+  struct sample s;
+  struct suggestion best;
+  drachen_xform_spec trial;
+  uint64_t* score = NULL;
+  uint64_t best_score;
+  uint32_t max_lag, lag, strides[SUGGEST_STRIDES], num_strides = 0, i, j;
+  unsigned comps = 1;
+  int err;
+
+  if (!num_frames || !frame_size)
+    return EINVAL;
+
+  s.frames = frames;
+  s.num_frames = num_frames;
+  s.frame_size = frame_size;
+
+  memset(&best, 0, sizeof(best));
+  best.spec.kind = DRACHEN_XFORM_IDENTITY;
+  best.block_size = 32;
+  if ((err = trial_encode(&best.cost, &s, &best.spec, best.block_size)))
+    return err;
+
+  max_lag = frame_size / 2;
+  if (max_lag > SUGGEST_MAX_LAG)
+    max_lag = SUGGEST_MAX_LAG;
+
+  score = malloc(sizeof(uint64_t) * (max_lag + 1));
+  if (!score)
+    return ENOMEM;
+
+  score[0] = UINT64_MAX;
+  for (lag = 1; lag <= max_lag; ++lag)
+    score[lag] = amdf(&s, lag);
+
+  /* Components */
+  best_score = UINT64_MAX;
+  for (lag = 1; lag <= SUGGEST_MAX_COMPONENTS && lag <= max_lag; ++lag) {
+    if (score[lag] < best_score) {
+      best_score = score[lag];
+      comps = lag;
+    }
+  }
+  if (comps > 1)
+    comps = smallest_equivalent_lag(score, 1, comps);
+
+  /* Strides, best first */
+  while (num_strides < SUGGEST_STRIDES) {
+    best_score = UINT64_MAX;
+    for (lag = SUGGEST_MAX_COMPONENTS+1, j = 0; lag <= max_lag; ++lag) {
+      if (score[lag] < best_score) {
+        best_score = score[lag];
+        j = lag;
+      }
+    }
+
+    if (!j)
+      break;
+
+    strides[num_strides++] = j;
+    /* Don't pick the same lag again */
+    score[j] = UINT64_MAX;
+  }
+
+  for (i = 0; i < num_strides; ++i)
+    score[strides[i]] = amdf(&s, strides[i]);
+  for (i = 0; i < num_strides; ++i)
+    strides[i] = smallest_equivalent_lag(score, SUGGEST_MAX_COMPONENTS+1,
+                                         strides[i]);
+  free(score);
+
+  for (i = 0; i < num_strides; ++i) {
+    for (j = 0; j < i && strides[j] != strides[i]; ++j);
+    if (j < i)
+      continue;
+
+    if ((err = consider_image(&best, &s, strides[i], 1)))
+      return err;
+    if (comps > 1 && (err = consider_image(&best, &s, strides[i], comps)))
+      return err;
+    if (strides[i] <= SUGGEST_MAX_RECORD &&
+        (err = consider_records(&best, &s, strides[i])))
+      return err;
+  }
+
+  if (comps > 1 && (err = consider_records(&best, &s, comps)))
+    return err;
+
+  /* Refine the block shape of images, then the block size */
+  if (best.spec.kind == DRACHEN_XFORM_IMAGE) {
+    trial = best.spec;
+    for (i = 0; i < sizeof(block_shapes)/sizeof(block_shapes[0]); ++i) {
+      trial.block_width = block_shapes[i][0];
+      trial.block_height = block_shapes[i][1];
+      if ((err = consider(&best, &s, &trial, best.block_size)))
+        return err;
+    }
+  }
+
+  trial = best.spec;
+  for (i = 0; i < sizeof(block_sizes)/sizeof(block_sizes[0]); ++i)
+    if ((err = consider(&best, &s, &trial, block_sizes[i])))
+      return err;
+
+  /* Report the block dimensions as they will actually be used */
+  drachen_normalise_xform_spec(&best.spec, frame_size);
+  *spec = best.spec;
+  make_blocks(blocks, best.spec.offset, best.block_size);
+  return 0;
+}
@@ -0,0 +1,651 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "drachen.h"
+#include "common.h"
+
+/* Parametric transforms.
+ *
+ * Rather than looking every byte up in a table of frame_size indices, the
+ * transforms described by a drachen_xform_spec are applied with nested loops
+ * which copy whole rows of pixels at a time. For images, the transform only
+ * ever interleaves (or deinterleaves) the components of one row of a block,
+ * so both the untransformed and the transformed data are accessed in short
+ * sequential runs.
+ */
+
+/* Returns the transformed index of byte i of an image. */
+static uint32_t image_index(const drachen_xform_spec* spec, uint32_t i) {
+  uint32_t j, c, p, plane, block, sub, nbx;
+
+  if (i < spec->offset)
+    return i;
+
+  plane = spec->cols * spec->rows;
+  j = i - spec->offset;
+  if (j >= plane * spec->num_components)
+    return i;
+
+  c = j % spec->num_components;
+  p = j / spec->num_components;
+  block = p / (spec->block_width * spec->block_height);
+  sub = p % (spec->block_width * spec->block_height);
+  nbx = spec->cols / spec->block_width;
+
+  return spec->offset + c*plane +
+    (block % nbx) * spec->block_width + sub % spec->block_width +
+    ((block / nbx) * spec->block_height + sub / spec->block_width) *
+    spec->cols;
+}
+
+/* Returns the transformed index of byte i of an array of records. */
+static uint32_t record_index(const drachen_xform_spec* spec, uint32_t i) {
+  uint32_t j, r, b, start = 0, width = 0;
+  unsigned f;
+
+  if (i < spec->offset)
+    return i;
+
+  j = i - spec->offset;
+  if (j / spec->record_size >= spec->num_records)
+    return i;
+
+  r = j / spec->record_size;
+  b = j % spec->record_size;
+
+  if (spec->split_bytes)
+    return spec->offset + b * spec->num_records + r;
+
+  /* Find the field containing b; anything after the last field is one more
+   * field.
+   */
+  for (f = 0; f < spec->num_fields; ++f) {
+    width = spec->field_sizes[f];
+    if (b < start + width) break;
+    start += width;
+  }
+  if (f == spec->num_fields)
+    width = spec->record_size - start;
+
+  return spec->offset + start * spec->num_records + r * width + b - start;
+}
+
+uint32_t drachen_xform_spec_index(const drachen_xform_spec* spec, uint32_t i) {
+  switch (spec->kind) {
+  case DRACHEN_XFORM_IMAGE:  return image_index(spec, i);
+  case DRACHEN_XFORM_RECORD: return record_index(spec, i);
+  default:                   return i;
+  }
+}
+
+int drachen_normalise_xform_spec(drachen_xform_spec* spec,
+                                 uint32_t frame_size) {
+  uint64_t total;
+  unsigned f;
+
+  switch (spec->kind) {
+  case DRACHEN_XFORM_IDENTITY:
+    return 0;
+
+  case DRACHEN_XFORM_IMAGE:
+    if (!spec->cols || !spec->rows || !spec->num_components ||
+        !spec->block_width || !spec->block_height ||
+        spec->offset > frame_size ||
+        (uint64_t)spec->cols * spec->rows * spec->num_components >
+        frame_size - spec->offset)
+      return EINVAL;
+
+    /* As with drachen_make_image_xform_matrix() */
+    if (spec->block_width > spec->cols)
+      spec->block_width = spec->cols;
+    if (spec->block_height > spec->rows)
+      spec->block_height = spec->rows;
+    while (spec->cols % spec->block_width) --spec->block_width;
+    while (spec->rows % spec->block_height) --spec->block_height;
+    return 0;
+
+  case DRACHEN_XFORM_RECORD:
+    if (!spec->record_size || spec->offset > frame_size ||
+        (uint64_t)spec->record_size * spec->num_records >
+        frame_size - spec->offset ||
+        (spec->num_fields && !spec->field_sizes))
+      return EINVAL;
+
+    for (f = 0, total = 0; f < spec->num_fields; ++f) {
+      if (!spec->field_sizes[f])
+        return EINVAL;
+      total += spec->field_sizes[f];
+    }
+    if (total > spec->record_size)
+      return EINVAL;
+
+    spec->split_bytes = !!spec->split_bytes;
+    return 0;
+
+  default:
+    return EINVAL;
+  }
+}
+
+void drachen_make_xform_matrix(uint32_t* xform, uint32_t frame_size,
+                               const drachen_xform_spec* spec) {
+  drachen_xform_spec s = *spec;
+  uint32_t i;
+
+  if (drachen_normalise_xform_spec(&s, frame_size))
+    s.kind = DRACHEN_XFORM_IDENTITY;
+
+  for (i = 0; i < frame_size; ++i)
+    xform[i] = drachen_xform_spec_index(&s, i);
+}
+
+/* Copies n pixels of comps components each from the planes at src (which are
+ * plane bytes apart) into interleaved form at dst.
+ */
+static void interleave(unsigned char* dst, const unsigned char* src,
+                       uint32_t plane, uint32_t n, unsigned comps) {
+  const unsigned char* s0 = src, * s1 = src + plane,
+                     * s2 = s1 + plane, * s3 = s2 + plane;
+  uint32_t i;
+  unsigned c;
+
+  switch (comps) {
+  case 1:
+    memcpy(dst, src, n);
+    break;
+
+  case 2:
+    for (i = 0; i < n; ++i, dst += 2) {
+      dst[0] = s0[i];
+      dst[1] = s1[i];
+    }
+    break;
+
+  case 3:
+    for (i = 0; i < n; ++i, dst += 3) {
+      dst[0] = s0[i];
+      dst[1] = s1[i];
+      dst[2] = s2[i];
+    }
+    break;
+
+  case 4:
+    for (i = 0; i < n; ++i, dst += 4) {
+      dst[0] = s0[i];
+      dst[1] = s1[i];
+      dst[2] = s2[i];
+      dst[3] = s3[i];
+    }
+    break;
+
+  default:
+    for (i = 0; i < n; ++i)
+      for (c = 0; c < comps; ++c)
+        *dst++ = src[c*plane + i];
+    break;
+  }
+}
+
+/* The inverse of interleave() */
+static void deinterleave(unsigned char* dst, const unsigned char* src,
+                         uint32_t plane, uint32_t n, unsigned comps) {
+  unsigned char* d0 = dst, * d1 = dst + plane, * d2 = d1 + plane,
+               * d3 = d2 + plane;
+  uint32_t i;
+  unsigned c;
+
+  switch (comps) {
+  case 1:
+    memcpy(dst, src, n);
+    break;
+
+  case 2:
+    for (i = 0; i < n; ++i, src += 2) {
+      d0[i] = src[0];
+      d1[i] = src[1];
+    }
+    break;
+
+  case 3:
+    for (i = 0; i < n; ++i, src += 3) {
+      d0[i] = src[0];
+      d1[i] = src[1];
+      d2[i] = src[2];
+    }
+    break;
+
+  case 4:
+    for (i = 0; i < n; ++i, src += 4) {
+      d0[i] = src[0];
+      d1[i] = src[1];
+      d2[i] = src[2];
+      d3[i] = src[3];
+    }
+    break;
+
+  default:
+    for (i = 0; i < n; ++i)
+      for (c = 0; c < comps; ++c)
+        dst[c*plane + i] = *src++;
+    break;
+  }
+}
+
+/* Moves image data from src to dst. If reverse is zero, src is untransformed
+ * and dst transformed; otherwise, the other way around.
+ */
+static void image_xform(unsigned char* dst, const unsigned char* src,
+                        const drachen_xform_spec* spec, uint32_t frame_size,
+                        int reverse) {
+  const uint32_t bw = spec->block_width, bh = spec->block_height;
+  const uint32_t plane = spec->cols * spec->rows;
+  const uint32_t end = spec->offset + plane * spec->num_components;
+  const unsigned comps = spec->num_components;
+  uint32_t bx, by, py, nbx = spec->cols / bw, nby = spec->rows / bh;
+  uint32_t raw = spec->offset, xformed;
+
+  /* Bytes outside of the image are not moved */
+  memcpy(dst, src, spec->offset);
+  memcpy(dst + end, src + end, frame_size - end);
+
+  for (by = 0; by < nby; ++by) {
+    for (bx = 0; bx < nbx; ++bx) {
+      xformed = spec->offset + by*bh*spec->cols + bx*bw;
+      for (py = 0; py < bh; ++py) {
+        if (reverse)
+          interleave(dst + raw, src + xformed, plane, bw, comps);
+        else
+          deinterleave(dst + xformed, src + raw, plane, bw, comps);
+
+        raw += bw*comps;
+        xformed += spec->cols;
+      }
+    }
+  }
+}
+
+/* Frames smaller than this are transformed with a simple loop over the
+ * table, since they stay in cache anyway.
+ */
+#define PLAN_MIN_FRAME_SIZE 65536
+/* Size of destination tiles in a plan */
+#define PLAN_TILE 262144
+/* Minimum length of a run moved by memcpy() */
+#define PLAN_MIN_RUN 16
+/* Sources within the same 1<<PLAN_LINE_BITS bytes are considered equal when
+ * sorting a tile
+ */
+#define PLAN_LINE_BITS 6
+/* Digit size for sorting tiles */
+#define RADIX_BITS 10
+#define RADIX_MASK ((1 << RADIX_BITS) - 1)
+/* How many pairs ahead to prefetch the source */
+#define PLAN_PREFETCH 16
+
+void drachen_free_xform_plan(struct xform_plan* plan) {
+  if (plan->runs) free(plan->runs);
+  if (plan->dst) free(plan->dst);
+  if (plan->src) free(plan->src);
+  free(plan);
+}
+
+/* Sorts the count pairs in pairs, each of which has the source in its upper
+ * half, by source, using the equally sized array tmp as scratch space. Only
+ * bits [PLAN_LINE_BITS,bits) of the source are considered, since the order
+ * of accesses within a cache line does not matter. Returns whichever array
+ * holds the result.
+ */
+static uint64_t* radix_sort_pairs(uint64_t* pairs, uint64_t* tmp,
+                                  uint32_t count, unsigned bits) {
+  uint32_t pos[1 << RADIX_BITS], i, k, sum;
+  uint64_t* swap;
+  unsigned shift;
+
+  for (shift = 32 + PLAN_LINE_BITS; shift < 32 + bits; shift += RADIX_BITS) {
+    memset(pos, 0, sizeof(pos));
+    for (i = 0; i < count; ++i)
+      ++pos[(pairs[i] >> shift) & RADIX_MASK];
+    for (k = 0, sum = 0; k <= RADIX_MASK; ++k) {
+      i = pos[k];
+      pos[k] = sum;
+      sum += i;
+    }
+
+    for (i = 0; i < count; ++i)
+      tmp[pos[(pairs[i] >> shift) & RADIX_MASK]++] = pairs[i];
+
+    swap = pairs; pairs = tmp; tmp = swap;
+  }
+
+  return pairs;
+}
+
+void drachen_plan_xform(drachen_encoder* enc) {
+  const uint32_t n = enc->frame_size, * xform = enc->xform;
+  struct xform_plan* plan = NULL;
+  uint64_t* scratch = NULL, * sorted;
+  uint32_t i, j, r, tile, count, pos;
+  unsigned bits;
+
+  if (n < PLAN_MIN_FRAME_SIZE)
+    return;
+
+  plan = calloc(1, sizeof(struct xform_plan));
+  scratch = malloc(sizeof(uint64_t) * 2 * PLAN_TILE);
+  if (!plan || !scratch) goto fail;
+
+  /* Find the runs; the first pass only counts them */
+  for (i = 0; i < n; i = j) {
+    for (j = i+1; j < n && xform[j] == xform[j-1] + 1; ++j);
+    if (j - i >= PLAN_MIN_RUN)
+      ++plan->num_runs;
+  }
+
+  plan->runs = malloc(sizeof(struct xform_run) *
+                      (plan->num_runs? plan->num_runs : 1));
+  if (!plan->runs) goto fail;
+
+  plan->num_runs = 0;
+  plan->num_pairs = n;
+  for (i = 0; i < n; i = j) {
+    for (j = i+1; j < n && xform[j] == xform[j-1] + 1; ++j);
+    if (j - i >= PLAN_MIN_RUN) {
+      plan->runs[plan->num_runs].dst = i;
+      plan->runs[plan->num_runs].src = xform[i];
+      plan->runs[plan->num_runs].len = j - i;
+      ++plan->num_runs;
+      plan->num_pairs -= j - i;
+    }
+  }
+
+  plan->dst = malloc(sizeof(uint32_t) *
+                     (plan->num_pairs? plan->num_pairs : 1));
+  plan->src = malloc(sizeof(uint32_t) *
+                     (plan->num_pairs? plan->num_pairs : 1));
+  if (!plan->dst || !plan->src) goto fail;
+
+  for (bits = 0; bits < 32 && (n-1) >> bits; ++bits);
+
+  /* Collect the bytes outside of runs one tile at a time, and sort each tile
+   * by source.
+   */
+  r = pos = 0;
+  for (tile = 0; tile < n; tile += PLAN_TILE) {
+    count = 0;
+    for (i = tile; i < n && i < tile + PLAN_TILE; ++i) {
+      while (r < plan->num_runs &&
+             plan->runs[r].dst + plan->runs[r].len <= i)
+        ++r;
+      if (r < plan->num_runs && plan->runs[r].dst <= i) {
+        i = plan->runs[r].dst + plan->runs[r].len - 1;
+        continue;
+      }
+
+      scratch[count++] = (uint64_t)xform[i] << 32 | i;
+    }
+
+    sorted = radix_sort_pairs(scratch, scratch + PLAN_TILE, count, bits);
+    for (i = 0; i < count; ++i) {
+      plan->src[pos + i] = sorted[i] >> 32;
+      plan->dst[pos + i] = (uint32_t)sorted[i];
+    }
+    pos += count;
+  }
+
+  free(scratch);
+  enc->plan = plan;
+  return;
+
+  fail:
+  if (plan) drachen_free_xform_plan(plan);
+  if (scratch) free(scratch);
+}
+
+/* Moves bytes from in to out according to the given plan. */
+static void apply_plan(unsigned char* out, const unsigned char* in,
+                       const struct xform_plan* plan) {
+  const uint32_t* dst = plan->dst, * src = plan->src;
+  uint32_t i, n = plan->num_pairs;
+
+  for (i = 0; i < plan->num_runs; ++i)
+    memcpy(out + plan->runs[i].dst, in + plan->runs[i].src,
+           plan->runs[i].len);
+
+  for (i = 0; i + PLAN_PREFETCH < n; ++i) {
+#ifdef __GNUC__
+    __builtin_prefetch(in + src[i + PLAN_PREFETCH]);
+#endif
+    out[dst[i]] = in[src[i]];
+  }
+  for (; i < n; ++i)
+    out[dst[i]] = in[src[i]];
+}
+
+/* Number of records moved at a time by record_xform(). This keeps the
+ * records being worked on in cache while each of their fields is moved.
+ */
+#define RECORD_CHUNK 256
+
+/* Moves one field of count records, each stride bytes long, between raw
+ * (untransformed) and xformed, where the values are packed width bytes
+ * apart; the direction is given by reverse.
+ */
+static void move_field(unsigned char* raw, unsigned char* xformed,
+                       uint32_t width, uint32_t stride, uint32_t count,
+                       int reverse) {
+  uint32_t r;
+
+  if (width == 1) {
+    if (reverse)
+      for (r = 0; r < count; ++r)
+        raw[r*stride] = xformed[r];
+    else
+      for (r = 0; r < count; ++r)
+        xformed[r] = raw[r*stride];
+  } else {
+    if (reverse)
+      for (r = 0; r < count; ++r)
+        memcpy(raw + r*stride, xformed + r*width, width);
+    else
+      for (r = 0; r < count; ++r)
+        memcpy(xformed + r*width, raw + r*stride, width);
+  }
+}
+
+/* Moves an array of records from src to dst. If reverse is zero, src is
+ * untransformed and dst transformed; otherwise, the other way around.
+ */
+static void record_xform(unsigned char* dst, const unsigned char* src,
+                         const drachen_xform_spec* spec, uint32_t frame_size,
+                         int reverse) {
+  const uint32_t rs = spec->record_size, nr = spec->num_records;
+  const uint32_t end = spec->offset + rs * nr;
+  uint32_t r, count, start, width, b;
+  unsigned char* raw, * xformed;
+  unsigned f;
+
+  /* Bytes outside of the records are not moved */
+  memcpy(dst, src, spec->offset);
+  memcpy(dst + end, src + end, frame_size - end);
+
+  /* Only one of these is written to */
+  raw = (unsigned char*)(reverse? dst : src) + spec->offset;
+  xformed = (unsigned char*)(reverse? src : dst) + spec->offset;
+
+  for (r = 0; r < nr; r += count) {
+    count = nr - r < RECORD_CHUNK? nr - r : RECORD_CHUNK;
+    for (f = 0, start = 0; f <= spec->num_fields && start < rs;
+         ++f, start += width) {
+      width = f < spec->num_fields? spec->field_sizes[f] : rs - start;
+      if (spec->split_bytes)
+        for (b = start; b < start + width; ++b)
+          move_field(raw + r*rs + b, xformed + b*nr + r, 1, rs, count,
+                     reverse);
+      else
+        move_field(raw + r*rs + start, xformed + start*nr + r*width,
+                   width, rs, count, reverse);
+    }
+  }
+}
+
+/* Bit planes.
+ *
+ * A region of len bytes (a multiple of 8) is split into eight planes of
+ * len/8 bytes, plane k holding bit k of every byte: bit b of byte j of the
+ * plane is bit k of byte 8*j+b of the region. Each group of eight bytes is
+ * thus an 8x8 bit matrix to be transposed. With SSE2, sixteen bytes at a time
+ * are split by repeatedly taking the top bit of every byte with movemask and
+ * shifting the next one up, and joined by comparing a broadcast plane byte
+ * against the bit each output byte is to take.
+ */
+
+/* Transposes the 8x8 bit matrix whose rows are the bytes of x, least
+ * significant first.
+ */
+static inline uint64_t transpose_bits(uint64_t x) {
+  uint64_t t;
+
+  t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAull;
+  x ^= t ^ (t << 7);
+  t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCull;
+  x ^= t ^ (t << 14);
+  t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ull;
+  x ^= t ^ (t << 28);
+  return x;
+}
+
+void drachen_split_bitplanes(unsigned char* dst, const unsigned char* src,
+                             uint32_t len) {
+  uint32_t plane = len / 8, i = 0;
+  uint64_t x;
+  unsigned b;
+#ifdef __SSE2__
+  __m128i v;
+  unsigned k, m;
+
+  for (; i + 16 <= len; i += 16) {
+    v = _mm_loadu_si128((const __m128i*)(src + i));
+    for (k = 8; k-- > 0; ) {
+      m = _mm_movemask_epi8(v);
+      dst[k*plane + i/8] = m;
+      dst[k*plane + i/8 + 1] = m >> 8;
+      v = _mm_add_epi8(v, v);
+    }
+  }
+#endif
+
+  for (; i < len; i += 8) {
+    for (b = 0, x = 0; b < 8; ++b)
+      x |= (uint64_t)src[i+b] << 8*b;
+    x = transpose_bits(x);
+    for (b = 0; b < 8; ++b)
+      dst[b*plane + i/8] = x >> 8*b;
+  }
+}
+
+void drachen_join_bitplanes(unsigned char* dst, const unsigned char* src,
+                            uint32_t len) {
+  uint32_t i = 0;
+#ifdef __SSE2__
+  uint32_t plane = len / 8;
+  const __m128i bits = _mm_set1_epi64x(0x8040201008040201ll);
+  __m128i v, acc;
+  uint64_t lo, hi;
+  unsigned k;
+
+  for (; i + 16 <= len; i += 16) {
+    acc = _mm_setzero_si128();
+    for (k = 0; k < 8; ++k) {
+      lo = src[k*plane + i/8] * 0x0101010101010101ull;
+      hi = src[k*plane + i/8 + 1] * 0x0101010101010101ull;
+      v = _mm_set_epi64x((long long)hi, (long long)lo);
+      v = _mm_cmpeq_epi8(_mm_and_si128(v, bits), bits);
+      acc = _mm_or_si128(acc, _mm_and_si128(v, _mm_set1_epi8(1 << k)));
+    }
+    _mm_storeu_si128((__m128i*)(dst + i), acc);
+  }
+#endif
+
+  for (; i < len; i += 8)
+    drachen_join_bitplane_group(dst + i, src, len, i/8);
+}
+
+void drachen_join_bitplane_group(unsigned char* dst, const unsigned char* src,
+                                 uint32_t len, uint32_t group) {
+  uint32_t plane = len / 8;
+  uint64_t x;
+  unsigned b;
+
+  for (b = 0, x = 0; b < 8; ++b)
+    x |= (uint64_t)src[b*plane + group] << 8*b;
+  x = transpose_bits(x);
+  for (b = 0; b < 8; ++b)
+    dst[b] = x >> 8*b;
+}
+
+void drachen_transform_frame(unsigned char* out, const unsigned char* in,
+                             const drachen_encoder* enc) {
+  uint32_t i;
+
+  if (enc->plan)
+    apply_plan(out, in, enc->plan);
+  else if (enc->xform)
+    for (i = 0; i < enc->frame_size; ++i)
+      out[i] = in[enc->xform[i]];
+  else if (enc->xform_is_identity)
+    memcpy(out, in, enc->frame_size);
+  else if (enc->xform_spec.kind == DRACHEN_XFORM_RECORD)
+    record_xform(out, in, &enc->xform_spec, enc->frame_size, 0);
+  else
+    image_xform(out, in, &enc->xform_spec, enc->frame_size, 0);
+
+  if (has_bitplanes(enc)) {
+    i = enc->params.bitplane_end - enc->params.bitplane_begin;
+    memcpy(enc->bitplane_frame, out + enc->params.bitplane_begin, i);
+    drachen_split_bitplanes(out + enc->params.bitplane_begin,
+                            enc->bitplane_frame, i);
+  }
+}
+
+void drachen_untransform_frame(unsigned char* out, const unsigned char* in,
+                               const drachen_encoder* enc) {
+  uint32_t i, begin = enc->params.bitplane_begin;
+  uint32_t end = enc->params.bitplane_end;
+  unsigned char* joined;
+
+  /* Join the bit planes first, straight into the output if there is nothing
+   * else to do.
+   */
+  if (has_bitplanes(enc)) {
+    joined = enc->xform_is_identity? out : enc->bitplane_frame;
+    memcpy(joined, in, begin);
+    drachen_join_bitplanes(joined + begin, in + begin, end - begin);
+    memcpy(joined + end, in + end, enc->frame_size - end);
+    if (enc->xform_is_identity)
+      return;
+
+    in = joined;
+  }
+
+  if (enc->plan)
+    apply_plan(out, in, enc->plan);
+  else if (enc->xform)
+    for (i = 0; i < enc->frame_size; ++i)
+      out[i] = in[enc->xform[i]];
+  else if (enc->xform_is_identity)
+    memcpy(out, in, enc->frame_size);
+  else if (enc->xform_spec.kind == DRACHEN_XFORM_RECORD)
+    record_xform(out, in, &enc->xform_spec, enc->frame_size, 1);
+  else
+    image_xform(out, in, &enc->xform_spec, enc->frame_size, 1);
+}